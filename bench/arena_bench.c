@@ -0,0 +1,94 @@
+/*
+ * Licensed to Cloudkick, Inc under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * Cloudkick licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * The allocations behind one message of a long-running sender (libckl,
+ * the daemon): the fields, tags, URL and signed form parameters, each
+ * strdup()ed and freed one by one as before, against the same strings
+ * from an arena that is reset after every message.
+ *
+ *   arena_bench [messages]
+ */
+
+#include "src/ckl.h"
+#include "bench.h"
+#include <stdio.h>
+
+#define FIELDS 24
+
+static const char *fields[FIELDS] = {
+  "web-14.example.com", "deploy", "Rolled out api 2.4.1 to the canary pool",
+  "service=api", "tool=deployer", "env=prod",
+  "https://api.cloudkick.com/changelog/1.0/", "hostname=web-14.example.com",
+  "secret=0123456789abcdef", "username=deploy", "ts=1790000000",
+  "msg=Rolled out api 2.4.1 to the canary pool", "tags=service=api",
+  "oauth_consumer_key=3f1e9a", "oauth_nonce=a81b3c9d0e", "oauth_signature_method=HMAC-SHA1",
+  "oauth_timestamp=1790000000", "oauth_version=1.0", "oauth_signature=Zm9vYmFy",
+  "/tmp/ckl.a8Fj2k", "/proc/self/fd/5", "gzip", "script.log", "script.idx"
+};
+
+static double run_malloc(int messages)
+{
+  char *p[FIELDS];
+  double start = bench_now();
+  int i, j;
+
+  for (i = 0; i < messages; i++) {
+    for (j = 0; j < FIELDS; j++) {
+      p[j] = strdup(fields[j]);
+    }
+    for (j = 0; j < FIELDS; j++) {
+      free(p[j]);
+    }
+  }
+
+  return bench_now() - start;
+}
+
+static double run_arena(int messages)
+{
+  ckl_arena_t a;
+  volatile char *sink;
+  double start = bench_now();
+  int i, j;
+
+  memset(&a, 0, sizeof(a));
+  for (i = 0; i < messages; i++) {
+    for (j = 0; j < FIELDS; j++) {
+      sink = ckl_arena_strdup(&a, fields[j]);
+    }
+    ckl_arena_reset(&a);
+  }
+  ckl_arena_free(&a);
+  (void)sink;
+
+  return bench_now() - start;
+}
+
+int main(int argc, char *const *argv)
+{
+  int messages = argc > 1 ? atoi(argv[1]) : 1000000;
+  double m = run_malloc(messages);
+  double a = run_arena(messages);
+
+  fprintf(stdout, "%d messages, %d allocations each\n", messages, FIELDS);
+  fprintf(stdout, "%-8s %10s\n", "alloc", "ns/msg");
+  fprintf(stdout, "%-8s %10.1f\n", "malloc", m * 1e9 / messages);
+  fprintf(stdout, "%-8s %10.1f\n", "arena", a * 1e9 / messages);
+
+  return 0;
+}
@@ -0,0 +1,124 @@
+/*
+ * Licensed to Cloudkick, Inc under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * Cloudkick licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "bench.h"
+#include <stdlib.h>
+#include <sys/time.h>
+
+/* no line of any kind is longer */
+#define BENCH_LINE_MAX 256
+
+double bench_now(void)
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* the i-th line of a session of the kind */
+static int session_line(char *buf, bench_session_e kind, unsigned int i)
+{
+  switch (kind) {
+    case BENCH_SESSION_MIXED:
+      switch (i % 6) {
+        case 0:
+          return sprintf(buf, "\033[01;32mroot@web%02u\033[00m:\033[01;34m/etc/nginx\033[00m# ls -l\r\n", i % 17);
+        case 1:
+          return sprintf(buf, "-rw-r--r-- 1 root root %6u Jan %2u 12:%02u site-%u.conf\r\n",
+                         (i * 7919) % 100000, i % 28 + 1, i % 60, i % 300);
+        case 2:
+          return sprintf(buf, "gcc -Wall -O2 -c src/mod_%u.c -o build/mod_%u.o\r\n", i % 97, i % 97);
+        case 3:
+          return sprintf(buf, "src/mod_%u.c:%u: \033[01;35mwarning:\033[0m unused variable 'x%u'\r\n",
+                         i % 97, i % 400, i % 13);
+        case 4:
+          return sprintf(buf, "\r%3u%% [=========>          ] %u kB/s", i % 101, (i * 31) % 9000);
+        default:
+          return sprintf(buf, "Setting up libfoo%u (1.%u.%u-%u) ...\r\n", i % 50, i % 9, i % 30, i % 4);
+      }
+
+    case BENCH_SESSION_NOISY:
+      if (i % 4 == 0) {
+        return sprintf(buf, "\r\033[K%3u%% [\033[32m=================>\033[0m          ] %u kB/s",
+                       i % 101, (i * 31) % 9000);
+      }
+      if (i % 4 == 1) {
+        return sprintf(buf, "\033[01;35mwarning:\033[0m unused variable 'x%u' in src/mod_%u.c\r\n",
+                       i % 13, i % 97);
+      }
+      /* fall through */
+
+    case BENCH_SESSION_BUILD:
+      return sprintf(buf, "gcc -Wall -O2 -Iinclude -DNDEBUG -c src/module_%u.c -o build/module_%u.o (%u)\r\n",
+                     i % 97, i % 97, i * 7919 % 100000);
+
+    case BENCH_SESSION_DIFF:
+      return sprintf(buf, "%c    listen_backlog = %u; /* worker %u */\n",
+                     "+- "[i % 3], i * 7919 % 100000, i % 64);
+  }
+
+  return 0;
+}
+
+char *bench_session(bench_session_e kind, size_t size, size_t *len)
+{
+  char *buf = malloc(size + BENCH_LINE_MAX);
+  size_t off = 0;
+  unsigned int i = 0;
+
+  while (off < size) {
+    off += session_line(buf + off, kind, i++);
+  }
+
+  *len = off;
+  return buf;
+}
+
+size_t bench_session_write(FILE *fp, bench_session_e kind, size_t size)
+{
+  char line[BENCH_LINE_MAX];
+  size_t off = 0;
+  unsigned int i = 0;
+
+  while (off < size) {
+    int n = session_line(line, kind, i++);
+    fwrite(line, 1, n, fp);
+    off += n;
+  }
+
+  return off;
+}
+
+char *bench_read_file(const char *path, size_t *len)
+{
+  FILE *fp = fopen(path, "r");
+  char *buf;
+  long l;
+
+  if (fp == NULL) {
+    perror("fopen");
+    exit(EXIT_FAILURE);
+  }
+
+  fseek(fp, 0, SEEK_END);
+  l = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+  buf = malloc(l);
+  *len = fread(buf, 1, l, fp);
+  fclose(fp);
+  return buf;
+}
@@ -0,0 +1,54 @@
+/*
+ * Licensed to Cloudkick, Inc under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * Cloudkick licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _bench_h_
+#define _bench_h_
+
+#include <stdio.h>
+#include <stddef.h>
+
+/**
+ * What the benchmarks share: a wall clock, and synthetic output to push
+ * through the code under test, so that they all measure the same kind
+ * of session.
+ */
+
+typedef enum {
+  /* prompts, ls -l listings, compiler output with colour, and progress
+   * bar redraws */
+  BENCH_SESSION_MIXED,
+  /* one compiler command line after another, all plain text */
+  BENCH_SESSION_BUILD,
+  /* half progress bar redraws and coloured warnings, half plain */
+  BENCH_SESSION_NOISY,
+  /* the lines of a configuration diff, as pasted into a message */
+  BENCH_SESSION_DIFF
+} bench_session_e;
+
+/* seconds, from an arbitrary start */
+double bench_now(void);
+
+/* at least size bytes of the kind, in memory; *len is how many */
+char *bench_session(bench_session_e kind, size_t size, size_t *len);
+
+/* the same, written to fp; returns how many bytes */
+size_t bench_session_write(FILE *fp, bench_session_e kind, size_t size);
+
+/* a recorded session given on the command line, in memory */
+char *bench_read_file(const char *path, size_t *len);
+
+#endif
@@ -0,0 +1,88 @@
+/*
+ * Licensed to Cloudkick, Inc under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * Cloudkick licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Pushes a shell session through the capture path at each compression
+ * level and reports throughput and compression ratio.
+ *
+ *   capture_bench [session.log]
+ *
+ * Without an argument a synthetic session is generated: prompts, ls -l
+ * listings, compiler output with colour, and progress bar redraws.
+ */
+
+#include "src/ckl.h"
+#include "bench.h"
+#include <stdio.h>
+
+#define SYNTH_SIZE (64 * 1024 * 1024)
+#define CHUNK_SIZE 4096
+
+int main(int argc, char *const *argv)
+{
+  static const int levels[] = {0, 1, 3, 6, 9};
+  ckl_conf_t conf;
+  size_t len;
+  size_t i;
+  char *input;
+
+  if (argc > 1) {
+    input = bench_read_file(argv[1], &len);
+  }
+  else {
+    input = bench_session(BENCH_SESSION_MIXED, SYNTH_SIZE, &len);
+  }
+
+  fprintf(stdout, "input: %.1f MB\n", len / 1048576.0);
+  fprintf(stdout, "%-6s %10s %10s %8s\n", "level", "MB/s", "out MB", "ratio");
+
+  for (i = 0; i < sizeof(levels) / sizeof(levels[0]); i++) {
+    ckl_capture_t c;
+    char *path;
+    FILE *fd;
+    size_t off;
+    double start, elapsed;
+
+    memset(&conf, 0, sizeof(conf));
+    conf.script_compress = levels[i];
+
+    if (ckl_tmp_file(&path, &fd) < 0) {
+      return EXIT_FAILURE;
+    }
+
+    start = bench_now();
+    ckl_capture_init(&c, &conf, fileno(fd), -1, -1);
+    for (off = 0; off < len; off += CHUNK_SIZE) {
+      size_t n = len - off < CHUNK_SIZE ? len - off : CHUNK_SIZE;
+      ckl_capture_write(&c, input + off, n);
+    }
+    ckl_capture_finish(&c);
+    elapsed = bench_now() - start;
+
+    fprintf(stdout, "%-6d %10.1f %10.2f %7.1fx\n", levels[i],
+            c.log.bytes_in / 1048576.0 / elapsed,
+            c.log.bytes_out / 1048576.0,
+            (double)c.log.bytes_in / c.log.bytes_out);
+
+    fclose(fd);
+    unlink(path);
+    free(path);
+  }
+
+  free(input);
+  return 0;
+}
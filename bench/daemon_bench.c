@@ -0,0 +1,312 @@
+/*
+ * Licensed to Cloudkick, Inc under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * Cloudkick licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Compares many concurrent recorded sessions with one native recorder
+ * process each against the same sessions multiplexed by the recording
+ * daemon.
+ *
+ *   daemon_bench [sessions] [seconds]
+ *
+ * Every session's "shell" is this program again, printing a line every
+ * 20ms like a busy interactive session.  The harness plays all the
+ * users' terminals.  Only the recorder side is counted: the native
+ * recorders in one case, the daemon plus the waiting `ckl -s` clients in
+ * the other.  Memory is PSS, so shared library pages are not counted once
+ * per process.  Linux only.
+ */
+
+#include "src/ckl.h"
+#include "bench.h"
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <pty.h>
+#include <utmp.h>
+
+#define LINE_INTERVAL_MS 20
+#define SOCKET_PATH "/tmp/ckl_daemon_bench.sock"
+
+typedef struct bench_usage_t {
+  pid_t pid;
+  struct rusage ru;
+} bench_usage_t;
+
+/* the recorded "shell": build output at a steady trickle */
+static int workload(int seconds)
+{
+  char line[128];
+  double end = bench_now() + seconds;
+  unsigned int i = 0;
+
+  while (bench_now() < end) {
+    int n = snprintf(line, sizeof(line),
+                     "\033[32mCC\033[0m src/module_%u.c -> build/module_%u.o (%u warnings)\r\n",
+                     i % 97, i % 97, i % 3);
+    if (write(STDOUT_FILENO, line, n) < 0) {
+      return 1;
+    }
+    usleep(LINE_INTERVAL_MS * 1000);
+    i++;
+  }
+
+  return 0;
+}
+
+static void bench_conf(ckl_conf_t *conf)
+{
+  memset(conf, 0, sizeof(*conf));
+  conf->script_native = 1;
+  conf->script_compress = 6;
+  conf->script_normalize = 1;
+}
+
+static void report_usage(int fd)
+{
+  bench_usage_t u;
+
+  u.pid = getpid();
+  getrusage(RUSAGE_SELF, &u.ru);
+  if (write(fd, &u, sizeof(u)) < 0) {
+    perror("write");
+  }
+}
+
+static void recorder(int spty, int usage_fd, const char *daemon_socket)
+{
+  ckl_conf_t conf;
+  ckl_script_t *s = calloc(1, sizeof(ckl_script_t));
+  ckl_msg_t *msg = calloc(1, sizeof(ckl_msg_t));
+
+  if (login_tty(spty) != 0) {
+    _exit(EXIT_FAILURE);
+  }
+
+  bench_conf(&conf);
+  conf.daemon_socket = daemon_socket;
+
+  if (ckl_script_init(s, &conf, msg) < 0 || ckl_script_record(s, msg) < 0) {
+    _exit(EXIT_FAILURE);
+  }
+
+  report_usage(usage_fd);
+  ckl_script_free(s);
+  _exit(EXIT_SUCCESS);
+}
+
+/* PSS in kB from /proc, 0 if it is gone */
+static unsigned long pss_kb(pid_t pid)
+{
+  char path[64];
+  char line[256];
+  unsigned long kb = 0;
+  FILE *fp;
+
+  snprintf(path, sizeof(path), "/proc/%d/smaps_rollup", (int)pid);
+  fp = fopen(path, "r");
+  if (fp == NULL) {
+    return 0;
+  }
+
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    if (sscanf(line, "Pss: %lu kB", &kb) == 1) {
+      break;
+    }
+  }
+
+  fclose(fp);
+  return kb;
+}
+
+static double cpu_seconds(const struct rusage *ru)
+{
+  return ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1e6 +
+         ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1e6;
+}
+
+static void run(const char *name, int sessions, int seconds, int use_daemon)
+{
+  struct pollfd *pfd = calloc(sessions, sizeof(struct pollfd));
+  pid_t *pids = calloc(sessions + 1, sizeof(pid_t));
+  int usage[2];
+  int open_count = sessions;
+  unsigned long pss = 0;
+  unsigned long pss_daemon = 0;
+  unsigned long long bytes = 0;
+  double cpu = 0;
+  double sampled = 0;
+  double start;
+  pid_t daemon_pid = 0;
+  bench_usage_t u;
+  char buf[65536];
+  int i;
+
+  if (pipe(usage) < 0) {
+    perror("pipe");
+    exit(EXIT_FAILURE);
+  }
+  fcntl(usage[0], F_SETFD, FD_CLOEXEC);
+  fcntl(usage[1], F_SETFD, FD_CLOEXEC);
+
+  if (use_daemon) {
+    daemon_pid = fork();
+    if (daemon_pid == 0) {
+      ckl_conf_t conf;
+      bench_conf(&conf);
+      conf.daemon_socket = SOCKET_PATH;
+      ckl_daemon_run(&conf);
+      report_usage(usage[1]);
+      _exit(EXIT_SUCCESS);
+    }
+    for (i = 0; i < 100 && access(SOCKET_PATH, F_OK) != 0; i++) {
+      usleep(10000);
+    }
+  }
+
+  start = bench_now();
+
+  for (i = 0; i < sessions; i++) {
+    struct winsize win;
+    int mpty, spty;
+
+    memset(&win, 0, sizeof(win));
+    win.ws_row = 24;
+    win.ws_col = 80;
+    if (openpty(&mpty, &spty, NULL, NULL, &win) != 0) {
+      perror("openpty");
+      exit(EXIT_FAILURE);
+    }
+    fcntl(mpty, F_SETFD, FD_CLOEXEC);
+
+    pids[i] = fork();
+    if (pids[i] == 0) {
+      recorder(spty, usage[1], use_daemon ? SOCKET_PATH : NULL);
+    }
+    close(spty);
+
+    pfd[i].fd = mpty;
+    pfd[i].events = POLLIN;
+  }
+
+  /* play every user's terminal until all sessions are over */
+  while (open_count > 0) {
+    int n = poll(pfd, sessions, 1000);
+
+    if (n < 0 && errno != EINTR) {
+      perror("poll");
+      exit(EXIT_FAILURE);
+    }
+
+    if (sampled == 0 && bench_now() - start > seconds / 2.0) {
+      for (i = 0; i < sessions; i++) {
+        pss += pss_kb(pids[i]);
+      }
+      if (daemon_pid) {
+        pss_daemon = pss_kb(daemon_pid);
+      }
+      sampled = 1;
+    }
+
+    for (i = 0; i < sessions && n > 0; i++) {
+      ssize_t rv;
+
+      if (pfd[i].fd < 0 || pfd[i].revents == 0) {
+        continue;
+      }
+      rv = read(pfd[i].fd, buf, sizeof(buf));
+      if (rv < 0 && errno == EINTR) {
+        continue;
+      }
+      if (rv <= 0) {
+        close(pfd[i].fd);
+        pfd[i].fd = -1;
+        open_count--;
+        continue;
+      }
+      bytes += rv;
+    }
+  }
+
+  for (i = 0; i < sessions; i++) {
+    waitpid(pids[i], NULL, 0);
+  }
+
+  if (daemon_pid) {
+    kill(daemon_pid, SIGTERM);
+    waitpid(daemon_pid, NULL, 0);
+  }
+
+  close(usage[1]);
+  while (read(usage[0], &u, sizeof(u)) == sizeof(u)) {
+    cpu += cpu_seconds(&u.ru);
+  }
+  close(usage[0]);
+
+  fprintf(stdout, "%-7s %8d %9.2f %12.2f %10.1f %12.1f %12.1f %8.1f\n",
+          name, sessions, cpu, cpu * 1000 / sessions,
+          (pss + pss_daemon) / 1024.0, (double)pss / sessions,
+          (double)pss_daemon / sessions, bytes / 1048576.0);
+
+  free(pfd);
+  free(pids);
+}
+
+int main(int argc, char *const *argv)
+{
+  int sessions = argc > 1 ? atoi(argv[1]) : 200;
+  int seconds = argc > 2 ? atoi(argv[2]) : 10;
+  const char *w = getenv("CKL_BENCH_WORKLOAD");
+  char self[PATH_MAX];
+  char env[32];
+  struct rlimit rl;
+
+  if (w != NULL) {
+    return workload(atoi(w));
+  }
+
+  if (realpath(argv[0], self) == NULL) {
+    perror("realpath");
+    return EXIT_FAILURE;
+  }
+
+  /* the recorders start this program as the user's shell */
+  snprintf(env, sizeof(env), "%d", seconds);
+  setenv("CKL_BENCH_WORKLOAD", env, 1);
+  setenv("SHELL", self, 1);
+
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+
+  fprintf(stdout, "%-7s %8s %9s %12s %10s %12s %12s %8s\n", "mode", "sessions",
+          "cpu s", "cpu ms/sess", "pss MB", "procs kB/sess", "daemon kB/sess", "MB out");
+
+  run("native", sessions, seconds, 0);
+  run("daemon", sessions, seconds, 1);
+
+  return 0;
+}
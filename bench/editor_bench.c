@@ -0,0 +1,117 @@
+/*
+ * Licensed to Cloudkick, Inc under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * Cloudkick licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Reads back an edited log message the size of a pasted diff, with
+ * ckl_editor_read_file and with the line by line concatenation it
+ * replaced.
+ *
+ *   editor_bench [max MB]
+ *
+ * The old reader is quadratic, so it only runs up to OLD_MAX_SIZE.
+ */
+
+#include "src/ckl.h"
+#include "bench.h"
+#include <stdio.h>
+
+#define OLD_MAX_SIZE (2 * 1024 * 1024)
+
+static char *synth_message(size_t size)
+{
+  char *path;
+  FILE *fp;
+
+  if (ckl_tmp_file(&path, &fp) < 0) {
+    exit(EXIT_FAILURE);
+  }
+
+  fprintf(fp, "Deploy the config change below\n\n");
+  bench_session_write(fp, BENCH_SESSION_DIFF, size);
+  fprintf(fp, "\n# changelog entry:\n# (lines starting with # are ignored)");
+
+  fclose(fp);
+  return path;
+}
+
+/* the reader before ckl_editor_strip, newlines dropped as it did */
+static char *old_read_file(const char *path)
+{
+  FILE *fp = fopen(path, "r");
+  char *out = strdup("");
+  char buf[8096];
+  char *p = NULL;
+
+  while ((p = fgets(buf, sizeof(buf), fp)) != NULL) {
+    if (p[0] == '#') {
+      continue;
+    }
+
+    ckl_nuke_newlines(p);
+
+    char *t = calloc(1, strlen(out) + strlen(p) + 1);
+    strncpy(t, out, strlen(out));
+    strncpy(t+strlen(out), p, strlen(p));
+    free(out);
+    out = t;
+  }
+
+  fclose(fp);
+  return out;
+}
+
+int main(int argc, char *const *argv)
+{
+  size_t max = (argc > 1 ? strtoul(argv[1], NULL, 10) : 64) * 1048576;
+  size_t size;
+
+  fprintf(stdout, "%8s %12s %12s %10s\n", "MB", "old ms", "new ms", "new MB/s");
+
+  for (size = 256 * 1024; size <= max; size *= 2) {
+    char *path = synth_message(size);
+    ckl_msg_t m;
+    double start, old_ms = -1, new_ms;
+
+    if (size <= OLD_MAX_SIZE) {
+      start = bench_now();
+      free(old_read_file(path));
+      old_ms = (bench_now() - start) * 1000;
+    }
+
+    memset(&m, 0, sizeof(m));
+    start = bench_now();
+    if (ckl_editor_read_file(&m, path) < 0) {
+      return EXIT_FAILURE;
+    }
+    new_ms = (bench_now() - start) * 1000;
+
+    if (old_ms < 0) {
+      fprintf(stdout, "%8.2f %12s %12.2f %10.1f\n", size / 1048576.0, "-",
+              new_ms, size / 1048576.0 / (new_ms / 1000));
+    }
+    else {
+      fprintf(stdout, "%8.2f %12.2f %12.2f %10.1f\n", size / 1048576.0, old_ms,
+              new_ms, size / 1048576.0 / (new_ms / 1000));
+    }
+
+    ckl_arena_free(&m.arena);
+    unlink(path);
+    free(path);
+  }
+
+  return 0;
+}
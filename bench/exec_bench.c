@@ -0,0 +1,117 @@
+/*
+ * Licensed to Cloudkick, Inc under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * Cloudkick licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * What ckl exec adds to running a short command: ckl_exec_run with and
+ * without the output tail, against a plain fork/execvp/waitpid and
+ * against system(), which is what a wrapper script costs at least.
+ *
+ *   exec_bench [runs] [command [args]]
+ *
+ * The default command is true(1).  Its output is passed through to
+ * stdout, so the results go to stderr.
+ */
+
+#include "src/ckl.h"
+#include "bench.h"
+#include <stdio.h>
+#include <sys/wait.h>
+
+static void run_fork(char *const *argv)
+{
+  pid_t pid = fork();
+
+  if (pid == 0) {
+    execvp(argv[0], argv);
+    _exit(127);
+  }
+  waitpid(pid, NULL, 0);
+}
+
+static void run_system(const char *cmdline)
+{
+  if (system(cmdline) < 0) {
+    perror("system()");
+  }
+}
+
+static void run_exec(ckl_conf_t *conf, char *const *argv)
+{
+  ckl_exec_t e;
+
+  ckl_exec_run(&e, conf, argv);
+  ckl_exec_free(&e);
+}
+
+static void report(const char *name, double elapsed, int runs, double base)
+{
+  double us = elapsed / runs * 1e6;
+
+  if (base > 0) {
+    fprintf(stderr, "%-14s %10.1f %+10.1f\n", name, us, us - base);
+  }
+  else {
+    fprintf(stderr, "%-14s %10.1f %10s\n", name, us, "-");
+  }
+}
+
+int main(int argc, char *const *argv)
+{
+  static char *const deflt[] = {"true", NULL};
+  int runs = argc > 1 ? atoi(argv[1]) : 2000;
+  char *const *cmd = argc > 2 ? &argv[2] : deflt;
+  ckl_conf_t conf;
+  ckl_exec_t e;
+  double start, base;
+  int i;
+
+  /* a warm up run, which also gives the command line */
+  memset(&conf, 0, sizeof(conf));
+  ckl_exec_run(&e, &conf, cmd);
+  fprintf(stderr, "command: %s, %d runs\n", e.cmdline, runs);
+  fprintf(stderr, "%-14s %10s %10s\n", "runner", "us/run", "vs fork");
+
+  start = bench_now();
+  for (i = 0; i < runs; i++) {
+    run_fork(cmd);
+  }
+  base = (bench_now() - start) / runs * 1e6;
+  report("fork+exec", base * runs / 1e6, runs, 0);
+
+  start = bench_now();
+  for (i = 0; i < runs; i++) {
+    run_system(e.cmdline);
+  }
+  report("system()", bench_now() - start, runs, base);
+
+  conf.exec_tail_bytes = 0;
+  start = bench_now();
+  for (i = 0; i < runs; i++) {
+    run_exec(&conf, cmd);
+  }
+  report("exec", bench_now() - start, runs, base);
+
+  conf.exec_tail_bytes = 64 * 1024;
+  start = bench_now();
+  for (i = 0; i < runs; i++) {
+    run_exec(&conf, cmd);
+  }
+  report("exec + tail", bench_now() - start, runs, base);
+
+  ckl_exec_free(&e);
+  return 0;
+}
@@ -0,0 +1,107 @@
+/*
+ * Licensed to Cloudkick, Inc under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * Cloudkick licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * What the delivery counters add to a send: the updates a send makes to
+ * its slot in a mapped metrics file, against the same through a mutex,
+ * with 1 to 4 threads on one endpoint.
+ *
+ *   metrics_bench [iterations]
+ */
+
+#include "src/ckl.h"
+#include "bench.h"
+#include <stdio.h>
+#include <pthread.h>
+
+static ckl_metrics_t metrics;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long long locked[4];
+static long iterations = 10000000;
+
+static void *run_atomic(void *arg)
+{
+  long i;
+
+  for (i = 0; i < iterations; i++) {
+    ckl_metrics_request(&metrics, 512, i & 0xffff);
+    ckl_metrics_result(&metrics, 1);
+  }
+
+  return NULL;
+}
+
+static void *run_mutex(void *arg)
+{
+  long i;
+
+  for (i = 0; i < iterations; i++) {
+    pthread_mutex_lock(&lock);
+    locked[0]++;
+    locked[1] += i & 0xffff;
+    locked[2] += 512;
+    locked[3]++;
+    pthread_mutex_unlock(&lock);
+  }
+
+  return NULL;
+}
+
+static void run(const char *name, void *(*fn)(void *), int threads)
+{
+  pthread_t tid[4];
+  double start = bench_now();
+  double elapsed;
+  int t;
+
+  for (t = 0; t < threads; t++) {
+    pthread_create(&tid[t], NULL, fn, NULL);
+  }
+  for (t = 0; t < threads; t++) {
+    pthread_join(tid[t], NULL);
+  }
+
+  elapsed = bench_now() - start;
+  fprintf(stdout, "%-7s %7d %10.1f\n", name, threads,
+          elapsed * 1e9 / (iterations * threads));
+}
+
+int main(int argc, char *const *argv)
+{
+  char path[] = "/tmp/ckl-metrics-bench.XXXXXX";
+  int fd = mkstemp(path);
+  int t;
+
+  if (argc > 1) {
+    iterations = atol(argv[1]);
+  }
+
+  if (fd < 0 || ckl_metrics_open(&metrics, path, "http://bench") < 0) {
+    return EXIT_FAILURE;
+  }
+  close(fd);
+
+  fprintf(stdout, "%-7s %7s %10s\n", "update", "threads", "ns/send");
+  for (t = 1; t <= 4; t *= 2) {
+    run("atomic", run_atomic, t);
+    run("mutex", run_mutex, t);
+  }
+
+  ckl_metrics_close(&metrics);
+  unlink(path);
+  return 0;
+}
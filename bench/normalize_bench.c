@@ -0,0 +1,112 @@
+/*
+ * Licensed to Cloudkick, Inc under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * Cloudkick licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Runs the terminal normalizer over a session with each byte scanner and
+ * reports throughput and how much the output shrank.
+ *
+ *   normalize_bench [session.log]
+ *
+ * The synthetic sessions are plain build output, and the same output with
+ * colour and progress bar redraws mixed in.
+ */
+
+#include "src/ckl.h"
+#include "bench.h"
+#include <stdio.h>
+
+#define SYNTH_SIZE (128 * 1024 * 1024)
+#define CHUNK_SIZE 4096
+#define ROUNDS 3
+
+static int count_emit(void *baton, const char *buf, size_t len)
+{
+  *(size_t *)baton += len;
+  return 0;
+}
+
+static void run(const char *name, const char *input, size_t len)
+{
+  static const char *scanners[] = {"scalar", "sse2", "avx2"};
+  size_t i;
+
+  for (i = 0; i < sizeof(scanners) / sizeof(scanners[0]); i++) {
+    ckl_normalize_t n;
+    double best = 0;
+    size_t out = 0;
+    int r;
+
+    setenv("CKL_NORMALIZE_SCAN", scanners[i], 1);
+
+    for (r = 0; r < ROUNDS; r++) {
+      size_t off;
+      double start, elapsed;
+
+      out = 0;
+      ckl_normalize_init(&n, count_emit, &out);
+      if (strcmp(n.scan_name, scanners[i]) != 0) {
+        ckl_normalize_finish(&n);
+        break;
+      }
+
+      start = bench_now();
+      for (off = 0; off < len; off += CHUNK_SIZE) {
+        size_t l = len - off < CHUNK_SIZE ? len - off : CHUNK_SIZE;
+        ckl_normalize_write(&n, input + off, l);
+      }
+      ckl_normalize_finish(&n);
+      elapsed = bench_now() - start;
+
+      if (best == 0 || elapsed < best) {
+        best = elapsed;
+      }
+    }
+
+    if (best == 0) {
+      fprintf(stdout, "%-8s %-7s %10s\n", name, scanners[i], "n/a");
+      continue;
+    }
+
+    fprintf(stdout, "%-8s %-7s %10.2f %9.1f%%\n", name, scanners[i],
+            len / 1073741824.0 / best, 100.0 * out / len);
+  }
+}
+
+int main(int argc, char *const *argv)
+{
+  size_t len;
+  char *input;
+
+  fprintf(stdout, "%-8s %-7s %10s %10s\n", "input", "scan", "GB/s", "kept");
+
+  if (argc > 1) {
+    input = bench_read_file(argv[1], &len);
+    run("file", input, len);
+    free(input);
+    return 0;
+  }
+
+  input = bench_session(BENCH_SESSION_BUILD, SYNTH_SIZE, &len);
+  run("plain", input, len);
+  free(input);
+
+  input = bench_session(BENCH_SESSION_NOISY, SYNTH_SIZE, &len);
+  run("noisy", input, len);
+  free(input);
+
+  return 0;
+}
@@ -0,0 +1,179 @@
+/*
+ * Licensed to Cloudkick, Inc under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * Cloudkick licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Compresses a script log at upload time the way the transport does,
+ * pulling it through the read callback, with 1 to N threads, against a
+ * single zlib gzip stream.  Every output is inflated again and checked.
+ *
+ *   pgzip_bench [session.log] [level]
+ *
+ * Without a log, 256MB of synthetic build output is used.
+ */
+
+#include "src/ckl.h"
+#include "bench.h"
+#include <stdio.h>
+
+#define SYNTH_SIZE (256 * 1024 * 1024)
+#define READ_SIZE (16 * 1024)
+
+static char *synth_log()
+{
+  char *path;
+  FILE *fp;
+
+  if (ckl_tmp_file(&path, &fp) < 0) {
+    exit(EXIT_FAILURE);
+  }
+
+  bench_session_write(fp, BENCH_SESSION_BUILD, SYNTH_SIZE);
+
+  fclose(fp);
+  return path;
+}
+
+/* inflates as the output arrives, so nothing large is kept */
+typedef struct check_t {
+  z_stream zs;
+  unsigned long long in;
+  unsigned long long out;
+  char buf[READ_SIZE * 4];
+} check_t;
+
+static int check_feed(check_t *c, char *buf, size_t len)
+{
+  int rv = Z_OK;
+
+  c->in += len;
+  c->zs.next_in = (Bytef *)buf;
+  c->zs.avail_in = len;
+  while (c->zs.avail_in > 0 && rv == Z_OK) {
+    c->zs.next_out = (Bytef *)c->buf;
+    c->zs.avail_out = sizeof(c->buf);
+    rv = inflate(&c->zs, Z_NO_FLUSH);
+    c->out += sizeof(c->buf) - c->zs.avail_out;
+  }
+
+  return rv == Z_OK || rv == Z_STREAM_END ? 0 : -1;
+}
+
+static void report(const char *name, int threads, double elapsed,
+                   check_t *c, unsigned long long size)
+{
+  int ok = c->out == size && inflate(&c->zs, Z_FINISH) == Z_STREAM_END;
+
+  fprintf(stdout, "%-6s %7d %9.1f %8.1fx %s\n", name, threads,
+          size / 1048576.0 / elapsed, (double)size / c->in,
+          ok ? "ok" : "MISMATCH");
+  inflateEnd(&c->zs);
+}
+
+static void run_zlib(const char *path, int level, unsigned long long size)
+{
+  static char in[READ_SIZE];
+  static char out[READ_SIZE * 2];
+  check_t *c = calloc(1, sizeof(check_t));
+  FILE *fp = fopen(path, "r");
+  z_stream zs;
+  size_t n;
+  double start = bench_now();
+
+  inflateInit2(&c->zs, MAX_WBITS + 16);
+  memset(&zs, 0, sizeof(zs));
+  deflateInit2(&zs, level, Z_DEFLATED, MAX_WBITS + 16, 8, Z_DEFAULT_STRATEGY);
+
+  do {
+    int flush;
+    n = fread(in, 1, sizeof(in), fp);
+    flush = n < sizeof(in) ? Z_FINISH : Z_NO_FLUSH;
+    zs.next_in = (Bytef *)in;
+    zs.avail_in = n;
+    do {
+      zs.next_out = (Bytef *)out;
+      zs.avail_out = sizeof(out);
+      deflate(&zs, flush);
+      check_feed(c, out, sizeof(out) - zs.avail_out);
+    } while (zs.avail_out == 0);
+  } while (n == sizeof(in));
+
+  report("zlib", 1, bench_now() - start, c, size);
+  deflateEnd(&zs);
+  fclose(fp);
+  free(c);
+}
+
+static void run_pgzip(const char *path, int level, int threads,
+                      unsigned long long size)
+{
+  static char buf[READ_SIZE];
+  check_t *c = calloc(1, sizeof(check_t));
+  ckl_pgzip_t *z;
+  size_t n;
+  double start = bench_now();
+
+  inflateInit2(&c->zs, MAX_WBITS + 16);
+
+  z = ckl_pgzip_open(path, level, threads);
+  if (z == NULL) {
+    exit(EXIT_FAILURE);
+  }
+  while ((n = ckl_pgzip_read(buf, 1, sizeof(buf), z)) > 0) {
+    if (n == CURL_READFUNC_ABORT) {
+      exit(EXIT_FAILURE);
+    }
+    check_feed(c, buf, n);
+  }
+  ckl_pgzip_close(z);
+
+  report("pgzip", threads, bench_now() - start, c, size);
+  free(c);
+}
+
+int main(int argc, char *const *argv)
+{
+  char *path = argc > 1 ? strdup(argv[1]) : synth_log();
+  int level = argc > 2 ? atoi(argv[2]) : 6;
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  unsigned long long size;
+  FILE *fp;
+  int t;
+
+  fp = fopen(path, "r");
+  if (fp == NULL) {
+    perror(path);
+    return EXIT_FAILURE;
+  }
+  fseek(fp, 0, SEEK_END);
+  size = ftell(fp);
+  fclose(fp);
+
+  fprintf(stdout, "input: %.1f MB, level %d, %ld cores\n", size / 1048576.0,
+          level, cores);
+  fprintf(stdout, "%-6s %7s %9s %9s\n", "codec", "threads", "MB/s", "ratio");
+
+  run_zlib(path, level, size);
+  for (t = 1; t <= cores * 2; t *= 2) {
+    run_pgzip(path, level, t, size);
+  }
+
+  if (argc < 2) {
+    unlink(path);
+  }
+  free(path);
+  return 0;
+}
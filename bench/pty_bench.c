@@ -0,0 +1,394 @@
+/*
+ * Licensed to Cloudkick, Inc under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * Cloudkick licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Runs ckl_script_record headless: the harness plays the user's terminal
+ * through a PTY of its own, types commands into the recorded shell and
+ * reads back everything the recorder puts on screen.
+ *
+ *   pty_bench [MB]
+ *
+ * Workloads:
+ *   yes     a `yes` flood, large writes of identical lines
+ *   cat     cat of a file of build output
+ *   small   one write(2) per short line, like a chatty build or tail -f
+ *   keys    single keystrokes into `cat`, timing each until its echo
+ *
+ * Each workload runs with no recorder at all (the baseline), script(1)
+ * and the native recorder with and without the capture stages.  CPU is
+ * for the whole process tree, so the overhead column (CPU above the
+ * baseline) is what recording costs.  RSS is the largest process in it.
+ */
+
+#include "src/ckl.h"
+#include "bench.h"
+#include <stdio.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#ifdef __linux__
+#include <pty.h>
+#include <utmp.h>
+#else
+#ifdef __FreeBSD__
+#include <termios.h>
+#include <libutil.h>
+#else
+#include <util.h>
+#endif
+#endif
+
+#define READ_SIZE (64 * 1024)
+#define KEYSTROKES 2000
+#define SMALL_LINE "checking for sys/ioctl.h... yes\n"
+#define TIMEOUT_MS 60000
+
+enum {
+  MODE_NONE,
+  MODE_SCRIPT,
+  MODE_NATIVE,
+  MODE_NATIVE_FULL
+};
+
+static const char *mode_names[] = {"none", "script", "native", "native+gz+norm"};
+
+typedef struct bench_result_t {
+  double elapsed;
+  size_t bytes;
+  struct rusage ru;
+  double lat[KEYSTROKES];
+  int nlat;
+} bench_result_t;
+
+static void write_all(int fd, const char *buf, size_t len)
+{
+  ssize_t rv;
+
+  while (len > 0) {
+    rv = write(fd, buf, len);
+    if (rv < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("write");
+      exit(EXIT_FAILURE);
+    }
+    buf += rv;
+    len -= rv;
+  }
+}
+
+/* `pty_bench --small N` is the small write workload itself */
+static int small_writes(unsigned long count)
+{
+  unsigned long i;
+
+  for (i = 0; i < count; i++) {
+    write_all(STDOUT_FILENO, SMALL_LINE, sizeof(SMALL_LINE) - 1);
+  }
+  return 0;
+}
+
+static char *make_cat_file(size_t size)
+{
+  char *path;
+  FILE *fp;
+  size_t off = 0;
+  unsigned int i = 0;
+
+  if (ckl_tmp_file(&path, &fp) < 0) {
+    exit(EXIT_FAILURE);
+  }
+
+  while (off < size) {
+    off += fprintf(fp, "gcc -Wall -O2 -Iinclude -DNDEBUG -c src/module_%u.c -o build/module_%u.o\n",
+                   i % 97, i % 97);
+    i++;
+  }
+
+  fclose(fp);
+  return path;
+}
+
+/* the process behind the harness' terminal: a recorder, or the shell */
+static void start_recorder(int mode, int spty)
+{
+  ckl_conf_t conf;
+  ckl_script_t *s;
+  ckl_msg_t *msg;
+
+  if (login_tty(spty) != 0) {
+    perror("login_tty");
+    _exit(EXIT_FAILURE);
+  }
+
+  setenv("SHELL", "/bin/sh", 1);
+  /* keep the prompt and the command echo short and predictable */
+  setenv("PS1", "$ ", 1);
+  setenv("ENV", "/dev/null", 1);
+
+  if (mode == MODE_NONE) {
+    execl("/bin/sh", "/bin/sh", "-i", NULL);
+    _exit(EXIT_FAILURE);
+  }
+
+  memset(&conf, 0, sizeof(conf));
+  conf.script_native = mode != MODE_SCRIPT;
+  if (mode == MODE_NATIVE_FULL) {
+    conf.script_compress = 6;
+    conf.script_normalize = 1;
+  }
+
+  s = calloc(1, sizeof(ckl_script_t));
+  msg = calloc(1, sizeof(ckl_msg_t));
+
+  if (ckl_script_init(s, &conf, msg) < 0 || ckl_script_record(s, msg) < 0) {
+    _exit(EXIT_FAILURE);
+  }
+
+  ckl_script_free(s);
+  _exit(EXIT_SUCCESS);
+}
+
+static int contains(const char *buf, size_t len, const char *want, size_t wlen)
+{
+  const char *p = buf;
+  const char *end = buf + len;
+
+  while ((p = memchr(p, want[0], end - p)) != NULL) {
+    if ((size_t)(end - p) < wlen) {
+      return 0;
+    }
+    if (memcmp(p, want, wlen) == 0) {
+      return 1;
+    }
+    p++;
+  }
+  return 0;
+}
+
+/* reads from the terminal until `want` shows up, or everything to EOF */
+static size_t drain(int mpty, const char *want, int *eof)
+{
+  static char buf[READ_SIZE + 64];
+  static size_t carry = 0;
+  size_t total = 0;
+  struct pollfd pfd;
+  ssize_t rv;
+
+  pfd.fd = mpty;
+  pfd.events = POLLIN;
+
+  while (1) {
+    rv = poll(&pfd, 1, TIMEOUT_MS);
+    if (rv == 0) {
+      fprintf(stderr, "timed out waiting for the recorder\n");
+      exit(EXIT_FAILURE);
+    }
+    if (rv < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("poll");
+      exit(EXIT_FAILURE);
+    }
+
+    rv = read(mpty, buf + carry, READ_SIZE);
+    if (rv < 0 && errno == EINTR) {
+      continue;
+    }
+    if (rv <= 0) {
+      /* EIO once the last process on the slave side is gone */
+      *eof = 1;
+      carry = 0;
+      return total;
+    }
+    total += rv;
+
+    if (want) {
+      size_t wlen = strlen(want);
+      size_t have = carry + rv;
+      if (contains(buf, have, want, wlen)) {
+        carry = 0;
+        return total;
+      }
+      /* a marker may straddle two reads */
+      carry = have < wlen ? have : wlen - 1;
+      memmove(buf, buf + have - carry, carry);
+    }
+  }
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+static void run(int mode, const char *workload, const char *cmd,
+                bench_result_t *res)
+{
+  struct winsize win;
+  int mpty, spty;
+  int eof = 0;
+  int status;
+  char line[1024];
+  double start;
+  pid_t child;
+
+  memset(res, 0, sizeof(*res));
+  memset(&win, 0, sizeof(win));
+  win.ws_row = 24;
+  win.ws_col = 80;
+
+  if (openpty(&mpty, &spty, NULL, NULL, &win) != 0) {
+    perror("openpty");
+    exit(EXIT_FAILURE);
+  }
+
+  child = fork();
+  if (child < 0) {
+    perror("fork");
+    exit(EXIT_FAILURE);
+  }
+  if (child == 0) {
+    close(mpty);
+    start_recorder(mode, spty);
+  }
+  close(spty);
+
+  /* the recorder flushes pending input when it puts our terminal in raw
+   * mode, so wait for the first prompt before typing.  The echoed command
+   * line then reads RE''ADY, only its output says READY. */
+  drain(mpty, "$ ", &eof);
+  snprintf(line, sizeof(line), "echo RE''ADY; %s\n", cmd);
+  write_all(mpty, line, strlen(line));
+  drain(mpty, "READY", &eof);
+
+  start = bench_now();
+
+  if (strcmp(workload, "keys") == 0) {
+    /* the shell is now cat with echo on and no line buffering */
+    int i;
+    for (i = 0; i < KEYSTROKES && !eof; i++) {
+      double t = bench_now();
+      write_all(mpty, "x", 1);
+      drain(mpty, "x", &eof);
+      res->lat[res->nlat++] = bench_now() - t;
+    }
+    write_all(mpty, "\003", 1);
+    res->bytes = res->nlat;
+  }
+
+  while (!eof) {
+    res->bytes += drain(mpty, NULL, &eof);
+  }
+  res->elapsed = bench_now() - start;
+
+  while (wait4(child, &status, 0, &res->ru) < 0 && errno == EINTR);
+  close(mpty);
+
+  /* without a recorder the child is cat, which ^C kills */
+  if (mode != MODE_NONE && (!WIFEXITED(status) || WEXITSTATUS(status) != 0)) {
+    fprintf(stderr, "%s: recorder failed on %s\n", mode_names[mode], workload);
+  }
+}
+
+static double cpu_seconds(const struct rusage *ru)
+{
+  return ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1e6 +
+         ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1e6;
+}
+
+int main(int argc, char *const *argv)
+{
+  size_t mb = 64;
+  char self[PATH_MAX];
+  char *cat_path;
+  char cmd[3][PATH_MAX + 64];
+  const char *workloads[] = {"yes", "cat", "small", "keys"};
+  int w, m;
+
+  if (argc > 2 && strcmp(argv[1], "--small") == 0) {
+    return small_writes(strtoul(argv[2], NULL, 10));
+  }
+
+  if (argc > 1) {
+    mb = strtoul(argv[1], NULL, 10);
+  }
+
+  if (realpath(argv[0], self) == NULL) {
+    perror("realpath");
+    return EXIT_FAILURE;
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+
+  cat_path = make_cat_file(mb * 1048576);
+  snprintf(cmd[0], sizeof(cmd[0]), "yes | head -c %zu; exit", mb * 1048576);
+  snprintf(cmd[1], sizeof(cmd[1]), "cat '%s'; exit", cat_path);
+  snprintf(cmd[2], sizeof(cmd[2]), "'%s' --small %zu; exit", self,
+           mb * 1048576 / (sizeof(SMALL_LINE) - 1));
+
+  fprintf(stdout, "%-6s %-15s %9s %11s %11s %9s\n",
+          "load", "recorder", "MB/s", "cpu ms/MB", "overhead", "rss kB");
+
+  for (w = 0; w < 4; w++) {
+    double base_cpu = 0;
+
+    for (m = MODE_NONE; m <= MODE_NATIVE_FULL; m++) {
+      bench_result_t *res = malloc(sizeof(bench_result_t));
+      double cpu;
+
+      if (w == 3) {
+        run(m, workloads[w], "stty -icanon; exec cat >/dev/null", res);
+        qsort(res->lat, res->nlat, sizeof(double), cmp_double);
+        fprintf(stdout, "%-6s %-15s p50 %6.1f us  p90 %6.1f us  p99 %6.1f us  max %7.1f us %9ld\n",
+                workloads[w], mode_names[m],
+                res->lat[res->nlat / 2] * 1e6,
+                res->lat[res->nlat * 9 / 10] * 1e6,
+                res->lat[res->nlat * 99 / 100] * 1e6,
+                res->lat[res->nlat - 1] * 1e6,
+                res->ru.ru_maxrss);
+        free(res);
+        continue;
+      }
+
+      run(m, workloads[w], cmd[w], res);
+      cpu = cpu_seconds(&res->ru) * 1000 / (res->bytes / 1048576.0);
+      if (m == MODE_NONE) {
+        base_cpu = cpu;
+      }
+
+      fprintf(stdout, "%-6s %-15s %9.1f %11.2f %+11.2f %9ld\n",
+              workloads[w], mode_names[m],
+              res->bytes / 1048576.0 / res->elapsed, cpu, cpu - base_cpu,
+              res->ru.ru_maxrss);
+      free(res);
+    }
+  }
+
+  unlink(cat_path);
+  free(cat_path);
+  return 0;
+}
@@ -0,0 +1,124 @@
+/*
+ * Licensed to Cloudkick, Inc under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * Cloudkick licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Compares the write(2) and io_uring script log writers on a journaled
+ * (spooled) session, with and without gzip.
+ *
+ *   writer_bench [dir] [MB]
+ *
+ * The log goes to a file in dir (default /var/tmp, which unlike /tmp is
+ * rarely tmpfs, so the syncs reach a disk).  Input arrives in PTY sized
+ * chunks.  syscalls/MB counts the writer's write, fdatasync and
+ * io_uring_enter calls; latency is per ckl_capture_write, so it includes
+ * the group commit stalls.
+ */
+
+#include "src/ckl.h"
+#include "bench.h"
+#include <stdio.h>
+#include <fcntl.h>
+
+#define CHUNK_SIZE 4096
+
+static int cmp_double(const void *a, const void *b)
+{
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+static void run(const char *dir, const char *input, size_t len,
+                int uring, int level)
+{
+  size_t nchunks = (len + CHUNK_SIZE - 1) / CHUNK_SIZE;
+  double *lat = malloc(nchunks * sizeof(double));
+  char path[1024];
+  ckl_conf_t conf;
+  ckl_capture_t c;
+  size_t off, i;
+  double start, elapsed, mb;
+  int fd;
+
+  memset(&conf, 0, sizeof(conf));
+  conf.script_compress = level;
+  conf.script_io_uring = uring;
+  /* what the capture path does for a spooled session */
+  conf.spool_dir = dir;
+  conf.spool_sync_ms = 1000;
+  conf.spool_sync_bytes = 1024 * 1024;
+
+  snprintf(path, sizeof(path), "%s/ckl_writer_bench.%d", dir, (int)getpid());
+  fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+  if (fd < 0) {
+    perror(path);
+    exit(EXIT_FAILURE);
+  }
+
+  ckl_capture_init(&c, &conf, fd, -1, -1);
+  if (uring && c.log.out.ring == NULL) {
+    fprintf(stdout, "%-9s %5d   io_uring is not available here\n", "io_uring", level);
+    ckl_capture_finish(&c);
+    close(fd);
+    unlink(path);
+    free(lat);
+    return;
+  }
+
+  start = bench_now();
+  for (off = 0, i = 0; off < len; off += CHUNK_SIZE, i++) {
+    size_t n = len - off < CHUNK_SIZE ? len - off : CHUNK_SIZE;
+    double t = bench_now();
+    ckl_capture_write(&c, input + off, n);
+    lat[i] = bench_now() - t;
+  }
+  ckl_capture_finish(&c);
+  elapsed = bench_now() - start;
+
+  qsort(lat, nchunks, sizeof(double), cmp_double);
+  mb = len / 1048576.0;
+
+  fprintf(stdout, "%-9s %5d %8.1f %11.1f %9.1f %9.1f %9.1f %9.1f\n",
+          uring ? "io_uring" : "write", level, mb / elapsed,
+          c.log.out.calls / mb,
+          lat[nchunks / 2] * 1e6, lat[nchunks * 99 / 100] * 1e6,
+          lat[nchunks * 999 / 1000] * 1e6, lat[nchunks - 1] * 1e6);
+
+  close(fd);
+  unlink(path);
+  free(lat);
+}
+
+int main(int argc, char *const *argv)
+{
+  const char *dir = argc > 1 ? argv[1] : "/var/tmp";
+  size_t mb = argc > 2 ? strtoul(argv[2], NULL, 10) : 256;
+  static const int levels[] = {0, 6};
+  size_t len, i;
+  char *input = bench_session(BENCH_SESSION_BUILD, mb * 1048576, &len);
+
+  fprintf(stdout, "%-9s %5s %8s %11s %9s %9s %9s %9s\n", "writer", "level",
+          "MB/s", "syscalls/MB", "p50 us", "p99 us", "p99.9 us", "max us");
+
+  for (i = 0; i < sizeof(levels) / sizeof(levels[0]); i++) {
+    run(dir, input, len, 0, levels[i]);
+    run(dir, input, len, 1, levels[i]);
+  }
+
+  free(input);
+  return 0;
+}
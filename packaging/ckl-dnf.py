@@ -0,0 +1,86 @@
+# Licensed to Cloudkick, Inc under one or more
+# contributor license agreements.  See the NOTICE file distributed with
+# this work for additional information regarding copyright ownership.
+# Cloudkick licenses this file to You under the Apache License, Version 2.0
+# (the "License"); you may not use this file except in compliance with
+# the License.  You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# Logs each dnf transaction as one ckl entry, in the format of
+# ckl-pkg-hook.  Installed in dnf's plugin directory as ckl.py, enabled
+# by /etc/dnf/plugins/ckl.conf.  ckl runs detached once the transaction
+# is done, so dnf does not wait for the endpoint.
+
+import os
+import subprocess
+import tempfile
+import time
+
+import dnf
+import dnf.transaction
+
+CKL = "/usr/bin/ckl"
+
+UPGRADES = (dnf.transaction.PKG_UPGRADE, dnf.transaction.PKG_DOWNGRADE)
+REPLACED = (dnf.transaction.PKG_UPGRADED, dnf.transaction.PKG_DOWNGRADED,
+            dnf.transaction.PKG_OBSOLETED)
+INSTALLS = (dnf.transaction.PKG_INSTALL, dnf.transaction.PKG_REINSTALL)
+REMOVES = (dnf.transaction.PKG_REMOVE,)
+
+def _name(pkg):
+  return "%s.%s" % (pkg.name, pkg.arch)
+
+class Ckl(dnf.Plugin):
+  name = "ckl"
+
+  def __init__(self, base, cli):
+    super(Ckl, self).__init__(base, cli)
+    self.start = None
+
+  def pre_transaction(self):
+    self.start = time.time()
+
+  def transaction(self):
+    try:
+      self._log()
+    except Exception as e:
+      dnf.logger.debug("ckl: not logged: %s", e)
+
+  def _log(self):
+    items = list(self.base.transaction)
+    old = dict((_name(i.pkg), i.pkg) for i in items if i.action in REPLACED)
+    lines = []
+    count = {"upgrade": 0, "install": 0, "remove": 0}
+    for i in items:
+      if i.action in UPGRADES and _name(i.pkg) in old:
+        lines.append("upgrade %s %s -> %s" % (_name(i.pkg), old[_name(i.pkg)].evr, i.pkg.evr))
+        count["upgrade"] += 1
+      elif i.action in INSTALLS or i.action in UPGRADES:
+        lines.append("install %s %s" % (_name(i.pkg), i.pkg.evr))
+        count["install"] += 1
+      elif i.action in REMOVES:
+        lines.append("remove %s %s" % (_name(i.pkg), i.pkg.evr))
+        count["remove"] += 1
+    if not lines:
+      return
+    lines.sort(key=lambda l: l.split(" ")[1])
+    secs = time.time() - (self.start or time.time())
+
+    # on a file, not a pipe, so nothing waits for ckl
+    tmp = tempfile.TemporaryFile()
+    tmp.write(("dnf: %d upgraded, %d installed, %d removed in %ds\n" %
+               (count["upgrade"], count["install"], count["remove"], secs)).encode("utf-8"))
+    tmp.write(("\n".join(lines) + "\n").encode("utf-8"))
+    tmp.seek(0)
+    with open(os.devnull, "w") as devnull:
+      subprocess.Popen([CKL, "-m", "-", "-t", "source=dnf"], stdin=tmp,
+                       stdout=devnull, stderr=devnull, close_fds=True,
+                       start_new_session=True)
+    tmp.close()
@@ -0,0 +1,77 @@
+# Licensed to Cloudkick, Inc under one or more
+# contributor license agreements.  See the NOTICE file distributed with
+# this work for additional information regarding copyright ownership.
+# Cloudkick licenses this file to You under the Apache License, Version 2.0
+# (the "License"); you may not use this file except in compliance with
+# the License.  You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# Logs each yum transaction as one ckl entry, in the format of
+# ckl-pkg-hook.  Installed as /usr/lib/yum-plugins/ckl.py, enabled by
+# /etc/yum/pluginconf.d/ckl.conf.  ckl runs detached once the
+# transaction is done, so yum does not wait for the endpoint.
+
+import os
+import subprocess
+import tempfile
+import time
+
+from yum.plugins import TYPE_CORE
+from yum.constants import TS_INSTALL, TS_TRUEINSTALL, TS_UPDATE, \
+     TS_OBSOLETING, TS_ERASE
+
+requires_api_version = '2.3'
+plugin_type = (TYPE_CORE,)
+
+CKL = "/usr/bin/ckl"
+
+_start = None
+
+def pretrans_hook(conduit):
+  global _start
+  _start = time.time()
+
+def _name(po):
+  return "%s.%s" % (po.name, po.arch)
+
+def _send(tool, lines, count, secs):
+  """Hands the entry to ckl on a file, not a pipe, so nothing waits."""
+  tmp = tempfile.TemporaryFile()
+  tmp.write("%s: %d upgraded, %d installed, %d removed in %ds\n" %
+            (tool, count["upgrade"], count["install"], count["remove"], secs))
+  tmp.write("\n".join(lines) + "\n")
+  tmp.seek(0)
+  devnull = open(os.devnull, "w")
+  subprocess.Popen([CKL, "-m", "-", "-t", "source=" + tool], stdin=tmp,
+                   stdout=devnull, stderr=devnull, close_fds=True,
+                   preexec_fn=os.setsid)
+  tmp.close()
+  devnull.close()
+
+def posttrans_hook(conduit):
+  try:
+    lines = []
+    count = {"upgrade": 0, "install": 0, "remove": 0}
+    for m in conduit.getTsInfo().getMembers():
+      old = (m.updates or m.obsoletes or [None])[0]
+      if m.output_state in (TS_UPDATE, TS_OBSOLETING) and old is not None:
+        lines.append("upgrade %s %s -> %s" % (_name(m.po), old.printVer(), m.po.printVer()))
+        count["upgrade"] += 1
+      elif m.output_state in (TS_INSTALL, TS_TRUEINSTALL, TS_UPDATE, TS_OBSOLETING):
+        lines.append("install %s %s" % (_name(m.po), m.po.printVer()))
+        count["install"] += 1
+      elif m.output_state == TS_ERASE:
+        lines.append("remove %s %s" % (_name(m.po), m.po.printVer()))
+        count["remove"] += 1
+    if lines:
+      lines.sort(key=lambda l: l.split(" ")[1])
+      _send("yum", lines, count, time.time() - (_start or time.time()))
+  except Exception, e:
+    conduit.info(2, "ckl: not logged: %s" % e)
@@ -0,0 +1,224 @@
+/*
+ * Licensed to Cloudkick, Inc under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * Cloudkick licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ckl.h"
+#include <stdio.h>
+#include <stdarg.h>
+
+/**
+ * Bump allocator for the strings and arrays that live as long as a conf,
+ * a message or one request of a transport.  Allocations are carved out
+ * of 4k blocks and never freed one by one; ckl_arena_free() releases the
+ * lot, and ckl_arena_reset() does too but keeps a block for the next
+ * round, so a long-lived transport stops going to malloc at all.
+ *
+ * Buffers that grow with realloc (a message read from the editor) are
+ * handed to the arena with ckl_arena_own() and freed along with it.
+ *
+ * A zeroed ckl_arena_t is empty and ready to use.
+ */
+
+#define ARENA_ALIGN 16
+#define ARENA_HEADER ((sizeof(ckl_arena_block_t) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+#define ARENA_BLOCK_SIZE 4096
+/* past this a request gets a block of its own */
+#define ARENA_BIG (ARENA_BLOCK_SIZE / 4)
+
+struct ckl_arena_block_t {
+  ckl_arena_block_t *next;
+  size_t size;
+  size_t used;
+};
+
+struct ckl_arena_owned_t {
+  ckl_arena_owned_t *next;
+  void *ptr;
+};
+
+static ckl_arena_block_t *arena_block(size_t size)
+{
+  ckl_arena_block_t *b = malloc(ARENA_HEADER + size);
+
+  if (b == NULL) {
+    return NULL;
+  }
+
+  b->next = NULL;
+  b->size = size;
+  b->used = 0;
+  return b;
+}
+
+void *ckl_arena_alloc(ckl_arena_t *a, size_t size)
+{
+  ckl_arena_block_t *b = a->blocks;
+
+  size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+  if (size == 0) {
+    size = ARENA_ALIGN;
+  }
+
+  if (b != NULL && b->size - b->used >= size) {
+    void *p = (char *)b + ARENA_HEADER + b->used;
+    b->used += size;
+    return p;
+  }
+
+  if (size > ARENA_BIG) {
+    /* behind the current block, which keeps filling up */
+    ckl_arena_block_t *big = arena_block(size);
+    if (big == NULL) {
+      return NULL;
+    }
+    big->used = size;
+    if (b != NULL) {
+      big->next = b->next;
+      b->next = big;
+    }
+    else {
+      a->blocks = big;
+    }
+    return (char *)big + ARENA_HEADER;
+  }
+
+  b = arena_block(ARENA_BLOCK_SIZE);
+  if (b == NULL) {
+    return NULL;
+  }
+  b->next = a->blocks;
+  b->used = size;
+  a->blocks = b;
+  return (char *)b + ARENA_HEADER;
+}
+
+char *ckl_arena_strndup(ckl_arena_t *a, const char *s, size_t len)
+{
+  char *p = ckl_arena_alloc(a, len + 1);
+
+  if (p != NULL) {
+    memcpy(p, s, len);
+    p[len] = '\0';
+  }
+
+  return p;
+}
+
+char *ckl_arena_strdup(ckl_arena_t *a, const char *s)
+{
+  return ckl_arena_strndup(a, s, strlen(s));
+}
+
+char *ckl_arena_printf(ckl_arena_t *a, const char *fmt, ...)
+{
+  va_list ap;
+  char *p;
+  int len;
+
+  va_start(ap, fmt);
+  len = vsnprintf(NULL, 0, fmt, ap);
+  va_end(ap);
+
+  if (len < 0) {
+    return NULL;
+  }
+
+  p = ckl_arena_alloc(a, len + 1);
+  if (p != NULL) {
+    va_start(ap, fmt);
+    vsnprintf(p, len + 1, fmt, ap);
+    va_end(ap);
+  }
+
+  return p;
+}
+
+/* for arrays appended to one at a time: room doubles at powers of two */
+void *ckl_arena_grow(ckl_arena_t *a, void *array, int count, size_t elem)
+{
+  void *p;
+
+  if (count > 0 && (count & (count - 1)) != 0) {
+    return array;
+  }
+
+  p = ckl_arena_alloc(a, (count > 0 ? count * 2 : 1) * elem);
+  if (p != NULL && count > 0) {
+    memcpy(p, array, count * elem);
+  }
+
+  return p;
+}
+
+void *ckl_arena_own(ckl_arena_t *a, void *ptr)
+{
+  ckl_arena_owned_t *o;
+
+  if (ptr == NULL) {
+    return NULL;
+  }
+
+  o = ckl_arena_alloc(a, sizeof(*o));
+  if (o == NULL) {
+    return ptr;
+  }
+
+  o->ptr = ptr;
+  o->next = a->owned;
+  a->owned = o;
+  return ptr;
+}
+
+static void arena_release(ckl_arena_t *a, ckl_arena_block_t *keep)
+{
+  ckl_arena_block_t *b = a->blocks;
+  ckl_arena_owned_t *o;
+
+  for (o = a->owned; o != NULL; o = o->next) {
+    free(o->ptr);
+  }
+  a->owned = NULL;
+
+  while (b != NULL) {
+    ckl_arena_block_t *next = b->next;
+    if (b != keep) {
+      free(b);
+    }
+    b = next;
+  }
+
+  a->blocks = keep;
+  if (keep != NULL) {
+    keep->next = NULL;
+    keep->used = 0;
+  }
+}
+
+void ckl_arena_reset(ckl_arena_t *a)
+{
+  ckl_arena_block_t *keep = a->blocks;
+
+  while (keep != NULL && keep->size != ARENA_BLOCK_SIZE) {
+    keep = keep->next;
+  }
+
+  arena_release(a, keep);
+}
+
+void ckl_arena_free(ckl_arena_t *a)
+{
+  arena_release(a, NULL);
+}
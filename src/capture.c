@@ -0,0 +1,656 @@
+/*
+ * Licensed to Cloudkick, Inc under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * Cloudkick licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ckl.h"
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/time.h>
+
+/**
+ * The capture path takes the bytes read off the PTY master and turns them
+ * into the script log that gets uploaded.  Output is optionally gzip'ed as
+ * it is captured, so the temp file only ever holds the compressed stream
+ * and can be POST'ed as-is with a Content-Encoding header.
+ *
+ * Stages, in order: secret redaction, command segmentation, the raw sink
+ * (if kept), the normalizer, then the log sink.  Redaction runs first so
+ * no secret reaches either file.
+ *
+ * A sink can be capped: past the cap it keeps the first bytes of the
+ * session, a rolling window of the last ones, and a marker with the
+ * number of bytes elided between them, so memory and disk use stay
+ * constant however much a runaway command prints.
+ *
+ * When the log is journaled to the spool, writes are made durable in
+ * groups: every sync_ms or sync_bytes of output, whichever comes first,
+ * the gzip stream is flushed to a byte boundary and the files are
+ * fdatasync'ed, so a crash loses at most one group.  A capped sink's
+ * tail only lives in memory until the session ends, so its ring is
+ * journaled next to the log with the same group commit, for recovery to
+ * splice back in after the head (see spool.c).
+ *
+ * With a command index, the index also gets a time mark about once a
+ * second while there is output: how far into the log (and the raw log)
+ * the session was at that moment, so the endpoint can seek by time.
+ */
+
+#define CAPTURE_OBUF_SIZE (64 * 1024)
+#define CAPTURE_MARK_MS 1000
+
+static unsigned long long capture_now_ms()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (unsigned long long)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+#ifdef HAVE_ZLIB
+static int sink_deflate(ckl_sink_t *c, int flush)
+{
+  int rv;
+
+  do {
+    c->zs.next_out = (Bytef *)c->obuf;
+    c->zs.avail_out = CAPTURE_OBUF_SIZE;
+
+    rv = deflate(&c->zs, flush);
+    if (rv == Z_STREAM_ERROR) {
+      fprintf(stderr, "deflate() of script log failed\n");
+      return -1;
+    }
+
+    size_t have = CAPTURE_OBUF_SIZE - c->zs.avail_out;
+    if (have > 0) {
+      if (ckl_writer_write(&c->out, c->obuf, have) < 0) {
+        return -1;
+      }
+      c->bytes_out += have;
+    }
+  } while (c->zs.avail_out == 0);
+
+  return 0;
+}
+#endif
+
+static int sink_init(ckl_sink_t *c, ckl_conf_t *conf, int fd)
+{
+  int level = conf->script_compress;
+
+  memset(c, 0, sizeof(*c));
+  c->fd = fd;
+  c->journal.fd = -1;
+  ckl_writer_init(&c->out, fd, conf->script_io_uring);
+  c->out.spill_at = conf->tmp_memory_bytes;
+
+  if (conf->script_max_bytes > 0) {
+    unsigned long long tail = conf->script_tail_bytes;
+    if (tail == 0 || tail > conf->script_max_bytes) {
+      tail = conf->script_max_bytes / 2;
+    }
+    if (ckl_ring_init(&c->tail, tail) < 0) {
+      fprintf(stderr, "Unable to allocate %llu bytes for the script log tail\n", tail);
+      return -1;
+    }
+    c->head_size = c->head_left = conf->script_max_bytes - tail;
+    c->capped = 1;
+  }
+
+  if (level <= 0) {
+    return 0;
+  }
+
+#ifdef HAVE_ZLIB
+  {
+    int rv;
+
+    if (level > Z_BEST_COMPRESSION) {
+      level = Z_BEST_COMPRESSION;
+    }
+
+    /* windowBits + 16 selects the gzip wrapper, which is what a
+     * Content-Encoding: gzip consumer expects. */
+    rv = deflateInit2(&c->zs, level, Z_DEFLATED, MAX_WBITS + 16,
+                      8, Z_DEFAULT_STRATEGY);
+    if (rv != Z_OK) {
+      fprintf(stderr, "deflateInit2() failed: %d\n", rv);
+      return -1;
+    }
+
+    c->obuf = malloc(CAPTURE_OBUF_SIZE);
+    c->encoding = "gzip";
+  }
+#else
+  fprintf(stderr, "Warning: ckl was built without zlib, script log will not be compressed\n");
+#endif
+
+  return 0;
+}
+
+static int sink_put(void *baton, const char *buf, size_t len)
+{
+  ckl_sink_t *c = baton;
+
+#ifdef HAVE_ZLIB
+  if (c->encoding) {
+    c->zs.next_in = (Bytef *)buf;
+    c->zs.avail_in = len;
+    return sink_deflate(c, Z_NO_FLUSH);
+  }
+#endif
+
+  c->bytes_out += len;
+  return ckl_writer_write(&c->out, buf, len);
+}
+
+static int sink_write(void *baton, const char *buf, size_t len)
+{
+  ckl_sink_t *c = baton;
+
+  c->bytes_in += len;
+
+  if (!c->capped) {
+    return sink_put(c, buf, len);
+  }
+
+  if (c->head_left > 0) {
+    size_t n = len < c->head_left ? len : c->head_left;
+    int rv = sink_put(c, buf, n);
+    if (rv < 0) {
+      return rv;
+    }
+    c->head_left -= n;
+    buf += n;
+    len -= n;
+  }
+
+  if (len > 0) {
+    ckl_ring_write(&c->tail, buf, len);
+  }
+
+  return 0;
+}
+
+static int sink_finish(ckl_sink_t *c)
+{
+  int rv = 0;
+
+  if (c->capped) {
+    c->elided = c->tail.dropped;
+    if (c->elided > 0) {
+      char buf[128];
+      int n = snprintf(buf, sizeof(buf), CKL_ELIDED_MARKER, c->elided);
+      c->marker_len = n;
+      rv = sink_put(c, buf, n);
+    }
+    if (rv == 0) {
+      rv = ckl_ring_drain(&c->tail, sink_put, c);
+    }
+    ckl_ring_free(&c->tail);
+    if (rv < 0) {
+      ckl_writer_finish(&c->out);
+      return rv;
+    }
+  }
+
+#ifdef HAVE_ZLIB
+  if (c->encoding) {
+    c->zs.next_in = NULL;
+    c->zs.avail_in = 0;
+    rv = sink_deflate(c, Z_FINISH);
+    deflateEnd(&c->zs);
+  }
+#endif
+
+  if (c->obuf) {
+    free(c->obuf);
+    c->obuf = NULL;
+  }
+
+  if (ckl_writer_finish(&c->out) < 0) {
+    rv = -1;
+  }
+
+  return rv;
+}
+
+static int journal_emit(void *baton, const char *buf, size_t len)
+{
+  return ckl_writer_write(baton, buf, len);
+}
+
+/**
+ * A fresh tail journal, swapped in by rename so a crash midway leaves the
+ * old one:
+ *   ckl-tail 1 <ring size> <bytes before the ring> <log length>
+ * then the ring contents.  The log length is where the head ends in the
+ * file, which recovery truncates back to before splicing.
+ */
+static int sink_journal_rewrite(ckl_sink_t *c)
+{
+  size_t plen = strlen(c->journal_path);
+  char *tmp = malloc(plen + sizeof(".new"));
+  char head[128];
+  ckl_writer_t w;
+  int fd;
+  int n;
+
+  memcpy(tmp, c->journal_path, plen);
+  memcpy(tmp + plen, ".new", sizeof(".new"));
+
+  fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    fprintf(stderr, "Unable to create spool file %s: %s\n", tmp,
+            strerror(errno));
+    free(tmp);
+    return -1;
+  }
+
+  ckl_writer_init(&w, fd, 0);
+  n = snprintf(head, sizeof(head), "%s %llu %llu %llu\n", CKL_TAIL_MAGIC,
+               (unsigned long long)c->tail.size, c->tail.dropped,
+               c->bytes_out);
+
+  if (ckl_writer_write(&w, head, n) < 0 ||
+      ckl_ring_peek(&c->tail, 0, journal_emit, &w) < 0 ||
+      ckl_writer_sync(&w, 1) < 0) {
+    close(fd);
+    unlink(tmp);
+    free(tmp);
+    return -1;
+  }
+
+  if (rename(tmp, c->journal_path) < 0) {
+    perror("rename() of script log tail failed");
+    close(fd);
+    unlink(tmp);
+    free(tmp);
+    return -1;
+  }
+
+  free(tmp);
+  if (c->journal.fd >= 0) {
+    close(c->journal.fd);
+  }
+  c->journal = w;
+  c->journal_len = c->tail.len;
+  c->journaled = c->tail.dropped + c->tail.len;
+  return 0;
+}
+
+/**
+ * Appends what came into the tail ring since the last group.  Once the
+ * journal would pass twice the ring, or the ring has already dropped
+ * bytes it never got, it is rewritten from the ring instead.
+ */
+static int sink_journal(ckl_sink_t *c)
+{
+  unsigned long long total = c->tail.dropped + c->tail.len;
+  unsigned long long pending = total - c->journaled;
+
+  if (c->journal_path == NULL || pending == 0) {
+    return 0;
+  }
+
+  if (c->journal.fd < 0 || pending > c->tail.len ||
+      c->journal_len + pending > 2 * (unsigned long long)c->tail.size) {
+    return sink_journal_rewrite(c);
+  }
+
+  if (ckl_ring_peek(&c->tail, c->tail.len - pending, journal_emit,
+                    &c->journal) < 0 ||
+      ckl_writer_sync(&c->journal, 1) < 0) {
+    return -1;
+  }
+
+  c->journal_len += pending;
+  c->journaled = total;
+  return 0;
+}
+
+/* once the log is whole on disk, its journal must not be spliced in again */
+static void sink_journal_end(ckl_sink_t *c, int done)
+{
+  if (c->journal_path == NULL) {
+    return;
+  }
+
+  if (c->journal.fd >= 0) {
+    close(c->journal.fd);
+    c->journal.fd = -1;
+  }
+
+  if (done) {
+    unlink(c->journal_path);
+  }
+
+  free(c->journal_path);
+  c->journal_path = NULL;
+}
+
+/* pushes what the sink has out to the disk */
+static int sink_sync(ckl_sink_t *c)
+{
+#ifdef HAVE_ZLIB
+  if (c->encoding) {
+    /* ends on a byte boundary, so the file decodes up to here */
+    c->zs.next_in = NULL;
+    c->zs.avail_in = 0;
+    if (sink_deflate(c, Z_SYNC_FLUSH) < 0) {
+      return -1;
+    }
+  }
+#endif
+
+  /* with io_uring this only queues the sync behind the writes */
+  if (ckl_writer_sync(&c->out, 0) < 0) {
+    return -1;
+  }
+
+  return sink_journal(c);
+}
+
+/* everything after redaction */
+static int capture_process(void *baton, const char *buf, size_t len)
+{
+  ckl_capture_t *c = baton;
+  int rv;
+
+  if (c->keep_raw) {
+    rv = sink_write(&c->raw, buf, len);
+    if (rv < 0) {
+      return rv;
+    }
+  }
+
+  if (c->normalize) {
+    return ckl_normalize_write(&c->norm, buf, len);
+  }
+
+  return sink_write(&c->log, buf, len);
+}
+
+/* where a pre-cap offset into the log ended up in the stored file */
+static unsigned long long sink_final_offset(ckl_sink_t *c, unsigned long long off)
+{
+  if (!c->capped || c->elided == 0 || off <= c->head_size) {
+    return off;
+  }
+
+  if (off < c->head_size + c->elided) {
+    /* the command's output starts inside the elided part */
+    return c->head_size;
+  }
+
+  return off - c->elided + c->marker_len;
+}
+
+static unsigned long long capture_offset(void *baton)
+{
+  ckl_capture_t *c = baton;
+
+  /* bytes still in the normalizer's line buffer come before anything new */
+  return c->log.bytes_in + (c->normalize ? c->norm.len : 0);
+}
+
+static int capture_segment(void *baton, const char *buf, size_t len)
+{
+  ckl_capture_t *c = baton;
+
+  if (c->segmenting) {
+    return ckl_segment_write(&c->seg, buf, len);
+  }
+
+  return capture_process(c, buf, len);
+}
+
+/* where the session is before this chunk, if a second has passed */
+static void capture_mark(ckl_capture_t *c)
+{
+  unsigned long long ms = capture_now_ms() - c->start_ms;
+  ckl_mark_t *m;
+
+  if (c->nmarks > 0 && ms - c->marks[c->nmarks - 1].ms < CAPTURE_MARK_MS) {
+    return;
+  }
+
+  if (c->nmarks == c->marks_alloc) {
+    c->marks_alloc = c->marks_alloc ? c->marks_alloc * 2 : 64;
+    c->marks = realloc(c->marks, c->marks_alloc * sizeof(ckl_mark_t));
+  }
+
+  m = &c->marks[c->nmarks++];
+  m->ms = ms;
+  m->offset = capture_offset(c);
+  m->raw_offset = c->raw.bytes_in;
+}
+
+/**
+ * One line per command:
+ *   offset <TAB> start ms <TAB> duration ms <TAB> exit code <TAB> command
+ * Offsets are into the stored (uncompressed) log; the command line has
+ * backslash, tab and newline escaped.  Then one line per time mark:
+ *   @ <TAB> ms <TAB> offset <TAB> raw log offset
+ */
+static int capture_write_index(ckl_capture_t *c)
+{
+  FILE *fp = fdopen(dup(c->index_fd), "w");
+  size_t i;
+
+  if (fp == NULL) {
+    perror("fdopen() of script index failed");
+    return -1;
+  }
+
+  fprintf(fp, "# ckl command index: offset start_ms duration_ms exit command, @ ms offset raw_offset\n");
+
+  for (i = 0; i < c->seg.count; i++) {
+    ckl_command_t *cmd = &c->seg.cmds[i];
+
+    fprintf(fp, "%llu\t%llu\t%llu\t%d\t",
+            sink_final_offset(&c->log, cmd->offset),
+            cmd->start_ms, cmd->duration_ms, cmd->exit_code);
+
+    ckl_index_escape(fp, cmd->cmdline);
+    fputc('\n', fp);
+  }
+
+  for (i = 0; i < c->nmarks; i++) {
+    ckl_mark_t *m = &c->marks[i];
+    fprintf(fp, "@\t%llu\t%llu\t%llu\n", m->ms,
+            sink_final_offset(&c->log, m->offset),
+            c->keep_raw ? sink_final_offset(&c->raw, m->raw_offset) : 0);
+  }
+
+  if (fclose(fp) != 0) {
+    perror("writing script index failed");
+    return -1;
+  }
+
+  return 0;
+}
+
+int ckl_capture_init(ckl_capture_t *c, ckl_conf_t *conf,
+                     int fd, int raw_fd, int index_fd)
+{
+  int rv;
+
+  memset(c, 0, sizeof(*c));
+
+  rv = sink_init(&c->log, conf, fd);
+  if (rv < 0) {
+    return rv;
+  }
+
+  if (raw_fd >= 0) {
+    rv = sink_init(&c->raw, conf, raw_fd);
+    if (rv < 0) {
+      return rv;
+    }
+    c->keep_raw = 1;
+  }
+
+  if (conf->script_normalize) {
+    ckl_normalize_init(&c->norm, sink_write, &c->log);
+    c->normalize = 1;
+  }
+
+  if (index_fd >= 0) {
+    ckl_segment_init(&c->seg, capture_process, capture_offset, c);
+    c->index_fd = index_fd;
+    c->start_ms = capture_now_ms();
+    c->segmenting = 1;
+  }
+
+  if (conf->redact_count > 0) {
+    rv = ckl_redact_init(&c->redact, conf->redact, conf->redact_count,
+                         capture_segment, c);
+    if (rv < 0) {
+      return rv;
+    }
+    c->redacting = 1;
+  }
+
+  if (conf->spool_dir) {
+    c->durable = 1;
+    c->sync_ms = conf->spool_sync_ms;
+    c->sync_bytes = conf->spool_sync_bytes;
+    c->last_sync_ms = capture_now_ms();
+  }
+
+  return 0;
+}
+
+/* the paths are the capture's now; a sink that is not capped needs none */
+void ckl_capture_journal_tail(ckl_capture_t *c, char *path, char *raw_path)
+{
+  if (c->durable && c->log.capped) {
+    c->log.journal_path = path;
+  }
+  else {
+    free(path);
+  }
+
+  if (c->durable && c->keep_raw && c->raw.capped) {
+    c->raw.journal_path = raw_path;
+  }
+  else {
+    free(raw_path);
+  }
+}
+
+int ckl_capture_write(ckl_capture_t *c, const char *buf, size_t len)
+{
+  int rv;
+
+  CKL_PROBE1(script__output, len);
+  c->bytes += len;
+
+  if (c->segmenting) {
+    capture_mark(c);
+  }
+
+  if (c->redacting) {
+    rv = ckl_redact_write(&c->redact, buf, len);
+  }
+  else {
+    rv = capture_segment(c, buf, len);
+  }
+
+  if (rv < 0 || !c->durable) {
+    return rv;
+  }
+
+  c->unsynced += len;
+  return ckl_capture_sync(c);
+}
+
+/**
+ * Group commit: a no-op until the policy says the pending output is due.
+ * The recorder also calls this when idle, so a quiet session still gets
+ * its last group on disk within sync_ms.
+ */
+int ckl_capture_sync(ckl_capture_t *c)
+{
+  unsigned long long now;
+
+  if (!c->durable || c->unsynced == 0) {
+    return 0;
+  }
+
+  now = capture_now_ms();
+  if (c->unsynced < c->sync_bytes && now - c->last_sync_ms < (unsigned long long)c->sync_ms) {
+    return 0;
+  }
+
+  c->unsynced = 0;
+  c->last_sync_ms = now;
+
+  if (sink_sync(&c->log) < 0) {
+    return -1;
+  }
+
+  if (c->keep_raw && sink_sync(&c->raw) < 0) {
+    return -1;
+  }
+
+  return 0;
+}
+
+int ckl_capture_finish(ckl_capture_t *c)
+{
+  int rv = 0;
+
+  if (c->redacting && ckl_redact_finish(&c->redact) < 0) {
+    rv = -1;
+  }
+
+  if (c->normalize && ckl_normalize_finish(&c->norm) < 0) {
+    rv = -1;
+  }
+
+  if (sink_finish(&c->log) < 0) {
+    rv = -1;
+  }
+
+  if (c->keep_raw && sink_finish(&c->raw) < 0) {
+    rv = -1;
+  }
+
+  if (c->segmenting) {
+    if (capture_write_index(c) < 0) {
+      rv = -1;
+    }
+    ckl_segment_free(&c->seg);
+    free(c->marks);
+    c->marks = NULL;
+  }
+
+  if (c->durable && rv == 0) {
+    if (fdatasync(c->log.fd) < 0 || (c->keep_raw && fdatasync(c->raw.fd) < 0)) {
+      perror("fdatasync() of script log failed");
+      rv = -1;
+    }
+  }
+
+  sink_journal_end(&c->log, rv == 0);
+  if (c->keep_raw) {
+    sink_journal_end(&c->raw, rv == 0);
+  }
+
+  return rv;
+}
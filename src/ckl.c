@@ -15,8 +15,19 @@
  * limitations under the License.
  */
 
+#define _GNU_SOURCE
 #include "ckl.h"
 #include "ckl_version.h"
+#include <getopt.h>
+
+#define CKL_RECOVER_CONNECT_TIMEOUT 5
+
+/* the command line's alone: nothing in libckl exits the process */
+static void ckl_error_out(const char *msg)
+{
+  fprintf(stderr, "ERROR: %s\n", msg);
+  exit(EXIT_FAILURE);
+}
 
 static void show_version()
 {
@@ -29,29 +40,50 @@ static void show_help()
   fprintf(stdout, "ckl - Cloudkick Changelog tool\n");
   fprintf(stdout, "  Usage:  \n");
   fprintf(stdout, "    ckl [-h|-V]\n");
-  fprintf(stdout, "    ckl [-s] [-m message]\n");
-  fprintf(stdout, "    ckl [-l]\n");
-  fprintf(stdout, "    ckl [-d number]\n");
+  fprintf(stdout, "    ckl [-s] [-m message] [-t key=value ...]\n");
+  fprintf(stdout, "    ckl [-l] [-t key=value ...] [--remote]\n");
+  fprintf(stdout, "    ckl [-d number] [--head n | --tail n] [--remote]\n");
+  fprintf(stdout, "    ckl [-r number] [-a time]\n");
+  fprintf(stdout, "    ckl [-m message] [-t key=value ...] exec -- command [args]\n");
+  fprintf(stdout, "    ckl [-D]\n");
+  fprintf(stdout, "    ckl --sync\n");
+  fprintf(stdout, "    ckl --metrics\n");
   fprintf(stdout, "\n");
   fprintf(stdout, "     -h          Show Help message\n");
   fprintf(stdout, "     -V          Show Version number\n");
   fprintf(stdout, "     -l          List recent actions on this host\n");
   fprintf(stdout, "     -d (n)      Show details about session N, listed from -l\n");
+  fprintf(stdout, "     --head (n)  With -d, only the first N lines of the script log\n");
+  fprintf(stdout, "     --tail (n)  With -d, only the last N lines of the script log\n");
+  fprintf(stdout, "     --remote    With -l or -d, ask the endpoint even if ckl_store_dir has the entries\n");
+  fprintf(stdout, "     -r (n)      Show the screen of session N, listed from -l, at its end (--replay)\n");
+  fprintf(stdout, "     -a (time)   With -r, the screen at HH:MM:SS into the session instead (--at)\n");
   fprintf(stdout, "     -m (msg)    Set the log message, if none is set, an editor will be invoked.\n");
+  fprintf(stdout, "                 With -m -, the message is read from stdin.\n");
+  fprintf(stdout, "     -t (k=v)    Tag the log message, or with -l, list only messages tagged so.\n");
+  fprintf(stdout, "                 May be repeated.\n");
   fprintf(stdout, "     -s          Run in script recording mode.\n");
+  fprintf(stdout, "     exec        Run the command and log it with its exit status, time and output tail.\n");
+  fprintf(stdout, "     -D          Run the recording daemon for script sessions on this host.\n");
+  fprintf(stdout, "     --profile-startup  Print where the time of this run went, to stderr.\n");
+  fprintf(stdout, "     --sync      Add this host's entries from the endpoint to ckl_store_dir\n");
+  fprintf(stdout, "     --metrics   Print the counters of ckl_metrics_file for node_exporter.\n");
   fprintf(stdout, "See `man ckl` for more details\n");
   exit(EXIT_SUCCESS);
 }
 
-static int do_send_msg(ckl_conf_t *conf, const char *usermsg)
+static int do_send_msg(ckl_conf_t *conf, const char *usermsg,
+                       const char **tags, int tag_count)
 {
+  int i;
   int rv;
   const char *editor;
   ckl_msg_t *msg = calloc(1, sizeof(ckl_msg_t));
-  ckl_transport_t *transport = calloc(1, sizeof(ckl_transport_t));
   ckl_script_t *script = calloc(1, sizeof(ckl_script_t));
 
+  ckl_prof_begin(CKL_PROF_IDENTITY);
   rv = ckl_msg_init(msg);
+  ckl_prof_end(CKL_PROF_IDENTITY);
   if (rv < 0) {
     ckl_error_out("msg_init failed.");
     return rv;
@@ -93,17 +125,39 @@ static int do_send_msg(ckl_conf_t *conf, const char *usermsg)
 
     fclose(fd);
     unlink(path);
+    free(path);
+  }
+  else if (strcmp(usermsg, "-") == 0) {
+    /* streamed to the endpoint as it is read, see ckl_msgstream_read */
+    if (conf->script_mode) {
+      ckl_error_out("-m - cannot be used with -s, the session needs stdin");
+    }
+    if (conf->oauth_key && conf->oauth_secret) {
+      /* a streamed part would go out unsigned */
+      rv = ckl_msg_read_stdin(msg, conf->msg_max_bytes);
+      if (rv < 0) {
+        ckl_error_out("Failed to read the message from stdin");
+        return rv;
+      }
+    }
+    else {
+      msg->msg_stdin = 1;
+    }
   }
   else {
-    msg->msg = strdup(usermsg);
+    msg->msg = ckl_arena_strdup(&msg->arena, usermsg);
   }
 
-  if (msg->msg == NULL) {
+  for (i = 0; i < tag_count; i++) {
+    ckl_msg_add_tag(msg, tags[i]);
+  }
+
+  if (msg->msg == NULL && !msg->msg_stdin) {
     ckl_error_out("no message specified");
   }
 
   if (conf->script_mode) {
-    rv = ckl_script_init(script, conf);
+    rv = ckl_script_init(script, conf, msg);
     if (rv < 0) {
       ckl_error_out("script_init failed.");
       return rv;
@@ -116,39 +170,173 @@ static int do_send_msg(ckl_conf_t *conf, const char *usermsg)
     }
   }
 
+  rv = ckl_transport_send(conf, msg, 0);
+  if (rv < 0) {
+    ckl_error_out("msg_send failed.");
+    return rv;
+  }
+
+  ckl_msg_free(msg);
+  ckl_script_free(script);
+
+  return 0;
+}
+
+/* runs the command, sends one entry for it and exits as it did */
+static int do_exec(ckl_conf_t *conf, const char *usermsg,
+                   const char **tags, int tag_count, char *const *argv)
+{
+  ckl_exec_t e;
+  ckl_msg_t *msg = calloc(1, sizeof(ckl_msg_t));
+  int i;
+  int rv;
+
+  ckl_prof_begin(CKL_PROF_IDENTITY);
+  rv = ckl_msg_init(msg);
+  ckl_prof_end(CKL_PROF_IDENTITY);
+  if (rv < 0) {
+    ckl_error_out("msg_init failed.");
+    return rv;
+  }
+
+  rv = ckl_exec_run(&e, conf, argv);
+  if (rv < 0) {
+    ckl_error_out("exec failed.");
+    return rv;
+  }
+
+  msg->msg = ckl_arena_printf(&msg->arena,
+                              "%s%s$ %s\nexit %d, %.3fs wall, %.3fs user, %.3fs sys",
+                              usermsg ? usermsg : "", usermsg ? "\n" : "",
+                              e.cmdline, e.exit_code, e.wall_ms / 1000,
+                              e.user_ms / 1000, e.sys_ms / 1000);
+
+  for (i = 0; i < tag_count; i++) {
+    ckl_msg_add_tag(msg, tags[i]);
+  }
+
+  /* the command ran either way, so a failed upload only warns */
+  rv = ckl_exec_files(&e, conf, msg);
+  if (rv == 0) {
+    rv = ckl_transport_send(conf, msg, 0);
+  }
+  if (rv < 0) {
+    fprintf(stderr, "Warning: ckl exec could not log the command\n");
+  }
+
+  if (msg->script_log) {
+    ckl_tmp_remove(msg->script_log);
+  }
+  if (msg->script_index) {
+    ckl_tmp_remove(msg->script_index);
+  }
+
+  rv = e.exit_code;
+  ckl_msg_free(msg);
+  ckl_exec_free(&e);
+
+  return rv;
+}
+
+/* an endpoint that is down costs this run seconds, not minutes */
+static int do_send_recovered(ckl_conf_t *conf, ckl_msg_t *msg)
+{
+  return ckl_transport_send(conf, msg, CKL_RECOVER_CONNECT_TIMEOUT);
+}
+
+/* from the store when it has any matching entries, so that -l and -d
+ * number entries the same way; from the endpoint when it has none */
+static int do_list(ckl_conf_t *conf, int count,
+                   const char **tags, int tag_count, int remote)
+{
+  int rv;
+  int local;
+  ckl_store_t store;
+  ckl_transport_t *transport;
+
+  if (conf->store_dir && !remote) {
+    ckl_store_open(&store, conf->store_dir);
+    local = ckl_store_list(&store, count, tags, tag_count, stdout);
+    ckl_store_close(&store);
+    if (local > 0) {
+      if (local < count) {
+        fprintf(stderr, "Only %d entries are stored on this host; "
+                "--remote lists the endpoint's.\n", local);
+      }
+      return 0;
+    }
+  }
+
+  transport = calloc(1, sizeof(ckl_transport_t));
   rv = ckl_transport_init(transport, conf);
   if (rv < 0) {
     ckl_error_out("transport_init failed.");
     return rv;
   }
 
-  rv = ckl_transport_msg_send(transport, conf, msg);
+  rv = ckl_transport_list(transport, conf, count, tags, tag_count);
   if (rv < 0) {
-    ckl_error_out("msg_send failed.");
+    ckl_error_out("ckl_transport_list failed.");
     return rv;
   }
 
   ckl_transport_free(transport);
-  ckl_msg_free(msg);
-  ckl_script_free(script);
 
   return 0;
 }
 
-static int do_list(ckl_conf_t *conf, int count)
+/* Entry N of the store and of the endpoint can differ until a sync, so
+ * the endpoint is asked for a stored entry by its event id, and by
+ * number only when the store is synced or empty (event 0) */
+static unsigned long long store_event(ckl_conf_t *conf, ckl_store_t *store,
+                                      int n)
 {
   int rv;
-  ckl_transport_t *transport = calloc(1, sizeof(ckl_transport_t));
+  unsigned long long event = 0;
+  char hostname[HOST_NAME_MAX + 1];
+
+  rv = ckl_store_event(store, n, &event);
+  if (rv == 0 && event == 0) {
+    ckl_error_out("That entry is not synced yet, so the endpoint does not "
+                  "know it by that number.\nRun ckl --sync first, or use "
+                  "--remote for the endpoint's entry.");
+  }
+  if (rv < 0 && store->count > 0 &&
+      (ckl_hostname(hostname, sizeof(hostname)) < 0 ||
+       ckl_store_since(conf->store_dir, hostname) == 0)) {
+    ckl_error_out("The store on this host has not been synced, so its "
+                  "numbers can differ from the endpoint's.\nRun ckl --sync "
+                  "first, or use --remote for the endpoint's entry.");
+  }
+
+  return event;
+}
 
+/* the session is on the endpoint; which one -l listed is in the store */
+static int do_replay(ckl_conf_t *conf, const char *slug, const char *at,
+                     int remote)
+{
+  int rv;
+  unsigned long long event = 0;
+  ckl_store_t store;
+  ckl_transport_t *transport;
+
+  if (conf->store_dir && !remote) {
+    ckl_store_open(&store, conf->store_dir);
+    event = store_event(conf, &store, atoi(slug));
+    ckl_store_close(&store);
+  }
+
+  transport = calloc(1, sizeof(ckl_transport_t));
   rv = ckl_transport_init(transport, conf);
   if (rv < 0) {
     ckl_error_out("transport_init failed.");
     return rv;
   }
 
-  rv = ckl_transport_list(transport, conf, count);
+  rv = ckl_transport_replay(transport, conf, slug, event, at);
   if (rv < 0) {
-    ckl_error_out("ckl_transport_list failed.");
+    ckl_error_out("ckl_transport_replay failed.");
     return rv;
   }
 
@@ -157,18 +345,35 @@ static int do_list(ckl_conf_t *conf, int count)
   return 0;
 }
 
-static int do_detail(ckl_conf_t *conf, const char *slug)
+/* the script log itself, and so --head and --tail, are on the endpoint */
+static int do_detail(ckl_conf_t *conf, const char *slug, int head, int tail,
+                     int remote)
 {
   int rv;
-  ckl_transport_t *transport = calloc(1, sizeof(ckl_transport_t));
+  int n = atoi(slug);
+  unsigned long long event = 0;
+  ckl_store_t store;
+  ckl_transport_t *transport;
+
+  if (conf->store_dir && !remote) {
+    ckl_store_open(&store, conf->store_dir);
+    if (head == 0 && tail == 0 && ckl_store_detail(&store, n, stdout) == 0) {
+      ckl_store_close(&store);
+      return 0;
+    }
+
+    event = store_event(conf, &store, n);
+    ckl_store_close(&store);
+  }
 
+  transport = calloc(1, sizeof(ckl_transport_t));
   rv = ckl_transport_init(transport, conf);
   if (rv < 0) {
     ckl_error_out("transport_init failed.");
     return rv;
   }
 
-  rv = ckl_transport_detail(transport, conf, slug);
+  rv = ckl_transport_detail(transport, conf, slug, event, head, tail);
   if (rv < 0) {
     ckl_error_out("ckl_transport_detail failed.");
     return rv;
@@ -179,10 +384,45 @@ static int do_detail(ckl_conf_t *conf, const char *slug)
   return 0;
 }
 
+static int do_sync(ckl_conf_t *conf)
+{
+  int rv;
+  unsigned long long since;
+
+  if (!conf->store_dir) {
+    ckl_error_out("--sync needs ckl_store_dir in the configuration.");
+  }
+
+  rv = ckl_store_sync(conf, &since);
+  if (rv < 0) {
+    ckl_error_out("ckl_store_sync failed.");
+    return rv;
+  }
+
+  fprintf(stdout, "%d new entries, up to event %llu\n", rv, since);
+
+  return 0;
+}
+
 enum {
   MODE_SEND_MSG,
   MODE_LIST,
-  MODE_DETAIL
+  MODE_DETAIL,
+  MODE_REPLAY,
+  MODE_EXEC,
+  MODE_DAEMON,
+  MODE_METRICS,
+  MODE_SYNC
+};
+
+/* long options without a short form */
+enum {
+  OPT_HEAD = 256,
+  OPT_TAIL,
+  OPT_PROFILE_STARTUP,
+  OPT_METRICS,
+  OPT_REMOTE,
+  OPT_SYNC
 };
 
 int main(int argc, char *const *argv)
@@ -191,13 +431,33 @@ int main(int argc, char *const *argv)
   int c;
   int rv;
   int count = 10;
+  int head = 0;
+  int tail = 0;
+  int remote = 0;
   const char *detail = NULL;
+  const char *at = NULL;
   const char *usermsg = NULL;
+  const char *why = NULL;
+  const char **tags = NULL;
+  int tag_count = 0;
   ckl_conf_t *conf = calloc(1, sizeof(ckl_conf_t));
 
-  curl_global_init(CURL_GLOBAL_ALL);
-
-  while ((c = getopt(argc, argv, "hVslm:d:")) != -1) {
+  ckl_prof_init();
+  ckl_trace_init();
+
+  static const struct option longopts[] = {
+    {"replay", required_argument, NULL, 'r'},
+    {"at", required_argument, NULL, 'a'},
+    {"head", required_argument, NULL, OPT_HEAD},
+    {"tail", required_argument, NULL, OPT_TAIL},
+    {"profile-startup", no_argument, NULL, OPT_PROFILE_STARTUP},
+    {"metrics", no_argument, NULL, OPT_METRICS},
+    {"remote", no_argument, NULL, OPT_REMOTE},
+    {"sync", no_argument, NULL, OPT_SYNC},
+    {NULL, 0, NULL, 0}
+  };
+
+  while ((c = getopt_long(argc, argv, "hVslm:t:d:r:a:D", longopts, NULL)) != -1) {
     switch (c) {
       case 'V':
         show_version();
@@ -208,7 +468,7 @@ int main(int argc, char *const *argv)
       case 'l':
         mode = MODE_LIST;
         char *arg = argv[optind];
-        if(arg != NULL) {
+        if(arg != NULL && arg[0] != '-') {
           count = atoi(arg);
           if(count < 1) {
             ckl_error_out("Count cannot be less than 1. See -h for correct options.");
@@ -219,39 +479,124 @@ int main(int argc, char *const *argv)
         mode = MODE_DETAIL;
         detail = optarg;
         break;
+      case 'r':
+        mode = MODE_REPLAY;
+        detail = optarg;
+        break;
+      case 'a':
+        at = optarg;
+        break;
+      case OPT_HEAD:
+      case OPT_TAIL:
+        if (atoi(optarg) < 1) {
+          ckl_error_out("Line count cannot be less than 1. See -h for correct options.");
+        }
+        if (c == OPT_HEAD) {
+          head = atoi(optarg);
+        }
+        else {
+          tail = atoi(optarg);
+        }
+        break;
       case 'm':
         usermsg = optarg;
         break;
+      case OPT_PROFILE_STARTUP:
+        ckl_prof_enable();
+        break;
+      case 't':
+        /* one line of the tags field, see tags_post_data */
+        if (strchr(optarg, '=') == NULL || optarg[0] == '=' ||
+            strchr(optarg, '\n') != NULL) {
+          ckl_error_out("Tags are key=value. See -h for correct options.");
+        }
+        tags = realloc(tags, (tag_count + 1) * sizeof(char *));
+        tags[tag_count++] = optarg;
+        break;
       case 's':
         conf->script_mode = 1;
         break;
+      case 'D':
+        mode = MODE_DAEMON;
+        break;
+      case OPT_METRICS:
+        mode = MODE_METRICS;
+        break;
+      case OPT_REMOTE:
+        remote = 1;
+        break;
+      case OPT_SYNC:
+        mode = MODE_SYNC;
+        break;
       case '?':
         ckl_error_out("See -h for correct options");
         break;
     }
   }
 
-  rv = ckl_conf_init(conf);
+  /* ckl [options] exec -- command [args] */
+  if (optind < argc && strcmp(argv[optind], "exec") == 0) {
+    if (optind + 1 >= argc) {
+      ckl_error_out("exec needs a command. See -h for correct options.");
+    }
+    if (conf->script_mode) {
+      ckl_error_out("exec cannot be used with -s. See -h for correct options.");
+    }
+    mode = MODE_EXEC;
+  }
 
-  if (rv < 0) {
-    ckl_error_out("conf_init failed");
+  ckl_prof_begin(CKL_PROF_CONFIG);
+  rv = ckl_conf_load(conf, NULL, &why);
+  ckl_prof_end(CKL_PROF_CONFIG);
+
+  if (rv != CKL_OK) {
+    ckl_error_out(why);
+  }
+
+  /* sessions a crashed or killed ckl never got to upload; not before
+   * the modes that answer from the store, which must work offline */
+  if (conf->spool_dir && mode != MODE_METRICS && mode != MODE_LIST &&
+      mode != MODE_DETAIL) {
+    ckl_spool_recover(conf, do_send_recovered);
   }
 
   switch (mode) {
     case MODE_SEND_MSG:
-      rv = do_send_msg(conf, usermsg);
+      rv = do_send_msg(conf, usermsg, tags, tag_count);
       break;
     case MODE_LIST:
-      rv = do_list(conf, count);
+      rv = do_list(conf, count, tags, tag_count, remote);
       break;
     case MODE_DETAIL:
-      rv = do_detail(conf, detail);
+      rv = do_detail(conf, detail, head, tail, remote);
+      break;
+    case MODE_REPLAY:
+      rv = do_replay(conf, detail, at, remote);
+      break;
+    case MODE_EXEC:
+      rv = do_exec(conf, usermsg, tags, tag_count, &argv[optind + 1]);
+      break;
+    case MODE_DAEMON:
+      rv = ckl_daemon_run(conf);
+      break;
+    case MODE_SYNC:
+      rv = do_sync(conf);
+      break;
+    case MODE_METRICS:
+      if (!conf->metrics_file) {
+        ckl_error_out("--metrics needs ckl_metrics_file in the configuration.");
+      }
+      rv = ckl_metrics_render(conf->metrics_file, stdout);
       break;
   }
 
+  ckl_prof_begin(CKL_PROF_TEARDOWN);
   ckl_conf_free(conf);
+  free(tags);
+  ckl_transport_cleanup();
+  ckl_prof_end(CKL_PROF_TEARDOWN);
 
-  curl_global_cleanup();
+  ckl_prof_report();
 
   return rv;
 }
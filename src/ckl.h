@@ -19,6 +19,7 @@
 #define _ckl_h_
 
 #include <string.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <ctype.h>
@@ -27,25 +28,117 @@
 #include <curl/types.h>
 #include <curl/easy.h>
 
+#include "libckl.h"
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+/* USDT probes, provider "ckl"; a nop each unless a tracer attaches */
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define CKL_PROBE(name) DTRACE_PROBE(ckl, name)
+#define CKL_PROBE1(name, a) DTRACE_PROBE1(ckl, name, a)
+#define CKL_PROBE2(name, a, b) DTRACE_PROBE2(ckl, name, a, b)
+#else
+#define CKL_PROBE(name) do { } while (0)
+#define CKL_PROBE1(name, a) do { } while (0)
+#define CKL_PROBE2(name, a, b) do { } while (0)
+#endif
+
+/* a span is a <probe>__start and <probe>__done(a, b) pair of probes, and
+ * a line in the JSON trace, see trace.c */
+#define CKL_TRACE_START(span, probe) \
+  do { CKL_PROBE(probe##__start); ckl_trace_begin(span); } while (0)
+#define CKL_TRACE_DONE(span, probe, a, b) \
+  do { \
+    long long ckl_a_ = (a), ckl_b_ = (b); \
+    CKL_PROBE2(probe##__done, ckl_a_, ckl_b_); \
+    ckl_trace_end(span, ckl_a_, ckl_b_); \
+  } while (0)
+
 #ifndef HOST_NAME_MAX
 #define HOST_NAME_MAX 255
 #endif
 
+typedef struct ckl_pgzip_t ckl_pgzip_t;
+typedef struct ckl_msgstream_t ckl_msgstream_t;
+typedef struct ckl_arena_block_t ckl_arena_block_t;
+typedef struct ckl_arena_owned_t ckl_arena_owned_t;
+
+/* what a conf, a message or a request allocates, released at once */
+typedef struct ckl_arena_t {
+  ckl_arena_block_t *blocks;
+  ckl_arena_owned_t *owned;
+} ckl_arena_t;
+
+/* a form part curl pulls through the transport's read callback */
+typedef struct ckl_stream_t {
+  size_t (*read)(char *buf, size_t size, size_t nmemb, void *baton);
+  void (*close)(void *baton);
+  void *baton;
+} ckl_stream_t;
+
 typedef struct ckl_transport_t {
   CURL *curl;
   const char *append_url;
   struct curl_slist *headerlist;
   struct curl_httppost *formpost;
   struct curl_httppost *lastptr;
+  struct curl_slist *script_headers;
+  ckl_stream_t streams[3];
+  int nstreams;
+  char error[CURL_ERROR_SIZE];
+  ckl_arena_t arena;
 } ckl_transport_t;
 
+/* the counters of one endpoint in the metrics file, see metrics.c */
+typedef struct ckl_metrics_t {
+  struct ckl_metrics_file_t *file;
+  struct ckl_metrics_endpoint_t *ep;
+} ckl_metrics_t;
+
+/* the local changelog, mapped for reading, see store.c */
+typedef struct ckl_store_t {
+  const char *entries;
+  size_t entries_size;
+  const struct ckl_store_rec_t *index;
+  size_t index_size;
+  size_t nrec;
+  size_t *order;
+  size_t count;
+} ckl_store_t;
+
 typedef struct ckl_conf_t {
   int script_mode;
+  int script_native;
+  int script_compress;
+  int script_normalize;
+  int script_keep_raw;
+  unsigned long long script_max_bytes;
+  unsigned long long script_tail_bytes;
+  int script_commands;
+  int script_io_uring;
+  int upload_compress;
+  int upload_threads;
+  unsigned long long msg_max_bytes;
+  unsigned long long exec_tail_bytes;
+  unsigned long long tmp_memory_bytes;
+  const char **redact;
+  int redact_count;
+  const char *daemon_socket;
+  const char *spool_dir;
+  const char *metrics_file;
+  ckl_metrics_t metrics;
+  const char *store_dir;
+  int spool_sync_ms;
+  unsigned long long spool_sync_bytes;
   int quiet;
   const char *endpoint;
   const char *secret;
   const char *oauth_key;
   const char *oauth_secret;
+  ckl_arena_t arena;
 } ckl_conf_t;
 
 typedef struct ckl_msg_t {
@@ -53,46 +146,401 @@ typedef struct ckl_msg_t {
   const char *username;
   const char *hostname;
   const char *msg;
+  int msg_stdin;
+  const char **tags;
+  int tag_count;
   const char *script_log;
+  const char *script_raw_log;
+  const char *script_index;
+  const char *script_encoding;
+  ckl_arena_t arena;
 } ckl_msg_t;
 
+typedef int (*ckl_emit_fn)(void *baton, const char *buf, size_t len);
+
+typedef struct ckl_ring_t {
+  char *buf;
+  size_t size;
+  size_t start;
+  size_t len;
+  unsigned long long dropped;
+} ckl_ring_t;
+
+typedef struct ckl_exec_t {
+  char *cmdline;
+  int exit_code;
+  double wall_ms;
+  double user_ms;
+  double sys_ms;
+  ckl_ring_t tail;
+  unsigned long long output_bytes;
+  int relay[2];
+  FILE *files[2];
+} ckl_exec_t;
+
+typedef struct ckl_uring_t ckl_uring_t;
+
+typedef struct ckl_writer_t {
+  int fd;
+  ckl_uring_t *ring;
+  unsigned long long calls;
+  unsigned long long written;
+  unsigned long long spill_at;
+} ckl_writer_t;
+
+/* what a capped log has between its head and tail, see capture.c */
+#define CKL_ELIDED_MARKER "\n[ckl: %llu bytes elided]\n"
+#define CKL_TAIL_MAGIC "ckl-tail 1"
+
+typedef struct ckl_sink_t {
+  int fd;
+  ckl_writer_t out;
+  int capped;
+  unsigned long long head_size;
+  unsigned long long head_left;
+  unsigned long long elided;
+  size_t marker_len;
+  ckl_ring_t tail;
+  char *journal_path;
+  ckl_writer_t journal;
+  unsigned long long journaled;
+  unsigned long long journal_len;
+  const char *encoding;
+  char *obuf;
+  unsigned long long bytes_in;
+  unsigned long long bytes_out;
+#ifdef HAVE_ZLIB
+  z_stream zs;
+#endif
+} ckl_sink_t;
+
+typedef struct ckl_normalize_t ckl_normalize_t;
+
+struct ckl_normalize_t {
+  ckl_emit_fn emit;
+  void *baton;
+  void (*loop)(ckl_normalize_t *n, const char *p, const char *end);
+  const char *scan_name;
+  char *buf;
+  size_t size;
+  size_t len;
+  size_t line_start;
+  size_t col;
+  size_t cells;
+  int state;
+  int csi_arg;
+  int csi_nargs;
+};
+
+typedef struct ckl_redact_t {
+  ckl_emit_fn emit;
+  void *baton;
+  unsigned char class[256];
+  int nclasses;
+  uint32_t nstates;
+  uint32_t *delta;
+  uint32_t *depth;
+  uint32_t *match;
+  unsigned char *token;
+  uint32_t max_len;
+  uint32_t state;
+  int in_token;
+  char *hold;
+  size_t hold_len;
+  size_t hold_size;
+  int matching;
+  char *win;
+  unsigned char *win_mask;
+  size_t win_len;
+  size_t win_masked;
+  int last_masked;
+  unsigned long long matches;
+} ckl_redact_t;
+
+typedef struct ckl_command_t {
+  unsigned long long offset;
+  unsigned long long start_ms;
+  unsigned long long duration_ms;
+  int exit_code;
+  char *cmdline;
+} ckl_command_t;
+
+typedef struct ckl_segment_t {
+  ckl_emit_fn emit;
+  unsigned long long (*offset)(void *baton);
+  void *baton;
+  int state;
+  char osc[64];
+  size_t osc_len;
+  int in_input;
+  int running;
+  ckl_normalize_t input;
+  char *cmd;
+  size_t cmd_len;
+  unsigned long long session_start_ms;
+  ckl_command_t *cmds;
+  size_t count;
+  size_t alloc;
+} ckl_segment_t;
+
+typedef struct ckl_mark_t {
+  unsigned long long ms;
+  unsigned long long offset;
+  unsigned long long raw_offset;
+} ckl_mark_t;
+
+typedef struct ckl_capture_t {
+  int redacting;
+  ckl_redact_t redact;
+  int segmenting;
+  ckl_segment_t seg;
+  int index_fd;
+  unsigned long long start_ms;
+  ckl_mark_t *marks;
+  size_t nmarks;
+  size_t marks_alloc;
+  ckl_sink_t log;
+  ckl_sink_t raw;
+  int keep_raw;
+  int normalize;
+  ckl_normalize_t norm;
+  int durable;
+  int sync_ms;
+  unsigned long long sync_bytes;
+  unsigned long long unsynced;
+  unsigned long long last_sync_ms;
+  unsigned long long bytes;
+} ckl_capture_t;
+
+typedef struct ckl_spool_t {
+  int fd;
+  char *path;
+  char *base;
+} ckl_spool_t;
+
 typedef struct ckl_script_t {
   const char *shell;
   FILE *fd;
   char *path;
+  FILE *raw_fd;
+  char *raw_path;
+  FILE *index_fd;
+  char *index_path;
+  FILE *rc_fd;
+  char *rc_path;
+  int native;
+  int daemon;
+  int daemon_fd;
+  int spooled;
+  ckl_spool_t spool;
+  ckl_capture_t capture;
 } ckl_script_t;
 
+/* recording daemon protocol, see daemon.c */
+#define CKL_DAEMON_MAGIC 0x636b6c31
+#define CKL_DAEMON_RAW   (1 << 0)
+#define CKL_DAEMON_INDEX (1 << 1)
+#define CKL_DAEMON_GZIP  (1 << 2)
+
+typedef struct ckl_daemon_hello_t {
+  uint32_t magic;
+  uint32_t flags;
+} ckl_daemon_hello_t;
+
+typedef struct ckl_daemon_reply_t {
+  uint32_t magic;
+  int32_t status;
+  uint32_t flags;
+} ckl_daemon_reply_t;
+
+/* phases of an invocation timed by --profile-startup */
+typedef enum {
+  CKL_PROF_CONFIG,
+  CKL_PROF_IDENTITY,
+  CKL_PROF_LIBINIT,
+  CKL_PROF_NETWORK,
+  CKL_PROF_TEARDOWN,
+  CKL_PROF_MAX
+} ckl_prof_phase_e;
+
+/* spans of the JSON trace, in the order of trace_spans in trace.c */
+typedef enum {
+  CKL_SPAN_CONFIG,
+  CKL_SPAN_MSG,
+  CKL_SPAN_EDITOR,
+  CKL_SPAN_SCRIPT,
+  CKL_SPAN_OAUTH,
+  CKL_SPAN_REQUEST,
+  CKL_SPAN_SPOOL_ENQUEUE,
+  CKL_SPAN_SPOOL_DEQUEUE,
+  CKL_SPAN_MAX
+} ckl_span_e;
+
+/* trace functions */
+int ckl_trace_open(const char *path);
+void ckl_trace_init(void);
+void ckl_trace_begin(ckl_span_e span);
+void ckl_trace_end(ckl_span_e span, long long a, long long b);
+
+/* store functions */
+int ckl_store_append(ckl_conf_t *conf, ckl_msg_t *msg);
+int ckl_store_open(ckl_store_t *s, const char *dir);
+int ckl_store_list(ckl_store_t *s, int count, const char **tags, int tag_count,
+                   FILE *out);
+int ckl_store_detail(ckl_store_t *s, int n, FILE *out);
+int ckl_store_event(ckl_store_t *s, int n, unsigned long long *event);
+void ckl_store_close(ckl_store_t *s);
+unsigned long long ckl_store_since(const char *dir, const char *hostname);
+int ckl_store_merge(const char *dir, const char *hostname, const char *buf,
+                    size_t len, unsigned long long *since);
+int ckl_store_sync(ckl_conf_t *conf, unsigned long long *since);
+
+/* metrics functions */
+int ckl_metrics_open(ckl_metrics_t *m, const char *path, const char *endpoint);
+void ckl_metrics_request(ckl_metrics_t *m, unsigned long long bytes,
+                         unsigned long long usec);
+void ckl_metrics_result(ckl_metrics_t *m, int ok);
+void ckl_metrics_retry(ckl_metrics_t *m);
+void ckl_metrics_close(ckl_metrics_t *m);
+int ckl_metrics_render(const char *path, FILE *out);
+
+/* arena functions */
+void *ckl_arena_alloc(ckl_arena_t *a, size_t size);
+char *ckl_arena_strdup(ckl_arena_t *a, const char *s);
+char *ckl_arena_strndup(ckl_arena_t *a, const char *s, size_t len);
+char *ckl_arena_printf(ckl_arena_t *a, const char *fmt, ...);
+void *ckl_arena_grow(ckl_arena_t *a, void *array, int count, size_t elem);
+void *ckl_arena_own(ckl_arena_t *a, void *ptr);
+void ckl_arena_reset(ckl_arena_t *a);
+void ckl_arena_free(ckl_arena_t *a);
+
 /* util functions */
-void ckl_error_out(const char *msg);
 void ckl_nuke_newlines(char *p);
 int ckl_tmp_file(char **path, FILE **fd);
-const char *ckl_hostname();
+int ckl_tmp_buffer(char **path, FILE **fd, int memory);
+int ckl_tmp_inherit(FILE *fd);
+void ckl_tmp_remove(const char *path);
+int ckl_tmp_spill(int fd);
+int ckl_hostname(char *buf, size_t len);
+int ckl_ring_init(ckl_ring_t *r, size_t size);
+void ckl_ring_write(ckl_ring_t *r, const char *buf, size_t len);
+int ckl_ring_peek(ckl_ring_t *r, size_t skip, ckl_emit_fn emit, void *baton);
+int ckl_ring_drain(ckl_ring_t *r, ckl_emit_fn emit, void *baton);
+void ckl_ring_free(ckl_ring_t *r);
+void ckl_prof_init(void);
+void ckl_prof_enable(void);
+void ckl_prof_begin(ckl_prof_phase_e phase);
+void ckl_prof_end(ckl_prof_phase_e phase);
+void ckl_prof_report(void);
 
 /* transport fucntions */
+int ckl_transport_global_init(long flags);
 int ckl_transport_init(ckl_transport_t *t, ckl_conf_t *conf);
+void ckl_transport_connect_timeout(ckl_transport_t *t, long seconds);
 void ckl_transport_free(ckl_transport_t *t);
+void ckl_transport_cleanup(void);
 int ckl_transport_msg_send(ckl_transport_t *t,
                        ckl_conf_t *conf,
                        ckl_msg_t* m);
+int ckl_transport_send(ckl_conf_t *conf, ckl_msg_t *msg, long connect_timeout);
 int ckl_transport_list(ckl_transport_t *t,
                        ckl_conf_t *conf,
-                       int count);
+                       int count,
+                       const char **tags,
+                       int tag_count);
 int ckl_transport_detail(ckl_transport_t *t,
                          ckl_conf_t *conf,
-                         const char *slug);
+                         const char *slug,
+                         unsigned long long event,
+                         int head,
+                         int tail);
+int ckl_transport_replay(ckl_transport_t *t,
+                         ckl_conf_t *conf,
+                         const char *slug,
+                         unsigned long long event,
+                         const char *at);
+int ckl_transport_sync(ckl_transport_t *t,
+                       ckl_conf_t *conf,
+                       const char *hostname,
+                       unsigned long long since,
+                       ckl_emit_fn emit,
+                       void *baton);
 
 /* script functions */
-int ckl_script_init(ckl_script_t *s, ckl_conf_t *conf);
+int ckl_script_init(ckl_script_t *s, ckl_conf_t *conf, ckl_msg_t *msg);
 int ckl_script_record(ckl_script_t *s, ckl_msg_t *msg);
 void ckl_script_free(ckl_script_t *s);
 
+/* capture functions */
+int ckl_capture_init(ckl_capture_t *c, ckl_conf_t *conf,
+                     int fd, int raw_fd, int index_fd);
+int ckl_capture_write(ckl_capture_t *c, const char *buf, size_t len);
+void ckl_capture_journal_tail(ckl_capture_t *c, char *path, char *raw_path);
+int ckl_capture_sync(ckl_capture_t *c);
+int ckl_capture_finish(ckl_capture_t *c);
+
+/* writer functions */
+int ckl_writer_init(ckl_writer_t *w, int fd, int use_uring);
+int ckl_writer_write(ckl_writer_t *w, const char *buf, size_t len);
+int ckl_writer_sync(ckl_writer_t *w, int wait);
+int ckl_writer_finish(ckl_writer_t *w);
+
+/* pgzip functions */
+ckl_pgzip_t *ckl_pgzip_open(const char *path, int level, int threads);
+size_t ckl_pgzip_read(char *buf, size_t size, size_t nmemb, void *baton);
+void ckl_pgzip_close(ckl_pgzip_t *z);
+
+/* exec functions */
+int ckl_exec_run(ckl_exec_t *e, ckl_conf_t *conf, char *const *argv);
+int ckl_exec_files(ckl_exec_t *e, ckl_conf_t *conf, ckl_msg_t *msg);
+void ckl_exec_free(ckl_exec_t *e);
+
+/* daemon functions */
+int ckl_daemon_run(ckl_conf_t *conf);
+int ckl_daemon_connect(const char *path);
+int ckl_daemon_attach(int sock, const ckl_daemon_hello_t *hello,
+                      const int *fds, int nfds);
+
+/* spool functions */
+int ckl_spool_open(ckl_spool_t *sp, ckl_conf_t *conf, ckl_msg_t *msg);
+int ckl_spool_file(ckl_spool_t *sp, const char *ext, char **path, FILE **fd);
+char *ckl_spool_path(ckl_spool_t *sp, const char *ext);
+void ckl_spool_close(ckl_spool_t *sp);
+typedef int (*ckl_spool_send_fn)(ckl_conf_t *conf, ckl_msg_t *msg);
+int ckl_spool_recover(ckl_conf_t *conf, ckl_spool_send_fn send);
+
+/* redact functions */
+int ckl_redact_init(ckl_redact_t *r, const char *const *patterns, int count,
+                    ckl_emit_fn emit, void *baton);
+int ckl_redact_write(ckl_redact_t *r, const char *buf, size_t len);
+int ckl_redact_finish(ckl_redact_t *r);
+
+/* segment functions */
+int ckl_segment_init(ckl_segment_t *g, ckl_emit_fn emit,
+                     unsigned long long (*offset)(void *baton), void *baton);
+int ckl_segment_write(ckl_segment_t *g, const char *buf, size_t len);
+void ckl_segment_free(ckl_segment_t *g);
+void ckl_index_escape(FILE *fp, const char *cmdline);
+
+/* normalize functions */
+int ckl_normalize_init(ckl_normalize_t *n, ckl_emit_fn emit, void *baton);
+int ckl_normalize_write(ckl_normalize_t *n, const char *buf, size_t len);
+int ckl_normalize_reset(ckl_normalize_t *n);
+int ckl_normalize_finish(ckl_normalize_t *n);
+
 /* configuration functions */
-int ckl_conf_init(ckl_conf_t *conf);
+int ckl_conf_load(ckl_conf_t *conf, const char *path, const char **why);
 void ckl_conf_free(ckl_conf_t *conf);
 
 /* msg functions */
+int ckl_username(char *buf, size_t len);
 int ckl_msg_init(ckl_msg_t *msg);
 void ckl_msg_free(ckl_msg_t *m);
+void ckl_msg_add_tag(ckl_msg_t *m, const char *tag);
+ckl_msgstream_t *ckl_msgstream_open(int fd, unsigned long long max_bytes);
+size_t ckl_msgstream_read(char *buf, size_t size, size_t nmemb, void *baton);
+void ckl_msgstream_close(ckl_msgstream_t *s);
+int ckl_msg_read_stdin(ckl_msg_t *m, unsigned long long max_bytes);
 
 /* editor functions */
 int ckl_editor_find(const char **output);
@@ -100,5 +548,6 @@ int ckl_editor_setup_file(char **path, FILE **fd);
 int ckl_editor_fill_file(ckl_conf_t *conf, ckl_msg_t *m, FILE *fd);
 int ckl_editor_edit(const char* editor, const char *path);
 int ckl_editor_read_file(ckl_msg_t *m, const char *path);
+size_t ckl_editor_strip(char *buf, size_t len);
 #endif
 
@@ -17,7 +17,8 @@
 
 #include "ckl.h"
 
-static char *next_chunk(char **x_p)
+/* strings from the file live in the conf's arena */
+static char *next_chunk(ckl_conf_t *conf, char **x_p)
 {
   char *p = *x_p;
 
@@ -26,7 +27,77 @@ static char *next_chunk(char **x_p)
   ckl_nuke_newlines(p);
 
   *x_p = p;
-  return strdup(p);
+  return ckl_arena_strdup(&conf->arena, p);
+}
+
+static int next_int(char **x_p)
+{
+  char *p = *x_p;
+
+  while (isspace(p[0])) { p++;};
+
+  *x_p = p;
+  return atoi(p);
+}
+
+/* a byte count, with an optional k, m or g suffix */
+static unsigned long long next_size(char **x_p)
+{
+  char *p = *x_p;
+  char *end = NULL;
+  unsigned long long v;
+
+  while (isspace(p[0])) { p++;};
+
+  v = strtoull(p, &end, 10);
+  switch (tolower(*end)) {
+    case 'g':
+      v *= 1024;
+      /* fall through */
+    case 'm':
+      v *= 1024;
+      /* fall through */
+    case 'k':
+      v *= 1024;
+      break;
+  }
+
+  *x_p = p;
+  return v;
+}
+
+static void conf_add_redact(ckl_conf_t *conf, char *pattern)
+{
+  if (pattern[0] == '\0') {
+    return;
+  }
+
+  conf->redact = ckl_arena_grow(&conf->arena, conf->redact, conf->redact_count,
+                                sizeof(char *));
+  conf->redact[conf->redact_count++] = pattern;
+}
+
+/* one pattern per line, a trailing '*' marks a token prefix */
+static int conf_read_redact_file(ckl_conf_t *conf, const char *path)
+{
+  char buf[8096];
+  char *p = NULL;
+  FILE *fp = fopen(path, "r");
+
+  if (fp == NULL) {
+    fprintf(stderr, "Unable to read redaction patterns: %s\n", path);
+    return -1;
+  }
+
+  while ((p = fgets(buf, sizeof(buf), fp)) != NULL) {
+    if (p[0] == '#') {
+      continue;
+    }
+    conf_add_redact(conf, next_chunk(conf, &p));
+  }
+
+  fclose(fp);
+  return 0;
 }
 
 static int conf_parse(ckl_conf_t *conf, FILE *fp)
@@ -43,38 +114,164 @@ static int conf_parse(ckl_conf_t *conf, FILE *fp)
     
     if (strncmp("ckl_endpoint", p, 12) == 0) {
       p += 12;
-      if (conf->endpoint) {
-        free((char*)conf->endpoint);
-      }
-      conf->endpoint = next_chunk(&p);
+      conf->endpoint = next_chunk(conf, &p);
       continue;
     }
     
+    if (strncmp("ckl_script_native", p, 17) == 0) {
+      p += 17;
+      conf->script_native = next_int(&p);
+      continue;
+    }
+
+    if (strncmp("ckl_script_compress", p, 19) == 0) {
+      p += 19;
+      conf->script_compress = next_int(&p);
+      continue;
+    }
+
+    if (strncmp("ckl_script_normalize", p, 20) == 0) {
+      p += 20;
+      conf->script_normalize = next_int(&p);
+      continue;
+    }
+
+    if (strncmp("ckl_script_keep_raw", p, 19) == 0) {
+      p += 19;
+      conf->script_keep_raw = next_int(&p);
+      continue;
+    }
+
+    if (strncmp("ckl_script_max_bytes", p, 20) == 0) {
+      p += 20;
+      conf->script_max_bytes = next_size(&p);
+      continue;
+    }
+
+    if (strncmp("ckl_script_tail_bytes", p, 21) == 0) {
+      p += 21;
+      conf->script_tail_bytes = next_size(&p);
+      continue;
+    }
+
+    if (strncmp("ckl_script_commands", p, 19) == 0) {
+      p += 19;
+      conf->script_commands = next_int(&p);
+      continue;
+    }
+
+    if (strncmp("ckl_script_io_uring", p, 19) == 0) {
+      p += 19;
+      conf->script_io_uring = next_int(&p);
+      continue;
+    }
+
+    if (strncmp("ckl_upload_compress", p, 19) == 0) {
+      p += 19;
+      conf->upload_compress = next_int(&p);
+      continue;
+    }
+
+    if (strncmp("ckl_upload_threads", p, 18) == 0) {
+      p += 18;
+      conf->upload_threads = next_int(&p);
+      continue;
+    }
+
+    if (strncmp("ckl_exec_tail_bytes", p, 19) == 0) {
+      p += 19;
+      conf->exec_tail_bytes = next_size(&p);
+      continue;
+    }
+
+    if (strncmp("ckl_trace_file", p, 14) == 0) {
+      p += 14;
+      if (ckl_trace_open(next_chunk(conf, &p)) < 0) {
+        return -1;
+      }
+      continue;
+    }
+
+    if (strncmp("ckl_tmp_memory_bytes", p, 20) == 0) {
+      p += 20;
+      conf->tmp_memory_bytes = next_size(&p);
+      continue;
+    }
+
+    if (strncmp("ckl_msg_max_bytes", p, 17) == 0) {
+      p += 17;
+      conf->msg_max_bytes = next_size(&p);
+      continue;
+    }
+
+    if (strncmp("ckl_daemon_socket", p, 17) == 0) {
+      p += 17;
+      conf->daemon_socket = next_chunk(conf, &p);
+      continue;
+    }
+
+    if (strncmp("ckl_store_dir", p, 13) == 0) {
+      p += 13;
+      conf->store_dir = next_chunk(conf, &p);
+      continue;
+    }
+
+    if (strncmp("ckl_metrics_file", p, 16) == 0) {
+      p += 16;
+      conf->metrics_file = next_chunk(conf, &p);
+      continue;
+    }
+
+    if (strncmp("ckl_spool_dir", p, 13) == 0) {
+      p += 13;
+      conf->spool_dir = next_chunk(conf, &p);
+      continue;
+    }
+
+    if (strncmp("ckl_spool_sync_ms", p, 17) == 0) {
+      p += 17;
+      conf->spool_sync_ms = next_int(&p);
+      continue;
+    }
+
+    if (strncmp("ckl_spool_sync_bytes", p, 20) == 0) {
+      p += 20;
+      conf->spool_sync_bytes = next_size(&p);
+      continue;
+    }
+
+    if (strncmp("ckl_redact_file", p, 15) == 0) {
+      p += 15;
+      char *path = next_chunk(conf, &p);
+      int rv = conf_read_redact_file(conf, path);
+      if (rv < 0) {
+        return rv;
+      }
+      continue;
+    }
+
+    if (strncmp("ckl_redact", p, 10) == 0) {
+      p += 10;
+      conf_add_redact(conf, next_chunk(conf, &p));
+      continue;
+    }
+
     /* Deprecated: 'secret' based authentication */
     if (strncmp("secret", p, 6) == 0) {
       p += 6;
-      if (conf->secret) {
-        free((char*)conf->secret);
-      }
-      conf->secret = next_chunk(&p);
+      conf->secret = next_chunk(conf, &p);
       continue;
     }
 
     if (strncmp("oauth_secret", p, 12) == 0) {
       p += 12;
-      if (conf->oauth_secret) {
-        free((char*)conf->oauth_secret);
-      }
-      conf->oauth_secret = next_chunk(&p);
+      conf->oauth_secret = next_chunk(conf, &p);
       continue;
     }
 
     if (strncmp("oauth_key", p, 9) == 0) {
       p += 9;
-      if (conf->oauth_key) {
-        free((char*)conf->oauth_key);
-      }
-      conf->oauth_key = next_chunk(&p);
+      conf->oauth_key = next_chunk(conf, &p);
       continue;
     }
   }
@@ -82,65 +279,99 @@ static int conf_parse(ckl_conf_t *conf, FILE *fp)
   return 0;
 }
 
-int ckl_conf_init(ckl_conf_t *conf)
+static FILE *conf_open(const char *path, const char **why)
 {
-  int rv;
+  char buf[2048];
+  const char *home;
   FILE *fp;
-  
+
+  if (path) {
+    fp = fopen(path, "r");
+    if (fp == NULL) {
+      *why = "Unable to read the configuration file.";
+    }
+    return fp;
+  }
+
   /* TODO: respect prefix */
   fp = fopen("/etc/cloudkick.conf", "r");
+  if (fp != NULL) {
+    return fp;
+  }
+
+  home = getenv("HOME");
+  if (home == NULL) {
+    *why = "HOME is not set";
+    return NULL;
+  }
+
+  snprintf(buf, sizeof(buf), "%s/.ckl", home);
+
+  fp = fopen(buf, "r");
   if (fp == NULL) {
-    char buf[2048];
-    const char *home = getenv("HOME");
-    
-    if (home == NULL) {
-      ckl_error_out("HOME is not set");
-      return -1;
-    }
-    
-    snprintf(buf, sizeof(buf), "%s/.ckl", home);
-    
-    fp = fopen(buf, "r");
-    
-    if (fp == NULL) {
-      fprintf(stderr, "Unable to read configuration file: /etc/cloudkick.conf\n");
-      fprintf(stderr, "Please run cloudkick-config, or visit https://support.cloudkick.com/Ckl/Installation\n");
-      ckl_error_out("Exiting: No configuration file available.");
-      return -1;
-    }
+    *why = "Unable to read configuration file: /etc/cloudkick.conf\n"
+           "Please run cloudkick-config, or visit https://support.cloudkick.com/Ckl/Installation\n"
+           "Exiting: No configuration file available.";
   }
-  
+
+  return fp;
+}
+
+/* the file at path, or the usual ones; on CKL_ERR_CONF *why says why */
+int ckl_conf_load(ckl_conf_t *conf, const char *path, const char **why)
+{
+  int rv;
+  FILE *fp;
+
+  fp = conf_open(path, why);
+  if (fp == NULL) {
+    return CKL_ERR_CONF;
+  }
+
+  /* group commit defaults for the session spool */
+  conf->spool_sync_ms = 1000;
+  conf->spool_sync_bytes = 1024 * 1024;
+  /* output kept from ckl exec */
+  conf->exec_tail_bytes = 64 * 1024;
+  /* how large a session's temp buffers get in memory */
+  conf->tmp_memory_bytes = 8 * 1024 * 1024;
+
+  CKL_TRACE_START(CKL_SPAN_CONFIG, config);
   rv = conf_parse(conf, fp);
+  fclose(fp);
+  CKL_TRACE_DONE(CKL_SPAN_CONFIG, config, rv, 0);
   if (rv < 0) {
-    ckl_error_out("parsing config file failed. \nFor help go to https://support.cloudkick.com/Ckl/Installation");
-    return rv;
+    *why = "parsing config file failed. \nFor help go to https://support.cloudkick.com/Ckl/Installation";
+    return CKL_ERR_CONF;
   }
-  
-  fclose(fp);
-  
+
   if (!conf->endpoint) {
-    conf->endpoint = strdup("https://api.cloudkick.com/changelog/1.0");
+    conf->endpoint = "https://api.cloudkick.com/changelog/1.0";
   }
 
   if (strlen(conf->endpoint) < 8 /* len(http://a) */) {
-    ckl_error_out("Configuration file has invalid ckl_endpoint. \nFor help go to https://support.cloudkick.com/Ckl/Installation");
-    return -1;
+    *why = "Configuration file has invalid ckl_endpoint. \nFor help go to https://support.cloudkick.com/Ckl/Installation";
+    return CKL_ERR_CONF;
   }
-  
+
   if (!conf->oauth_key && !conf->oauth_secret) {
     if (!conf->secret || strlen(conf->secret) < 1) {
-      ckl_error_out("Configuration file is missing secret, oauth_key and oauth_secret. \nFor help go to https://support.cloudkick.com/Ckl/Installation\n");
-      return -1;
+      *why = "Configuration file is missing secret, oauth_key and oauth_secret. \nFor help go to https://support.cloudkick.com/Ckl/Installation\n";
+      return CKL_ERR_CONF;
     }
   }
-  
-  return 0;
+
+  /* a send is still worth making without its counters */
+  if (conf->metrics_file) {
+    ckl_metrics_open(&conf->metrics, conf->metrics_file, conf->endpoint);
+  }
+
+  return CKL_OK;
 }
 
 void ckl_conf_free(ckl_conf_t *conf)
 {
-  free((char*)conf->endpoint);
-  free((char*)conf->secret);
+  ckl_metrics_close(&conf->metrics);
+  ckl_arena_free(&conf->arena);
   free(conf);
 }
-
@@ -0,0 +1,675 @@
+/*
+ * Licensed to Cloudkick, Inc under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * Cloudkick licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE
+#include "ckl.h"
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
+/**
+ * Recording daemon.  `ckl -D` owns the PTY masters of every session on the
+ * host and pumps them all from one epoll loop, so a recorded session costs
+ * a few buffers here instead of a recorder process of its own.
+ *
+ * `ckl -s` still opens the PTY and starts the shell, then hands the daemon
+ * over a Unix socket (SCM_RIGHTS):
+ *
+ *   the user's terminal, reopened non-blocking
+ *   the PTY master
+ *   the log file, and the raw log and command index if it wants them
+ *
+ * The client then sleeps until the daemon reports the session finished,
+ * and uploads the files as usual.  Capture settings (compression,
+ * normalizing, redaction, caps, spool sync) come from the daemon's
+ * configuration.
+ */
+
+#define DAEMON_MAX_FDS 5
+#define DAEMON_BUF_SIZE (16 * 1024)
+#define DAEMON_MAX_EVENTS 256
+
+int ckl_daemon_connect(const char *path)
+{
+  struct sockaddr_un sun;
+  int fd;
+
+  if (strlen(path) >= sizeof(sun.sun_path)) {
+    fprintf(stderr, "Daemon socket path too long: %s\n", path);
+    return -1;
+  }
+
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    perror("socket() failed");
+    return -1;
+  }
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+  memset(&sun, 0, sizeof(sun));
+  sun.sun_family = AF_UNIX;
+  strcpy(sun.sun_path, path);
+
+  if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+int ckl_daemon_attach(int sock, const ckl_daemon_hello_t *hello,
+                      const int *fds, int nfds)
+{
+  struct msghdr mh;
+  struct iovec iov;
+  struct cmsghdr *cm;
+  char cbuf[CMSG_SPACE(DAEMON_MAX_FDS * sizeof(int))];
+  ssize_t rv;
+
+  memset(&mh, 0, sizeof(mh));
+  memset(cbuf, 0, sizeof(cbuf));
+
+  iov.iov_base = (void *)hello;
+  iov.iov_len = sizeof(*hello);
+  mh.msg_iov = &iov;
+  mh.msg_iovlen = 1;
+  mh.msg_control = cbuf;
+  mh.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+
+  cm = CMSG_FIRSTHDR(&mh);
+  cm->cmsg_level = SOL_SOCKET;
+  cm->cmsg_type = SCM_RIGHTS;
+  cm->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+  memcpy(CMSG_DATA(cm), fds, nfds * sizeof(int));
+
+  do {
+    rv = sendmsg(sock, &mh, 0);
+  } while (rv < 0 && errno == EINTR);
+
+  if (rv != sizeof(*hello)) {
+    perror("sendmsg() to daemon failed");
+    return -1;
+  }
+
+  return 0;
+}
+
+#ifdef __linux__
+
+typedef struct daemon_session_t daemon_session_t;
+
+/* what an epoll event points at */
+typedef struct daemon_ref_t {
+  daemon_session_t *s;
+  int which;
+} daemon_ref_t;
+
+enum {
+  REF_SOCK,
+  REF_TTY,
+  REF_MASTER
+};
+
+/**
+ * One buffer per direction.  A side is only read while its buffer is
+ * empty, so a stalled terminal throttles the shell instead of growing
+ * memory.
+ */
+struct daemon_session_t {
+  int sock;
+  int tty;
+  int master;
+  int fds[DAEMON_MAX_FDS];
+  int nfds;
+  int attached;
+  int closed;
+  int eof;
+  int tty_gone;
+  int master_hup;
+  ckl_capture_t capture;
+  daemon_ref_t ref[3];
+  uint32_t events[3];
+  char out[DAEMON_BUF_SIZE];
+  size_t out_off;
+  size_t out_len;
+  char in[DAEMON_BUF_SIZE];
+  size_t in_off;
+  size_t in_len;
+  daemon_session_t *next;
+  daemon_session_t *prev;
+};
+
+typedef struct daemon_t {
+  ckl_conf_t *conf;
+  int ep;
+  int listener;
+  daemon_session_t *sessions;
+  daemon_session_t *dead;
+  int count;
+} daemon_t;
+
+static volatile sig_atomic_t g_daemon_stop = 0;
+
+static void daemon_stop(int signo)
+{
+  g_daemon_stop = 1;
+}
+
+static void daemon_watch(daemon_t *d, daemon_session_t *s, int which, int fd,
+                         uint32_t events)
+{
+  struct epoll_event ev;
+
+  if (s->events[which] == events) {
+    return;
+  }
+
+  ev.events = events;
+  ev.data.ptr = &s->ref[which];
+  epoll_ctl(d->ep, EPOLL_CTL_MOD, fd, &ev);
+  s->events[which] = events;
+}
+
+/* re-arms the terminal and master for whichever buffers need service */
+static void daemon_rearm(daemon_t *d, daemon_session_t *s)
+{
+  uint32_t tty = 0;
+  uint32_t master = 0;
+
+  if (!s->tty_gone) {
+    if (s->in_len == 0) {
+      tty |= EPOLLIN;
+    }
+    if (s->out_len > 0) {
+      tty |= EPOLLOUT;
+    }
+    daemon_watch(d, s, REF_TTY, s->tty, tty);
+  }
+
+  if (!s->master_hup) {
+    if (s->out_len == 0) {
+      master |= EPOLLIN;
+    }
+    if (s->in_len > 0) {
+      master |= EPOLLOUT;
+    }
+    daemon_watch(d, s, REF_MASTER, s->master, master);
+  }
+}
+
+/* epoll keeps reporting a hangup however the mask is set, so a side that
+ * hung up is taken out of the set and served without it */
+static void daemon_unwatch(daemon_t *d, daemon_session_t *s, int which, int fd)
+{
+  epoll_ctl(d->ep, EPOLL_CTL_DEL, fd, NULL);
+  s->events[which] = 0;
+}
+
+static void daemon_close(daemon_t *d, daemon_session_t *s)
+{
+  int i;
+
+  if (s->attached) {
+    if (!s->tty_gone) {
+      epoll_ctl(d->ep, EPOLL_CTL_DEL, s->tty, NULL);
+    }
+    if (!s->master_hup) {
+      epoll_ctl(d->ep, EPOLL_CTL_DEL, s->master, NULL);
+    }
+  }
+  epoll_ctl(d->ep, EPOLL_CTL_DEL, s->sock, NULL);
+
+  for (i = 0; i < s->nfds; i++) {
+    close(s->fds[i]);
+  }
+  close(s->sock);
+
+  if (s->prev) {
+    s->prev->next = s->next;
+  }
+  else {
+    d->sessions = s->next;
+  }
+  if (s->next) {
+    s->next->prev = s->prev;
+  }
+
+  /* later events of this epoll_wait batch may still point at it */
+  s->closed = 1;
+  s->next = d->dead;
+  d->dead = s;
+  d->count--;
+}
+
+/* the shell is gone and its output is on the terminal: wrap up */
+static void daemon_finish(daemon_t *d, daemon_session_t *s)
+{
+  ckl_daemon_reply_t reply;
+
+  memset(&reply, 0, sizeof(reply));
+  reply.magic = CKL_DAEMON_MAGIC;
+  reply.status = ckl_capture_finish(&s->capture);
+  if (s->capture.log.encoding) {
+    reply.flags |= CKL_DAEMON_GZIP;
+  }
+
+  /* the client may already be gone, there is nobody to tell then */
+  send(s->sock, &reply, sizeof(reply), MSG_NOSIGNAL | MSG_DONTWAIT);
+
+  daemon_close(d, s);
+}
+
+static void daemon_add(daemon_t *d, daemon_session_t *s, int which, int fd,
+                       uint32_t events)
+{
+  struct epoll_event ev;
+
+  s->ref[which].s = s;
+  s->ref[which].which = which;
+  s->events[which] = events;
+  ev.events = events;
+  ev.data.ptr = &s->ref[which];
+  epoll_ctl(d->ep, EPOLL_CTL_ADD, fd, &ev);
+}
+
+/* the client's hello: flags plus the descriptors of its session */
+static int daemon_attach(daemon_t *d, daemon_session_t *s)
+{
+  ckl_daemon_hello_t hello;
+  struct msghdr mh;
+  struct iovec iov;
+  struct cmsghdr *cm;
+  char cbuf[CMSG_SPACE(DAEMON_MAX_FDS * sizeof(int))];
+  int want;
+  int raw_fd = -1;
+  int index_fd = -1;
+  ssize_t rv;
+
+  memset(&mh, 0, sizeof(mh));
+  iov.iov_base = &hello;
+  iov.iov_len = sizeof(hello);
+  mh.msg_iov = &iov;
+  mh.msg_iovlen = 1;
+  mh.msg_control = cbuf;
+  mh.msg_controllen = sizeof(cbuf);
+
+  rv = recvmsg(s->sock, &mh, MSG_CMSG_CLOEXEC);
+  if (rv < 0 && (errno == EAGAIN || errno == EINTR)) {
+    return 0;
+  }
+
+  for (cm = CMSG_FIRSTHDR(&mh); cm != NULL; cm = CMSG_NXTHDR(&mh, cm)) {
+    if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS) {
+      s->nfds = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      memcpy(s->fds, CMSG_DATA(cm), s->nfds * sizeof(int));
+    }
+  }
+
+  if (rv != sizeof(hello) || hello.magic != CKL_DAEMON_MAGIC ||
+      (mh.msg_flags & MSG_CTRUNC)) {
+    return -1;
+  }
+
+  want = 3 + !!(hello.flags & CKL_DAEMON_RAW) + !!(hello.flags & CKL_DAEMON_INDEX);
+  if (s->nfds != want) {
+    return -1;
+  }
+
+  s->tty = s->fds[0];
+  s->master = s->fds[1];
+  if (hello.flags & CKL_DAEMON_RAW) {
+    raw_fd = s->fds[3];
+  }
+  if (hello.flags & CKL_DAEMON_INDEX) {
+    index_fd = s->fds[s->nfds - 1];
+  }
+
+  fcntl(s->tty, F_SETFL, fcntl(s->tty, F_GETFL) | O_NONBLOCK);
+  fcntl(s->master, F_SETFL, fcntl(s->master, F_GETFL) | O_NONBLOCK);
+
+  if (ckl_capture_init(&s->capture, d->conf, s->fds[2], raw_fd, index_fd) < 0) {
+    return -1;
+  }
+
+  daemon_add(d, s, REF_TTY, s->tty, EPOLLIN);
+  daemon_add(d, s, REF_MASTER, s->master, EPOLLIN);
+  s->attached = 1;
+
+  /* from now on the socket only tells us if the client goes away */
+  daemon_watch(d, s, REF_SOCK, s->sock, EPOLLRDHUP);
+
+  return 0;
+}
+
+static void daemon_accept(daemon_t *d)
+{
+  daemon_session_t *s;
+  int fd;
+
+  while ((fd = accept4(d->listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+    s = calloc(1, sizeof(daemon_session_t));
+    s->sock = fd;
+    s->next = d->sessions;
+    if (s->next) {
+      s->next->prev = s;
+    }
+    d->sessions = s;
+    d->count++;
+    daemon_add(d, s, REF_SOCK, fd, EPOLLIN | EPOLLRDHUP);
+  }
+}
+
+/**
+ * PTY master -> capture + terminal, until the terminal pushes back, the
+ * master has nothing more, or the shell is gone.
+ */
+static int daemon_output(daemon_session_t *s)
+{
+  ssize_t rv;
+
+  while (1) {
+    if (s->out_len > 0) {
+      rv = s->tty_gone ? (ssize_t)s->out_len : write(s->tty, s->out + s->out_off, s->out_len);
+      if (rv < 0) {
+        if (errno == EAGAIN || errno == EINTR) {
+          return 0;
+        }
+        /* the user's terminal went away, keep recording regardless */
+        rv = s->out_len;
+      }
+      s->out_off += rv;
+      s->out_len -= rv;
+      if (s->out_len > 0) {
+        return 0;
+      }
+    }
+
+    if (s->eof) {
+      return 0;
+    }
+
+    rv = read(s->master, s->out, sizeof(s->out));
+    if (rv < 0 && (errno == EAGAIN || errno == EINTR)) {
+      return 0;
+    }
+    if (rv <= 0) {
+      /* EIO: the shell closed the slave side */
+      s->eof = 1;
+      return 0;
+    }
+    if (ckl_capture_write(&s->capture, s->out, rv) < 0) {
+      return -1;
+    }
+    s->out_off = 0;
+    s->out_len = rv;
+  }
+}
+
+/* terminal -> PTY master */
+static void daemon_input(daemon_session_t *s)
+{
+  ssize_t rv;
+
+  while (1) {
+    if (s->in_len > 0) {
+      rv = s->eof ? (ssize_t)s->in_len : write(s->master, s->in + s->in_off, s->in_len);
+      if (rv < 0) {
+        if (errno == EAGAIN || errno == EINTR) {
+          return;
+        }
+        rv = s->in_len;
+      }
+      s->in_off += rv;
+      s->in_len -= rv;
+      if (s->in_len > 0) {
+        return;
+      }
+    }
+
+    if (s->tty_gone) {
+      return;
+    }
+
+    rv = read(s->tty, s->in, sizeof(s->in));
+    if (rv < 0 && (errno == EAGAIN || errno == EINTR)) {
+      return;
+    }
+    if (rv <= 0) {
+      s->tty_gone = 1;
+      return;
+    }
+    s->in_off = 0;
+    s->in_len = rv;
+  }
+}
+
+static void daemon_event(daemon_t *d, daemon_ref_t *ref, uint32_t events)
+{
+  daemon_session_t *s = ref->s;
+  int rv = 0;
+
+  if (s->closed) {
+    return;
+  }
+
+  switch (ref->which) {
+    case REF_SOCK:
+      if (!s->attached) {
+        if (daemon_attach(d, s) < 0) {
+          daemon_close(d, s);
+        }
+        return;
+      }
+      /* the client is gone: finish with what we have */
+      daemon_finish(d, s);
+      return;
+
+    case REF_TTY:
+      if (events & (EPOLLHUP | EPOLLERR)) {
+        daemon_unwatch(d, s, REF_TTY, s->tty);
+        s->tty_gone = 1;
+      }
+      daemon_input(s);
+      rv = daemon_output(s);
+      break;
+
+    case REF_MASTER:
+      if (events & (EPOLLHUP | EPOLLERR)) {
+        /* the rest is read as the terminal takes it */
+        daemon_unwatch(d, s, REF_MASTER, s->master);
+        s->master_hup = 1;
+      }
+      rv = daemon_output(s);
+      daemon_input(s);
+      break;
+  }
+
+  if (s->tty_gone && s->events[REF_TTY]) {
+    daemon_unwatch(d, s, REF_TTY, s->tty);
+  }
+
+  if (rv < 0 || (s->eof && s->out_len == 0)) {
+    daemon_finish(d, s);
+    return;
+  }
+
+  daemon_rearm(d, s);
+}
+
+static int daemon_listen(const char *path)
+{
+  struct sockaddr_un sun;
+  int fd;
+
+  if (strlen(path) >= sizeof(sun.sun_path)) {
+    fprintf(stderr, "Daemon socket path too long: %s\n", path);
+    return -1;
+  }
+
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    perror("socket() failed");
+    return -1;
+  }
+
+  memset(&sun, 0, sizeof(sun));
+  sun.sun_family = AF_UNIX;
+  strcpy(sun.sun_path, path);
+  unlink(path);
+
+  if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0 ||
+      listen(fd, 128) < 0) {
+    fprintf(stderr, "Unable to listen on %s: %s\n", path, strerror(errno));
+    close(fd);
+    return -1;
+  }
+
+  /* every operator on the host records through us */
+  chmod(path, 0666);
+
+  return fd;
+}
+
+int ckl_daemon_run(ckl_conf_t *conf)
+{
+  struct epoll_event events[DAEMON_MAX_EVENTS];
+  struct epoll_event ev;
+  struct sigaction sa;
+  struct rlimit rl;
+  daemon_t d;
+  int timeout = -1;
+  int i, n;
+
+  if (conf->daemon_socket == NULL) {
+    fprintf(stderr, "ckl_daemon_socket is not set in the configuration\n");
+    return -1;
+  }
+
+  memset(&d, 0, sizeof(d));
+  d.conf = conf;
+
+  /* up to six descriptors per session */
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+
+  d.listener = daemon_listen(conf->daemon_socket);
+  if (d.listener < 0) {
+    return -1;
+  }
+
+  d.ep = epoll_create1(EPOLL_CLOEXEC);
+  if (d.ep < 0) {
+    perror("epoll_create1() failed");
+    return -1;
+  }
+
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL;
+  epoll_ctl(d.ep, EPOLL_CTL_ADD, d.listener, &ev);
+
+  signal(SIGPIPE, SIG_IGN);
+  memset(&sa, 0, sizeof(sa));
+  sigemptyset(&sa.sa_mask);
+  sa.sa_handler = daemon_stop;
+  sigaction(SIGTERM, &sa, NULL);
+  sigaction(SIGINT, &sa, NULL);
+
+  /* the spool's group commit needs a tick when sessions are idle */
+  if (conf->spool_dir) {
+    timeout = conf->spool_sync_ms > 0 ? conf->spool_sync_ms : 1000;
+  }
+
+  while (!g_daemon_stop) {
+    n = epoll_wait(d.ep, events, DAEMON_MAX_EVENTS, timeout);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("epoll_wait() failed");
+      break;
+    }
+
+    for (i = 0; i < n; i++) {
+      if (events[i].data.ptr == NULL) {
+        daemon_accept(&d);
+        continue;
+      }
+      daemon_event(&d, events[i].data.ptr, events[i].events);
+    }
+
+    while (d.dead) {
+      daemon_session_t *s = d.dead;
+      d.dead = s->next;
+      free(s);
+    }
+
+    if (timeout >= 0) {
+      daemon_session_t *s, *next;
+      for (s = d.sessions; s != NULL; s = next) {
+        next = s->next;
+        if (s->attached && ckl_capture_sync(&s->capture) < 0) {
+          daemon_finish(&d, s);
+        }
+      }
+    }
+  }
+
+  /* wrap up what is left, so no client waits forever */
+  while (d.sessions) {
+    if (d.sessions->attached) {
+      daemon_finish(&d, d.sessions);
+    }
+    else {
+      daemon_close(&d, d.sessions);
+    }
+  }
+
+  while (d.dead) {
+    daemon_session_t *s = d.dead;
+    d.dead = s->next;
+    free(s);
+  }
+
+  close(d.ep);
+  close(d.listener);
+  unlink(conf->daemon_socket);
+
+  return 0;
+}
+
+#else
+
+int ckl_daemon_run(ckl_conf_t *conf)
+{
+  fprintf(stderr, "The recording daemon needs epoll and is only available on Linux\n");
+  return -1;
+}
+
+#endif
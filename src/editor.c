@@ -16,6 +16,9 @@
  */
 
 #include "ckl.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 
 int ckl_editor_fill_file(ckl_conf_t *conf, ckl_msg_t *m, FILE *fd)
 {
@@ -36,7 +39,9 @@ int ckl_editor_edit(const char* editor, const char *path)
   /* TODO: proper quoting */
   snprintf(buf, sizeof(buf), "%s '%s'", editor, path);
   
+  CKL_TRACE_START(CKL_SPAN_EDITOR, editor);
   rv = system(buf);
+  CKL_TRACE_DONE(CKL_SPAN_EDITOR, editor, rv, 0);
   if (rv < 0) {
     fprintf(stderr, "os.system failed for cmd '%s'\n", buf);
     perror("system(): ");
@@ -49,37 +54,90 @@ int ckl_editor_edit(const char* editor, const char *path)
   return 0;
 }
 
+/* Drops the comment lines of buf in place and trims the blank lines at
+ * either end; the other lines are kept as typed, newlines included.
+ * Returns the new length. */
+size_t ckl_editor_strip(char *buf, size_t len)
+{
+  const char *p = buf;
+  const char *end = buf + len;
+  size_t out = 0;
+
+  while (p < end) {
+    const char *nl = memchr(p, '\n', end - p);
+    size_t n = nl ? (size_t)(nl - p) + 1 : (size_t)(end - p);
+
+    /* comment lines */
+    if (p[0] != '#') {
+      memmove(buf + out, p, n);
+      out += n;
+    }
+    p += n;
+  }
+
+  while (out > 0 && (buf[out - 1] == '\n' || buf[out - 1] == '\r')) {
+    out--;
+  }
+
+  p = buf;
+  while (p < buf + out && (*p == '\n' || *p == '\r')) {
+    p++;
+  }
+  out -= p - buf;
+  memmove(buf, p, out);
+
+  return out;
+}
+
 int ckl_editor_read_file(ckl_msg_t *m, const char *path)
 {
-  FILE *fp = fopen(path, "r");
-  
-  char *out = strdup("");
-  
-  if (!fp) {
-    ckl_error_out("Unable to read editted file?");
+  struct stat st;
+  size_t size = 8192;
+  size_t len = 0;
+  char *out;
+  int fd = open(path, O_RDONLY);
+
+  if (fd < 0) {
+    perror("Unable to read editted file?");
     return -1;
   }
-  
-  char buf[8096];
-  char *p = NULL;
-  
-  while ((p = fgets(buf, sizeof(buf), fp)) != NULL) {
-    /* comment lines */
-    if (p[0] == '#') {
+
+  /* one read for the whole file; grows if it is still being written */
+  if (fstat(fd, &st) == 0 && st.st_size > 0) {
+    size = st.st_size + 1;
+  }
+  out = malloc(size);
+
+  for (;;) {
+    ssize_t n;
+
+    if (len + 1 >= size) {
+      size *= 2;
+      out = realloc(out, size);
+    }
+
+    n = read(fd, out + len, size - len - 1);
+    if (n < 0 && errno == EINTR) {
       continue;
     }
-    
-    ckl_nuke_newlines(p);
-    
-    char *t = calloc(1, strlen(out) + strlen(p) + 1);
-    strncpy(t, out, strlen(out));
-    strncpy(t+strlen(out), p, strlen(p));
-    free(out);
-    out = t;
+    if (n < 0) {
+      perror("read() of editted file failed");
+      close(fd);
+      free(out);
+      return -1;
+    }
+    if (n == 0) {
+      break;
+    }
+    len += n;
   }
-  
-  m->msg = out;
-  
+
+  close(fd);
+
+  len = ckl_editor_strip(out, len);
+  out[len] = '\0';
+  m->msg = ckl_arena_own(&m->arena, out);
+
   return 0;
 }
 
@@ -0,0 +1,406 @@
+/*
+ * Licensed to Cloudkick, Inc under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * Cloudkick licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE
+#include "ckl.h"
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+/**
+ * ckl exec -- <command>: runs the command itself, with posix_spawnp (a
+ * vfork underneath, no shell), and waits for it with wait4() for the CPU
+ * time.  Its stdout and stderr go through pipes that ckl copies to its
+ * own, keeping the last exec_tail_bytes in a ring; with a tail size of 0
+ * the command gets ckl's stdio as-is and nothing is copied.  A stream that
+ * is a terminal is never captured, so commands that check isatty() behave
+ * as they would without ckl.
+ *
+ * The command is done when it exits, not when its pipes close: a daemon
+ * it started in the background may hold them open for good.  Once it is
+ * reaped, what is already in the pipes is copied and the rest dropped.
+ *
+ * Like system(), ckl ignores SIGINT and SIGQUIT while the command runs,
+ * so ^C stops the command and the entry is still sent.
+ */
+
+extern char **environ;
+
+#define EXEC_READ_SIZE (64 * 1024)
+/* how often to look for the exit without a pidfd to poll */
+#define EXEC_REAP_POLL_MS 100
+
+static double exec_ms(const struct timespec *a, const struct timespec *b)
+{
+  return (b->tv_sec - a->tv_sec) * 1e3 + (b->tv_nsec - a->tv_nsec) / 1e6;
+}
+
+static double tv_ms(const struct timeval *tv)
+{
+  return tv->tv_sec * 1e3 + tv->tv_usec / 1e3;
+}
+
+/* the command line as a shell would take it back */
+static char *exec_cmdline(char *const *argv)
+{
+  size_t len = 1;
+  char *out;
+  char *p;
+  int i;
+
+  for (i = 0; argv[i]; i++) {
+    len += strlen(argv[i]) * 4 + 3;
+  }
+
+  p = out = malloc(len);
+  for (i = 0; argv[i]; i++) {
+    const char *a = argv[i];
+    int plain = a[0] != '\0';
+
+    for (; *a && plain; a++) {
+      plain = isalnum((unsigned char)*a) || strchr("-_./=:,+@%", *a) != NULL;
+    }
+
+    if (i > 0) {
+      *p++ = ' ';
+    }
+
+    if (plain) {
+      p += sprintf(p, "%s", argv[i]);
+      continue;
+    }
+
+    *p++ = '\'';
+    for (a = argv[i]; *a; a++) {
+      if (*a == '\'') {
+        memcpy(p, "'\\''", 4);
+        p += 4;
+      }
+      else {
+        *p++ = *a;
+      }
+    }
+    *p++ = '\'';
+  }
+  *p = '\0';
+
+  return out;
+}
+
+/* returns what was read, 0 once the pipe is closed */
+static ssize_t exec_relay(ckl_exec_t *e, struct pollfd *pfd, int *open_fds,
+                          int i, char *buf)
+{
+  ssize_t n = read(pfd[i].fd, buf, EXEC_READ_SIZE);
+  ssize_t off = 0;
+  int out = i == 0 ? STDOUT_FILENO : STDERR_FILENO;
+
+  if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+    return -1;
+  }
+
+  if (n <= 0) {
+    close(pfd[i].fd);
+    pfd[i].fd = -1;
+    (*open_fds)--;
+    return 0;
+  }
+
+  ckl_ring_write(&e->tail, buf, n);
+  e->output_bytes += n;
+
+  /* once our side is gone (EPIPE), keep reading so the command can finish */
+  while (e->relay[i] && off < n) {
+    ssize_t w = write(out, buf + off, n - off);
+    if (w < 0 && errno == EINTR) {
+      continue;
+    }
+    if (w < 0) {
+      e->relay[i] = 0;
+      break;
+    }
+    off += w;
+  }
+
+  return n;
+}
+
+/* readable when the command exits, -1 on kernels without pidfds */
+static int exec_pidfd(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+  return syscall(SYS_pidfd_open, pid, 0);
+#else
+  return -1;
+#endif
+}
+
+/* copies what the command left in the pipes, but nothing written after */
+static void exec_drain(ckl_exec_t *e, struct pollfd *pfd, int *open_fds,
+                       char *buf)
+{
+  int i;
+
+  for (i = 0; i < 2; i++) {
+    int avail = 0;
+
+    if (pfd[i].fd < 0 || ioctl(pfd[i].fd, FIONREAD, &avail) < 0) {
+      continue;
+    }
+    while (avail > 0 && pfd[i].fd >= 0) {
+      ssize_t n = exec_relay(e, pfd, open_fds, i, buf);
+      if (n < 0) {
+        break;
+      }
+      avail -= n;
+    }
+  }
+}
+
+int ckl_exec_run(ckl_exec_t *e, ckl_conf_t *conf, char *const *argv)
+{
+  posix_spawn_file_actions_t fa;
+  posix_spawnattr_t attr;
+  struct sigaction ign, old_int, old_quit, old_pipe;
+  struct pollfd pfd[3] = {{-1, POLLIN, 0}, {-1, POLLIN, 0}, {-1, POLLIN, 0}};
+  struct timespec start, end;
+  struct rusage ru;
+  sigset_t dfl;
+  int pipes[2][2] = {{-1, -1}, {-1, -1}};
+  int capture[2];
+  int open_fds = 0;
+  int reaped = 0;
+  int status = 0;
+  pid_t pid;
+  int rv;
+  int i;
+
+  memset(e, 0, sizeof(*e));
+  e->cmdline = exec_cmdline(argv);
+  e->relay[0] = e->relay[1] = 1;
+
+  capture[0] = conf->exec_tail_bytes > 0 && !isatty(STDOUT_FILENO);
+  capture[1] = conf->exec_tail_bytes > 0 && !isatty(STDERR_FILENO);
+
+  if (capture[0] || capture[1]) {
+    if (ckl_ring_init(&e->tail, conf->exec_tail_bytes) < 0) {
+      perror("setting up the output of the command failed");
+      return -1;
+    }
+  }
+
+  posix_spawn_file_actions_init(&fa);
+  for (i = 0; i < 2; i++) {
+    if (!capture[i]) {
+      continue;
+    }
+    if (pipe2(pipes[i], O_CLOEXEC) < 0) {
+      perror("setting up the output of the command failed");
+      posix_spawn_file_actions_destroy(&fa);
+      if (i == 1 && capture[0]) {
+        close(pipes[0][0]);
+        close(pipes[0][1]);
+      }
+      return -1;
+    }
+    posix_spawn_file_actions_adddup2(&fa, pipes[i][1],
+                                     i == 0 ? STDOUT_FILENO : STDERR_FILENO);
+  }
+
+  memset(&ign, 0, sizeof(ign));
+  ign.sa_handler = SIG_IGN;
+  sigaction(SIGINT, &ign, &old_int);
+  sigaction(SIGQUIT, &ign, &old_quit);
+  sigaction(SIGPIPE, &ign, &old_pipe);
+
+  /* the command gets back the dispositions ckl was started with */
+  posix_spawnattr_init(&attr);
+  sigemptyset(&dfl);
+  if (old_int.sa_handler != SIG_IGN) {
+    sigaddset(&dfl, SIGINT);
+  }
+  if (old_quit.sa_handler != SIG_IGN) {
+    sigaddset(&dfl, SIGQUIT);
+  }
+  if (old_pipe.sa_handler != SIG_IGN) {
+    sigaddset(&dfl, SIGPIPE);
+  }
+  posix_spawnattr_setsigdefault(&attr, &dfl);
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  rv = posix_spawnp(&pid, argv[0], &fa, &attr, argv, environ);
+
+  posix_spawn_file_actions_destroy(&fa);
+  posix_spawnattr_destroy(&attr);
+
+  for (i = 0; i < 2; i++) {
+    if (capture[i]) {
+      close(pipes[i][1]);
+      pfd[i].fd = pipes[i][0];
+      open_fds++;
+    }
+  }
+
+  if (rv != 0) {
+    /* what a shell reports for a command it cannot run */
+    fprintf(stderr, "ckl exec: %s: %s\n", argv[0], strerror(rv));
+    e->exit_code = rv == ENOENT ? 127 : 126;
+    for (i = 0; i < 2; i++) {
+      if (pfd[i].fd >= 0) {
+        close(pfd[i].fd);
+      }
+    }
+  }
+  else {
+    if (open_fds > 0) {
+      char *buf = malloc(EXEC_READ_SIZE);
+
+      pfd[2].fd = exec_pidfd(pid);
+
+      while (open_fds > 0) {
+        int timeout = pfd[2].fd >= 0 ? -1 : EXEC_REAP_POLL_MS;
+
+        if (poll(pfd, 3, timeout) < 0) {
+          if (errno == EINTR) {
+            continue;
+          }
+          perror("poll() on the output of the command failed");
+          break;
+        }
+
+        for (i = 0; i < 2; i++) {
+          if (pfd[i].fd >= 0 && pfd[i].revents) {
+            exec_relay(e, pfd, &open_fds, i, buf);
+          }
+        }
+
+        if (pfd[2].fd < 0 || pfd[2].revents) {
+          rv = wait4(pid, &status, WNOHANG, &ru);
+          if (rv == pid) {
+            reaped = 1;
+            exec_drain(e, pfd, &open_fds, buf);
+            break;
+          }
+        }
+      }
+
+      free(buf);
+      for (i = 0; i < 3; i++) {
+        if (pfd[i].fd >= 0) {
+          close(pfd[i].fd);
+        }
+      }
+    }
+
+    while (!reaped && wait4(pid, &status, 0, &ru) < 0) {
+      if (errno != EINTR) {
+        perror("wait4() for the command failed");
+        memset(&ru, 0, sizeof(ru));
+        break;
+      }
+    }
+
+    if (WIFSIGNALED(status)) {
+      e->exit_code = 128 + WTERMSIG(status);
+    }
+    else {
+      e->exit_code = WEXITSTATUS(status);
+    }
+    e->user_ms = tv_ms(&ru.ru_utime);
+    e->sys_ms = tv_ms(&ru.ru_stime);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  e->wall_ms = exec_ms(&start, &end);
+
+  /* SIGPIPE stays ignored, so the entry is still sent and the exit
+   * status kept if whatever read our output has gone away */
+  sigaction(SIGINT, &old_int, NULL);
+  sigaction(SIGQUIT, &old_quit, NULL);
+
+  return 0;
+}
+
+static int exec_emit(void *baton, const char *buf, size_t len)
+{
+  return fwrite(buf, 1, len, baton) == len ? 0 : -1;
+}
+
+/* The output tail as the script log, and an index with the one command,
+ * so the endpoint shows its exit status and duration like a session's.
+ * Both are temp buffers, open until ckl_exec_free(). */
+int ckl_exec_files(ckl_exec_t *e, ckl_conf_t *conf, ckl_msg_t *msg)
+{
+  char *path;
+  FILE *fp;
+
+  if (e->output_bytes > 0) {
+    if (ckl_tmp_buffer(&path, &fp,
+                       conf->exec_tail_bytes <= conf->tmp_memory_bytes) < 0) {
+      return -1;
+    }
+    e->files[0] = fp;
+    msg->script_log = ckl_arena_own(&msg->arena, path);
+    if (e->tail.dropped > 0) {
+      fprintf(fp, "[ckl: %llu bytes elided]\n", e->tail.dropped);
+    }
+    ckl_ring_drain(&e->tail, exec_emit, fp);
+    if (fflush(fp) != 0) {
+      perror("writing the output of the command failed");
+      return -1;
+    }
+  }
+
+  if (ckl_tmp_buffer(&path, &fp, conf->tmp_memory_bytes > 0) < 0) {
+    return -1;
+  }
+  e->files[1] = fp;
+  msg->script_index = ckl_arena_own(&msg->arena, path);
+  fprintf(fp, "0\t0\t%llu\t%d\t", (unsigned long long)e->wall_ms, e->exit_code);
+  ckl_index_escape(fp, e->cmdline);
+  fputc('\n', fp);
+  if (fflush(fp) != 0) {
+    perror("writing the command index failed");
+    return -1;
+  }
+
+  return 0;
+}
+
+void ckl_exec_free(ckl_exec_t *e)
+{
+  int i;
+
+  for (i = 0; i < 2; i++) {
+    if (e->files[i] != NULL) {
+      fclose(e->files[i]);
+    }
+  }
+  free(e->cmdline);
+  if (e->tail.buf) {
+    ckl_ring_free(&e->tail);
+  }
+}
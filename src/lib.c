@@ -0,0 +1,250 @@
+/*
+ * Licensed to Cloudkick, Inc under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * Cloudkick licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ckl.h"
+#include <stdio.h>
+#include <stdarg.h>
+#include <time.h>
+#include <pthread.h>
+
+/**
+ * The libckl API, see libckl.h.  A context is the same conf, message and
+ * transport the ckl binary uses, kept between messages: the identity is
+ * looked up once, and the curl handle, with its connection, lives as
+ * long as the context.
+ */
+
+struct ckl_ctx_t {
+  pthread_mutex_t lock;
+  ckl_conf_t *conf;
+  ckl_transport_t *transport;
+  char username[256];
+  char hostname[HOST_NAME_MAX + 1];
+  char error[512];
+};
+
+static pthread_once_t lib_once = PTHREAD_ONCE_INIT;
+static int lib_init_rv;
+
+static void lib_init(void)
+{
+  ckl_trace_init();
+  lib_init_rv = ckl_transport_global_init(CURL_GLOBAL_DEFAULT);
+}
+
+int ckl_global_init(void)
+{
+  pthread_once(&lib_once, lib_init);
+  return lib_init_rv;
+}
+
+void ckl_global_cleanup(void)
+{
+  ckl_transport_cleanup();
+}
+
+static int ctx_fail(ckl_ctx_t *ctx, int err, const char *fmt, ...)
+{
+  va_list ap;
+
+  va_start(ap, fmt);
+  vsnprintf(ctx->error, sizeof(ctx->error), fmt, ap);
+  va_end(ap);
+
+  return err;
+}
+
+ckl_ctx_t *ckl_ctx_new(void)
+{
+  ckl_ctx_t *ctx = calloc(1, sizeof(ckl_ctx_t));
+
+  if (ctx == NULL) {
+    return NULL;
+  }
+
+  pthread_mutex_init(&ctx->lock, NULL);
+  return ctx;
+}
+
+/* the endpoint's reply is for a person at a terminal */
+static size_t ctx_discard(char *buf, size_t size, size_t nmemb, void *baton)
+{
+  return size * nmemb;
+}
+
+/* back to as ckl_ctx_new() left it, so that a failed load can be retried */
+static void ctx_unload(ckl_ctx_t *ctx)
+{
+  if (ctx->transport) {
+    ckl_transport_free(ctx->transport);
+    ctx->transport = NULL;
+  }
+  if (ctx->conf) {
+    ckl_conf_free(ctx->conf);
+    ctx->conf = NULL;
+  }
+}
+
+static int ctx_load(ckl_ctx_t *ctx, const char *path)
+{
+  const char *why = NULL;
+  int rv;
+
+  rv = ckl_global_init();
+  if (rv != CKL_OK) {
+    return ctx_fail(ctx, rv, "curl_global_init() failed");
+  }
+
+  ctx->conf = calloc(1, sizeof(ckl_conf_t));
+  if (ctx->conf == NULL) {
+    return ctx_fail(ctx, CKL_ERR_NOMEM, "out of memory");
+  }
+
+  rv = ckl_conf_load(ctx->conf, path, &why);
+  if (rv != CKL_OK) {
+    ctx_unload(ctx);
+    return ctx_fail(ctx, rv, "%s", why);
+  }
+
+  if (ckl_username(ctx->username, sizeof(ctx->username)) < 0) {
+    ctx_unload(ctx);
+    return ctx_fail(ctx, CKL_ERR_SYSTEM, "unable to tell which user this is");
+  }
+
+  if (ckl_hostname(ctx->hostname, sizeof(ctx->hostname)) < 0) {
+    ctx_unload(ctx);
+    return ctx_fail(ctx, CKL_ERR_SYSTEM, "gethostname() failed");
+  }
+
+  ctx->transport = calloc(1, sizeof(ckl_transport_t));
+  rv = ckl_transport_init(ctx->transport, ctx->conf);
+  if (rv != CKL_OK) {
+    ctx_unload(ctx);
+    return ctx_fail(ctx, rv, "setting up curl failed");
+  }
+  curl_easy_setopt(ctx->transport->curl, CURLOPT_WRITEFUNCTION, ctx_discard);
+
+  return CKL_OK;
+}
+
+int ckl_ctx_load(ckl_ctx_t *ctx, const char *path)
+{
+  int rv;
+
+  pthread_mutex_lock(&ctx->lock);
+  if (ctx->conf != NULL) {
+    rv = ctx_fail(ctx, CKL_ERR_INVALID, "the context is already loaded");
+  }
+  else {
+    rv = ctx_load(ctx, path);
+  }
+  pthread_mutex_unlock(&ctx->lock);
+
+  return rv;
+}
+
+/* the message only points at the caller's strings and the context's */
+static int ctx_send(ckl_ctx_t *ctx, ckl_msg_t *msg, const char *message,
+                    const char *const *tags, int tag_count,
+                    const char *script_log)
+{
+  int i;
+  int rv;
+
+  if (ctx->transport == NULL) {
+    return ctx_fail(ctx, CKL_ERR_INVALID, "the context has no configuration");
+  }
+
+  if (message == NULL) {
+    return ctx_fail(ctx, CKL_ERR_INVALID, "no message specified");
+  }
+
+  for (i = 0; i < tag_count; i++) {
+    const char *eq = strchr(tags[i], '=');
+    if (eq == NULL || eq == tags[i]) {
+      return ctx_fail(ctx, CKL_ERR_INVALID, "tag '%s' is not key=value", tags[i]);
+    }
+  }
+
+  msg->username = ctx->username;
+  msg->hostname = ctx->hostname;
+  msg->msg = message;
+  msg->tags = (const char **)tags;
+  msg->tag_count = tag_count;
+  msg->script_log = script_log;
+  msg->ts = time(NULL);
+
+  rv = ckl_transport_msg_send(ctx->transport, ctx->conf, msg);
+  if (rv != CKL_OK) {
+    return ctx_fail(ctx, rv, "sending to %s failed: %s", ctx->conf->endpoint,
+                    ctx->transport->error[0] ? ctx->transport->error :
+                    ckl_strerror(rv));
+  }
+
+  return CKL_OK;
+}
+
+int ckl_ctx_send(ckl_ctx_t *ctx, const char *message,
+                 const char *const *tags, int tag_count,
+                 const char *script_log)
+{
+  ckl_msg_t msg;
+  int rv;
+
+  memset(&msg, 0, sizeof(msg));
+
+  pthread_mutex_lock(&ctx->lock);
+  rv = ctx_send(ctx, &msg, message, tags, tag_count, script_log);
+  pthread_mutex_unlock(&ctx->lock);
+
+  ckl_arena_free(&msg.arena);
+  return rv;
+}
+
+const char *ckl_ctx_error(ckl_ctx_t *ctx)
+{
+  return ctx->error;
+}
+
+void ckl_ctx_free(ckl_ctx_t *ctx)
+{
+  ctx_unload(ctx);
+  pthread_mutex_destroy(&ctx->lock);
+  free(ctx);
+}
+
+const char *ckl_strerror(int err)
+{
+  switch (err) {
+    case CKL_OK:
+      return "success";
+    case CKL_ERR_NOMEM:
+      return "out of memory";
+    case CKL_ERR_CONF:
+      return "configuration error";
+    case CKL_ERR_INVALID:
+      return "invalid argument";
+    case CKL_ERR_SYSTEM:
+      return "system error";
+    case CKL_ERR_NETWORK:
+      return "endpoint unreachable";
+    case CKL_ERR_HTTP:
+      return "endpoint returned an error";
+  }
+
+  return "unknown error";
+}
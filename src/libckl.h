@@ -0,0 +1,89 @@
+/*
+ * Licensed to Cloudkick, Inc under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * Cloudkick licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _libckl_h_
+#define _libckl_h_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * libckl: logging changes from inside a program, without running ckl.
+ *
+ *   ckl_global_init();
+ *   ckl_ctx_t *ctx = ckl_ctx_new();
+ *   if (ckl_ctx_load(ctx, NULL) != CKL_OK ||
+ *       ckl_ctx_send(ctx, "rolled out web 1.4", tags, 1, NULL) != CKL_OK) {
+ *     fprintf(stderr, "%s\n", ckl_ctx_error(ctx));
+ *   }
+ *   ckl_ctx_free(ctx);
+ *
+ * Nothing in the library exits the process; every call returns one of
+ * the codes below.  A context keeps its configuration, the user and
+ * host it logs as, and one HTTP connection to the endpoint that is
+ * reused from one message to the next.  Its calls are serialized, so
+ * threads may share a context, or have one each to send in parallel.
+ */
+
+typedef enum ckl_err_e {
+  CKL_OK = 0,
+  CKL_ERR_NOMEM = -1,
+  /* no configuration file, or one ckl cannot use */
+  CKL_ERR_CONF = -2,
+  /* a bad argument, e.g. a tag that is not key=value */
+  CKL_ERR_INVALID = -3,
+  /* the user or host name, temp files, or curl itself */
+  CKL_ERR_SYSTEM = -4,
+  /* the endpoint could not be reached */
+  CKL_ERR_NETWORK = -5,
+  /* the endpoint answered, with an error status */
+  CKL_ERR_HTTP = -6
+} ckl_err_e;
+
+typedef struct ckl_ctx_t ckl_ctx_t;
+
+/* libckl.so is built with -fvisibility=hidden and exports these alone */
+#if defined(__GNUC__)
+#define CKL_API __attribute__((visibility("default")))
+#else
+#define CKL_API
+#endif
+
+/* Sets up curl.  Safe to call from any number of threads, and more than
+ * once; ckl_ctx_load() calls it too. */
+CKL_API int ckl_global_init(void);
+CKL_API void ckl_global_cleanup(void);
+
+CKL_API ckl_ctx_t *ckl_ctx_new(void);
+/* the configuration file at path, or with NULL the one ckl would read */
+CKL_API int ckl_ctx_load(ckl_ctx_t *ctx, const char *path);
+/* tags are key=value, script_log a file to attach as the session log */
+CKL_API int ckl_ctx_send(ckl_ctx_t *ctx, const char *message,
+                         const char *const *tags, int tag_count,
+                         const char *script_log);
+/* what the last failed call on ctx ran into */
+CKL_API const char *ckl_ctx_error(ckl_ctx_t *ctx);
+CKL_API void ckl_ctx_free(ckl_ctx_t *ctx);
+
+CKL_API const char *ckl_strerror(int err);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
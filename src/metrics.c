@@ -0,0 +1,313 @@
+/*
+ * Licensed to Cloudkick, Inc under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * Cloudkick licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ckl.h"
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/**
+ * Delivery counters that outlive the run, for alerting on ckl across a
+ * fleet.  ckl_metrics_file names a small file that every ckl on the host
+ * maps shared; each endpoint gets a slot of counters in it, bumped with
+ * atomic adds, so a send costs a few nanoseconds and no syscall, and runs
+ * in parallel need no lock.  The kernel writes the pages back.
+ *
+ * `ckl --metrics` renders the file in the Prometheus text format, for
+ * node_exporter's textfile collector.
+ *
+ * A slot is claimed by the first ckl to send to its endpoint: free (0) is
+ * swapped for claimed (1), the name is written, then the slot is made
+ * ready (2) for the others to match on.
+ */
+
+#define METRICS_MAGIC 0x6d6c6b63 /* "cklm" */
+#define METRICS_VERSION 1
+#define METRICS_ENDPOINTS 16
+#define METRICS_NAME_SIZE 232
+
+enum {
+  SLOT_FREE,
+  SLOT_CLAIMED,
+  SLOT_READY
+};
+
+/* upper bounds of the latency buckets, in microseconds; one more for +Inf */
+static const uint64_t metrics_bounds[] = {
+  5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000,
+  5000000, 10000000
+};
+
+#define METRICS_BUCKETS (sizeof(metrics_bounds) / sizeof(metrics_bounds[0]) + 1)
+
+struct ckl_metrics_endpoint_t {
+  uint32_t state;
+  uint32_t pad;
+  char name[METRICS_NAME_SIZE];
+  uint64_t sent;
+  uint64_t failed;
+  uint64_t retries;
+  uint64_t bytes;
+  uint64_t latency_us;
+  /* per bucket, made cumulative when rendered */
+  uint64_t latency[METRICS_BUCKETS];
+};
+
+struct ckl_metrics_file_t {
+  uint32_t magic;
+  uint32_t version;
+  struct ckl_metrics_endpoint_t endpoints[METRICS_ENDPOINTS];
+};
+
+static struct ckl_metrics_file_t *metrics_map(const char *path, int writable)
+{
+  struct ckl_metrics_file_t *f;
+  size_t size = sizeof(struct ckl_metrics_file_t);
+  struct stat st;
+  int fd;
+
+  fd = open(path, (writable ? O_RDWR | O_CREAT : O_RDONLY) | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    fprintf(stderr, "Unable to open metrics file %s: %s\n", path,
+            strerror(errno));
+    return NULL;
+  }
+
+  /* a new file is zeros, which is every slot free */
+  if (fstat(fd, &st) < 0 ||
+      (st.st_size < size && (!writable || ftruncate(fd, size) < 0))) {
+    fprintf(stderr, "Unable to size metrics file %s: %s\n", path,
+            writable ? strerror(errno) : "file is too short");
+    close(fd);
+    return NULL;
+  }
+
+  f = mmap(NULL, size, writable ? PROT_READ | PROT_WRITE : PROT_READ,
+           MAP_SHARED, fd, 0);
+  close(fd);
+  if (f == MAP_FAILED) {
+    fprintf(stderr, "Unable to map metrics file %s: %s\n", path,
+            strerror(errno));
+    return NULL;
+  }
+
+  if (writable) {
+    __sync_bool_compare_and_swap(&f->magic, 0, METRICS_MAGIC);
+    __sync_bool_compare_and_swap(&f->version, 0, METRICS_VERSION);
+  }
+
+  if (f->magic != METRICS_MAGIC || f->version != METRICS_VERSION) {
+    fprintf(stderr, "%s is not a ckl metrics file\n", path);
+    munmap(f, size);
+    return NULL;
+  }
+
+  return f;
+}
+
+static struct ckl_metrics_endpoint_t *metrics_slot(struct ckl_metrics_file_t *f,
+                                                   const char *endpoint)
+{
+  int i;
+
+  for (i = 0; i < METRICS_ENDPOINTS; i++) {
+    struct ckl_metrics_endpoint_t *ep = &f->endpoints[i];
+    uint32_t state = __atomic_load_n(&ep->state, __ATOMIC_ACQUIRE);
+    int spins = 0;
+
+    if (state == SLOT_FREE &&
+        __sync_bool_compare_and_swap(&ep->state, SLOT_FREE, SLOT_CLAIMED)) {
+      snprintf(ep->name, sizeof(ep->name), "%s", endpoint);
+      __atomic_store_n(&ep->state, SLOT_READY, __ATOMIC_RELEASE);
+      return ep;
+    }
+
+    /* a name is a few stores away, unless its ckl died claiming it */
+    while (state != SLOT_READY && spins++ < 1000) {
+      sched_yield();
+      state = __atomic_load_n(&ep->state, __ATOMIC_ACQUIRE);
+    }
+
+    if (state == SLOT_READY && strncmp(ep->name, endpoint, sizeof(ep->name) - 1) == 0) {
+      return ep;
+    }
+  }
+
+  return NULL;
+}
+
+int ckl_metrics_open(ckl_metrics_t *m, const char *path, const char *endpoint)
+{
+  memset(m, 0, sizeof(*m));
+
+  m->file = metrics_map(path, 1);
+  if (m->file == NULL) {
+    return -1;
+  }
+
+  m->ep = metrics_slot(m->file, endpoint);
+  if (m->ep == NULL) {
+    fprintf(stderr, "Metrics file %s has no room for endpoint %s\n", path,
+            endpoint);
+    return -1;
+  }
+
+  return 0;
+}
+
+void ckl_metrics_request(ckl_metrics_t *m, unsigned long long bytes,
+                         unsigned long long usec)
+{
+  size_t i;
+
+  if (m->ep == NULL) {
+    return;
+  }
+
+  for (i = 0; i < METRICS_BUCKETS - 1 && usec > metrics_bounds[i]; i++);
+
+  __atomic_fetch_add(&m->ep->latency[i], 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&m->ep->latency_us, usec, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&m->ep->bytes, bytes, __ATOMIC_RELAXED);
+}
+
+void ckl_metrics_result(ckl_metrics_t *m, int ok)
+{
+  if (m->ep == NULL) {
+    return;
+  }
+
+  __atomic_fetch_add(ok ? &m->ep->sent : &m->ep->failed, 1, __ATOMIC_RELAXED);
+}
+
+void ckl_metrics_retry(ckl_metrics_t *m)
+{
+  if (m->ep == NULL) {
+    return;
+  }
+
+  __atomic_fetch_add(&m->ep->retries, 1, __ATOMIC_RELAXED);
+}
+
+void ckl_metrics_close(ckl_metrics_t *m)
+{
+  if (m->file != NULL) {
+    munmap(m->file, sizeof(struct ckl_metrics_file_t));
+  }
+  memset(m, 0, sizeof(*m));
+}
+
+/* a label value: backslash, double quote and newline escaped */
+static void metrics_label(FILE *out, const char *name)
+{
+  fputs("{endpoint=\"", out);
+  for (; *name; name++) {
+    if (*name == '\\' || *name == '"') {
+      fputc('\\', out);
+      fputc(*name, out);
+    }
+    else if (*name == '\n') {
+      fputs("\\n", out);
+    }
+    else {
+      fputc(*name, out);
+    }
+  }
+  fputc('"', out);
+}
+
+static void metrics_counter(FILE *out, struct ckl_metrics_file_t *f,
+                            const char *name, const char *help, size_t offset)
+{
+  int i;
+
+  fprintf(out, "# HELP %s %s\n# TYPE %s counter\n", name, help, name);
+  for (i = 0; i < METRICS_ENDPOINTS; i++) {
+    struct ckl_metrics_endpoint_t *ep = &f->endpoints[i];
+
+    if (__atomic_load_n(&ep->state, __ATOMIC_ACQUIRE) != SLOT_READY) {
+      continue;
+    }
+    fputs(name, out);
+    metrics_label(out, ep->name);
+    fprintf(out, "} %llu\n", (unsigned long long)
+            __atomic_load_n((uint64_t *)((char *)ep + offset), __ATOMIC_RELAXED));
+  }
+}
+
+int ckl_metrics_render(const char *path, FILE *out)
+{
+  static const char *hist = "ckl_request_duration_seconds";
+  struct ckl_metrics_file_t *f = metrics_map(path, 0);
+  int i;
+
+  if (f == NULL) {
+    return -1;
+  }
+
+  metrics_counter(out, f, "ckl_messages_sent_total",
+                  "Entries the endpoint accepted.",
+                  offsetof(struct ckl_metrics_endpoint_t, sent));
+  metrics_counter(out, f, "ckl_messages_failed_total",
+                  "Entries that could not be sent.",
+                  offsetof(struct ckl_metrics_endpoint_t, failed));
+  metrics_counter(out, f, "ckl_retries_total",
+                  "Spooled sessions sent again after an interrupted run.",
+                  offsetof(struct ckl_metrics_endpoint_t, retries));
+  metrics_counter(out, f, "ckl_upload_bytes_total",
+                  "Bytes of request bodies uploaded.",
+                  offsetof(struct ckl_metrics_endpoint_t, bytes));
+
+  fprintf(out, "# HELP %s Time to send an entry, connect to response.\n"
+          "# TYPE %s histogram\n", hist, hist);
+  for (i = 0; i < METRICS_ENDPOINTS; i++) {
+    struct ckl_metrics_endpoint_t *ep = &f->endpoints[i];
+    uint64_t count = 0;
+    size_t b;
+
+    if (__atomic_load_n(&ep->state, __ATOMIC_ACQUIRE) != SLOT_READY) {
+      continue;
+    }
+
+    for (b = 0; b < METRICS_BUCKETS; b++) {
+      count += __atomic_load_n(&ep->latency[b], __ATOMIC_RELAXED);
+      fprintf(out, "%s_bucket", hist);
+      metrics_label(out, ep->name);
+      if (b < METRICS_BUCKETS - 1) {
+        fprintf(out, ",le=\"%g\"} %llu\n", metrics_bounds[b] / 1e6,
+                (unsigned long long)count);
+      }
+      else {
+        fprintf(out, ",le=\"+Inf\"} %llu\n", (unsigned long long)count);
+      }
+    }
+
+    fprintf(out, "%s_sum", hist);
+    metrics_label(out, ep->name);
+    fprintf(out, "} %.6f\n", __atomic_load_n(&ep->latency_us, __ATOMIC_RELAXED) / 1e6);
+    fprintf(out, "%s_count", hist);
+    metrics_label(out, ep->name);
+    fprintf(out, "} %llu\n", (unsigned long long)count);
+  }
+
+  munmap(f, sizeof(struct ckl_metrics_file_t));
+  return 0;
+}
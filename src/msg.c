@@ -18,50 +18,218 @@
 #include "ckl.h"
 #include <sys/types.h>
 #include <pwd.h>
+#include <stdio.h>
+#include <errno.h>
+
+/* the _r lookups, so contexts in several threads can do this at once */
+int ckl_username(char *buf, size_t len)
+{
+  const char *user = getenv("SUDO_USER");
+  struct passwd pw;
+  struct passwd *pws = NULL;
+  char pwbuf[4096];
+
+  if (user == NULL && getlogin_r(buf, len) == 0) {
+    return 0;
+  }
+
+  if (user == NULL) {
+    if (getpwuid_r(getuid(), &pw, pwbuf, sizeof(pwbuf), &pws) == 0 &&
+        pws != NULL && pws->pw_name != NULL) {
+      user = pws->pw_name;
+    }
+  }
+
+  if (user == NULL) {
+    user = getenv("USER");
+  }
+
+  if (user == NULL) {
+    fprintf(stderr, "Unknown user: env['SUDO_USER'], getuid(2), getlogin(2), and env['USER'] all returned NULL.\n");
+    return -1;
+  }
+
+  snprintf(buf, len, "%s", user);
+  return 0;
+}
 
 int ckl_msg_init(ckl_msg_t *msg)
 {
-  {
-    const char *user = getenv("SUDO_USER");
+  char buf[HOST_NAME_MAX + 1];
+
+  if (ckl_username(buf, sizeof(buf)) < 0) {
+    return CKL_ERR_SYSTEM;
+  }
+  msg->username = ckl_arena_strdup(&msg->arena, buf);
+
+  if (ckl_hostname(buf, sizeof(buf)) < 0) {
+    return CKL_ERR_SYSTEM;
+  }
+  msg->hostname = ckl_arena_strdup(&msg->arena, buf);
+
+  msg->ts = time(NULL);
+
+  return 0;
+}
+
+/* tags are key=value, checked by the caller */
+void ckl_msg_add_tag(ckl_msg_t *m, const char *tag)
+{
+  m->tags = ckl_arena_grow(&m->arena, m->tags, m->tag_count, sizeof(char *));
+  m->tags[m->tag_count++] = ckl_arena_strdup(&m->arena, tag);
+}
+
+/* everything a message points to is in its arena */
+void ckl_msg_free(ckl_msg_t *m)
+{
+  ckl_arena_free(&m->arena);
+  free(m);
+}
+
+
+/**
+ * A message body read from a pipe (ckl -m -) as curl sends it: each read
+ * goes straight into curl's upload buffer, so memory does not grow with
+ * the message.  Past max_bytes the rest of the input is read and counted
+ * but not sent, and a note with the count ends the message.
+ */
+struct ckl_msgstream_t {
+  int fd;
+  unsigned long long max_bytes;
+  unsigned long long sent;
+  unsigned long long dropped;
+  int state;
+  char note[64];
+  size_t note_len;
+  size_t note_off;
+};
+
+enum {
+  MSGSTREAM_BODY,
+  MSGSTREAM_NOTE,
+  MSGSTREAM_DONE
+};
+
+ckl_msgstream_t *ckl_msgstream_open(int fd, unsigned long long max_bytes)
+{
+  ckl_msgstream_t *s = calloc(1, sizeof(ckl_msgstream_t));
+
+  s->fd = fd;
+  s->max_bytes = max_bytes;
+  return s;
+}
+
+static ssize_t msgstream_fill(ckl_msgstream_t *s, char *buf, size_t len)
+{
+  ssize_t n;
+
+  do {
+    n = read(s->fd, buf, len);
+  } while (n < 0 && errno == EINTR);
+
+  if (n < 0) {
+    perror("read() of the message failed");
+  }
+
+  return n;
+}
+
+static void msgstream_end(ckl_msgstream_t *s)
+{
+  if (s->dropped > 0) {
+    s->note_len = snprintf(s->note, sizeof(s->note),
+                           "\n[ckl: truncated %llu bytes]\n", s->dropped);
+  }
+  s->state = MSGSTREAM_NOTE;
+}
 
-    if (user == NULL) {
-      user = getlogin();
+/* curl read callback: the next piece of the message, 0 at the end */
+size_t ckl_msgstream_read(char *buf, size_t size, size_t nmemb, void *baton)
+{
+  ckl_msgstream_t *s = baton;
+  size_t room = size * nmemb;
+
+  if (s->state == MSGSTREAM_BODY) {
+    size_t want = room;
+    ssize_t n;
+
+    if (s->max_bytes > 0 && s->max_bytes - s->sent < want) {
+      want = s->max_bytes - s->sent;
     }
 
-    if (user == NULL) {
-      struct passwd *pws;
-      pws = getpwuid(getuid());
-      if (pws != NULL && pws->pw_name != NULL) {
-        user = pws->pw_name;
+    if (want == 0) {
+      /* at the cap: count what is left, in curl's buffer, and drop it */
+      while ((n = msgstream_fill(s, buf, room)) > 0) {
+        s->dropped += n;
       }
     }
-
-    if (user == NULL) {
-      user = getenv("USER");
+    else {
+      n = msgstream_fill(s, buf, want);
+      if (n > 0) {
+        s->sent += n;
+        return n;
+      }
     }
 
-    if (user == NULL) {
-      ckl_error_out("Unknown user: env['SUDO_USER'], getuid(2), getlogin(2), and env['USER'] all returned NULL.");
+    if (n < 0) {
+      return CURL_READFUNC_ABORT;
     }
 
-    msg->username = strdup(user);
+    msgstream_end(s);
   }
 
-  msg->hostname = ckl_hostname();
+  if (s->state == MSGSTREAM_NOTE) {
+    size_t n = s->note_len - s->note_off < room ? s->note_len - s->note_off : room;
+
+    memcpy(buf, s->note + s->note_off, n);
+    s->note_off += n;
+    if (s->note_off == s->note_len) {
+      s->state = MSGSTREAM_DONE;
+    }
+    return n;
+  }
 
-  msg->ts = time(NULL);
-  
   return 0;
 }
 
-void ckl_msg_free(ckl_msg_t *m)
+void ckl_msgstream_close(ckl_msgstream_t *s)
 {
-  free((char*)m->username);
-  free((char*)m->hostname);
-  free((char*)m->msg);
-  if (m->script_log) {
-    free((char*)m->script_log);
-  }
-  free(m);
+  free(s);
 }
 
+/**
+ * The same message read whole into the message's arena, for endpoints
+ * that sign their requests: OAuth covers the form fields it is given
+ * before the request starts, which a streamed part is not.  The cap and
+ * the truncation note work as they do when streaming.
+ */
+int ckl_msg_read_stdin(ckl_msg_t *m, unsigned long long max_bytes)
+{
+  ckl_msgstream_t *s = ckl_msgstream_open(STDIN_FILENO, max_bytes);
+  size_t size = 64 * 1024;
+  size_t len = 0;
+  char *buf = malloc(size);
+  size_t n;
+
+  for (;;) {
+    if (size - len < 4096) {
+      size *= 2;
+      buf = realloc(buf, size);
+    }
+    n = ckl_msgstream_read(buf + len, 1, size - len - 1, s);
+    if (n == 0) {
+      break;
+    }
+    if (n == CURL_READFUNC_ABORT) {
+      ckl_msgstream_close(s);
+      free(buf);
+      return CKL_ERR_SYSTEM;
+    }
+    len += n;
+  }
+
+  ckl_msgstream_close(s);
+  m->msg = ckl_arena_strndup(&m->arena, buf, len);
+  free(buf);
+  return 0;
+}
@@ -0,0 +1,525 @@
+/*
+ * Licensed to Cloudkick, Inc under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * Cloudkick licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ckl.h"
+#include <stdio.h>
+
+/**
+ * Terminal output normalizer for script logs.
+ *
+ * Strips escape sequences (CSI, OSC, DCS and friends) and applies carriage
+ * returns, backspaces and erase-line to a line buffer, so a progress bar
+ * that redraws itself a thousand times ends up as the one line a terminal
+ * would have shown.  Only completed lines are emitted; the line being
+ * drawn stays in the buffer until a newline or finish.  The cursor counts
+ * cells, one per UTF-8 character, so redraws over non-ASCII text land on
+ * the character they were aimed at.
+ *
+ * Plain text is located with a vectorized search for control bytes, which
+ * keeps the common case (long runs of printable output) close to memcpy.
+ */
+
+#define NORM_LINE_MAX (64 * 1024)
+#define NORM_BUF_INIT (128 * 1024)
+
+enum {
+  NORM_TEXT,
+  NORM_ESC,
+  NORM_ESC_INTER,
+  NORM_CSI,
+  NORM_STR,
+  NORM_STR_ESC
+};
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define NORM_HAVE_X86 1
+#include <immintrin.h>
+#endif
+
+#ifdef __GNUC__
+#define NORM_INLINE static inline __attribute__((always_inline))
+#else
+#define NORM_INLINE static
+#endif
+
+/* UTF-8 continuation bytes share the cell of the byte that leads them */
+#define NORM_CONT(c) (((unsigned char)(c) & 0xc0) == 0x80)
+
+/* returns the offset of the first byte < 0x20, or len, and adds the UTF-8
+ * continuation bytes before it to *cont so the caller can count cells */
+static size_t scan_ctrl_scalar(const char *p, size_t len, size_t *cont)
+{
+  size_t i;
+  size_t c = 0;
+  for (i = 0; i < len; i++) {
+    if ((unsigned char)p[i] < 0x20) {
+      break;
+    }
+    c += NORM_CONT(p[i]);
+  }
+  *cont += c;
+  return i;
+}
+
+#ifdef NORM_HAVE_X86
+__attribute__((target("sse2")))
+static size_t sum_bytes_sse2(__m128i acc)
+{
+  __m128i sad = _mm_sad_epu8(acc, _mm_setzero_si128());
+  return _mm_cvtsi128_si32(sad) + _mm_extract_epi16(sad, 4);
+}
+
+__attribute__((target("sse2")))
+static size_t scan_ctrl_sse2(const char *p, size_t len, size_t *cont)
+{
+  const __m128i lim = _mm_set1_epi8(0x1f);
+  const __m128i lead = _mm_set1_epi8(-64);
+  __m128i acc = _mm_setzero_si128();
+  size_t i = 0;
+  int words = 0;
+
+  for (; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+    /* x <= 0x1f  <=>  max(x, 0x1f) == 0x1f */
+    int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(v, lim), lim));
+    if (mask) {
+      break;
+    }
+    /* continuation bytes are the signed bytes below -64 (0xc0); the
+     * per-byte counts are summed before any lane can overflow */
+    acc = _mm_sub_epi8(acc, _mm_cmpgt_epi8(lead, v));
+    if (++words == 255) {
+      *cont += sum_bytes_sse2(acc);
+      acc = _mm_setzero_si128();
+      words = 0;
+    }
+  }
+
+  *cont += sum_bytes_sse2(acc);
+  return i + scan_ctrl_scalar(p + i, len - i, cont);
+}
+
+__attribute__((target("avx2")))
+static size_t sum_bytes_avx2(__m256i acc)
+{
+  __m256i sad = _mm256_sad_epu8(acc, _mm256_setzero_si256());
+  return _mm256_extract_epi64(sad, 0) + _mm256_extract_epi64(sad, 1) +
+         _mm256_extract_epi64(sad, 2) + _mm256_extract_epi64(sad, 3);
+}
+
+__attribute__((target("avx2")))
+static size_t scan_ctrl_avx2(const char *p, size_t len, size_t *cont)
+{
+  const __m256i lim = _mm256_set1_epi8(0x1f);
+  const __m256i lead = _mm256_set1_epi8(-64);
+  __m256i acc = _mm256_setzero_si256();
+  size_t i = 0;
+  int words = 0;
+
+  for (; i + 32 <= len; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+    unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_max_epu8(v, lim), lim));
+    if (mask) {
+      break;
+    }
+    acc = _mm256_sub_epi8(acc, _mm256_cmpgt_epi8(lead, v));
+    if (++words == 255) {
+      *cont += sum_bytes_avx2(acc);
+      acc = _mm256_setzero_si256();
+      words = 0;
+    }
+  }
+
+  /* the tail stays out of the sse2 scanner: calling legacy SSE code with
+   * the upper ymm halves dirty costs more than the scalar loop */
+  *cont += sum_bytes_avx2(acc);
+  return i + scan_ctrl_scalar(p + i, len - i, cont);
+}
+#endif
+
+static void norm_reserve(ckl_normalize_t *n, size_t extra)
+{
+  if (n->len + extra > n->size) {
+    while (n->len + extra > n->size) {
+      n->size *= 2;
+    }
+    n->buf = realloc(n->buf, n->size);
+  }
+}
+
+/* byte offset of cell col in the current line, or the line length */
+static size_t norm_offset(ckl_normalize_t *n, size_t col)
+{
+  const char *p = n->buf + n->line_start;
+  size_t line = n->len - n->line_start;
+  size_t i;
+
+  for (i = 0; i < line; i++) {
+    if (!NORM_CONT(p[i])) {
+      if (col == 0) {
+        return i;
+      }
+      col--;
+    }
+  }
+  return line;
+}
+
+/* replaces bytes [start, end) of the current line with p, or with blanks
+ * when p is NULL */
+static void norm_splice(ckl_normalize_t *n, size_t start, size_t end,
+                        const char *p, size_t len)
+{
+  size_t tail = n->len - n->line_start - end;
+  char *line;
+
+  if (len > end - start) {
+    norm_reserve(n, len - (end - start));
+  }
+  line = n->buf + n->line_start;
+  memmove(line + start + len, line + end, tail);
+  if (p) {
+    memcpy(line + start, p, len);
+  }
+  else {
+    memset(line + start, ' ', len);
+  }
+  n->len = n->line_start + start + len + tail;
+}
+
+/* puts text at the cursor, overwriting whatever an earlier redraw left */
+static void norm_put(ckl_normalize_t *n, const char *p, size_t len,
+                     size_t cells)
+{
+  if (n->col == n->cells) {
+    norm_reserve(n, len);
+    memcpy(n->buf + n->len, p, len);
+    n->len += len;
+    n->col += cells;
+    n->cells = n->col;
+  }
+  else if (n->col < n->cells) {
+    /* a run starting with continuation bytes lands right after the lead
+     * byte the last run ended with, which is where cell col starts */
+    norm_splice(n, norm_offset(n, n->col), norm_offset(n, n->col + cells),
+                p, len);
+    n->col += cells;
+    if (n->col > n->cells) {
+      n->cells = n->col;
+    }
+  }
+  else {
+    /* cursor was moved past the end of the line, pad with blanks */
+    size_t pad = n->col - n->cells;
+    norm_reserve(n, pad + len);
+    memset(n->buf + n->len, ' ', pad);
+    memcpy(n->buf + n->len + pad, p, len);
+    n->len += pad + len;
+    n->col += cells;
+    n->cells = n->col;
+  }
+
+  if (n->len - n->line_start > NORM_LINE_MAX) {
+    /* something is drawing without ever ending a line; give up on
+     * tracking it and commit what we have */
+    n->line_start = n->len;
+    n->col = 0;
+    n->cells = 0;
+  }
+}
+
+static void norm_newline(ckl_normalize_t *n)
+{
+  norm_reserve(n, 1);
+  n->buf[n->len++] = '\n';
+  n->line_start = n->len;
+  n->col = 0;
+  n->cells = 0;
+}
+
+static void norm_csi(ckl_normalize_t *n, char final)
+{
+  int arg = n->csi_arg;
+
+  switch (final) {
+    case 'K':
+      if (arg == 0) {
+        if (n->col < n->cells) {
+          n->len = n->line_start + norm_offset(n, n->col);
+          n->cells = n->col;
+        }
+      }
+      else if (arg == 1) {
+        /* erases up to and including the cursor cell */
+        size_t end = n->col < n->cells ? n->col + 1 : n->cells;
+        norm_splice(n, 0, norm_offset(n, end), NULL, end);
+      }
+      else if (arg == 2) {
+        n->len = n->line_start;
+        n->cells = 0;
+      }
+      break;
+    case 'D':
+      arg = arg ? arg : 1;
+      n->col = (size_t)arg > n->col ? 0 : n->col - arg;
+      break;
+    case 'C':
+      n->col += arg ? arg : 1;
+      break;
+    case 'G':
+      n->col = arg > 1 ? arg - 1 : 0;
+      break;
+    default:
+      /* colours, cursor movement across lines, modes: all dropped */
+      break;
+  }
+}
+
+static void norm_ctrl(ckl_normalize_t *n, char c)
+{
+  switch (c) {
+    case '\n':
+      norm_newline(n);
+      break;
+    case '\r':
+      n->col = 0;
+      break;
+    case '\b':
+      if (n->col > 0) {
+        n->col--;
+      }
+      break;
+    case '\033':
+      n->state = NORM_ESC;
+      break;
+    case '\a':
+    case '\0':
+      break;
+    default:
+      /* tabs and friends are kept as text */
+      norm_put(n, &c, 1, 1);
+      break;
+  }
+}
+
+static void norm_escape(ckl_normalize_t *n, char c)
+{
+  switch (n->state) {
+    case NORM_ESC:
+      if (c == '[') {
+        n->state = NORM_CSI;
+        n->csi_arg = 0;
+        n->csi_nargs = 0;
+      }
+      else if (c == ']' || c == 'P' || c == 'X' || c == '^' || c == '_') {
+        n->state = NORM_STR;
+      }
+      else if (c >= 0x20 && c <= 0x2f) {
+        n->state = NORM_ESC_INTER;
+      }
+      else {
+        n->state = NORM_TEXT;
+      }
+      break;
+    case NORM_ESC_INTER:
+      if (c < 0x20 || c > 0x2f) {
+        n->state = NORM_TEXT;
+      }
+      break;
+    case NORM_CSI:
+      if (c >= '0' && c <= '9') {
+        if (n->csi_nargs == 0 && n->csi_arg < 10000) {
+          n->csi_arg = n->csi_arg * 10 + (c - '0');
+        }
+      }
+      else if (c == ';') {
+        n->csi_nargs++;
+      }
+      else if (c >= 0x40 && c <= 0x7e) {
+        norm_csi(n, c);
+        n->state = NORM_TEXT;
+      }
+      else if (c == '\033') {
+        n->state = NORM_ESC;
+      }
+      break;
+    case NORM_STR:
+      if (c == '\a') {
+        n->state = NORM_TEXT;
+      }
+      else if (c == '\033') {
+        n->state = NORM_STR_ESC;
+      }
+      break;
+    case NORM_STR_ESC:
+      n->state = c == '\\' ? NORM_TEXT : NORM_STR;
+      break;
+  }
+}
+
+/**
+ * The inner loop is instantiated once per scanner so the scan can be
+ * inlined; going through a function pointer per text run costs more than
+ * the vector search saves on short, escape heavy lines.
+ */
+NORM_INLINE void norm_loop(ckl_normalize_t *n, const char *p, const char *end,
+                          size_t (*scan)(const char *p, size_t len, size_t *cont))
+{
+  while (p < end) {
+    if (n->state == NORM_TEXT) {
+      size_t cont = 0;
+      size_t run = scan(p, end - p, &cont);
+      if (run > 0) {
+        norm_put(n, p, run, run - cont);
+        p += run;
+        if (p == end) {
+          break;
+        }
+      }
+      if (*p == '\033' && end - p > 2 && p[1] == '[') {
+        /* SGR and friends are most of the escapes we see, parse them in
+         * one go when the whole sequence is in this chunk */
+        const char *q = p + 2;
+        int arg = 0;
+        int nargs = 0;
+        while (q < end && ((*q >= '0' && *q <= '9') || *q == ';')) {
+          if (*q == ';') {
+            nargs++;
+          }
+          else if (nargs == 0 && arg < 10000) {
+            arg = arg * 10 + (*q - '0');
+          }
+          q++;
+        }
+        if (q < end && *q >= 0x40 && *q <= 0x7e) {
+          n->csi_arg = arg;
+          norm_csi(n, *q);
+          p = q + 1;
+          continue;
+        }
+      }
+      norm_ctrl(n, *p++);
+    }
+    else {
+      norm_escape(n, *p++);
+    }
+  }
+}
+
+static void norm_loop_scalar(ckl_normalize_t *n, const char *p, const char *end)
+{
+  norm_loop(n, p, end, scan_ctrl_scalar);
+}
+
+#ifdef NORM_HAVE_X86
+__attribute__((target("sse2")))
+static void norm_loop_sse2(ckl_normalize_t *n, const char *p, const char *end)
+{
+  norm_loop(n, p, end, scan_ctrl_sse2);
+}
+
+__attribute__((target("avx2")))
+static void norm_loop_avx2(ckl_normalize_t *n, const char *p, const char *end)
+{
+  norm_loop(n, p, end, scan_ctrl_avx2);
+}
+#endif
+
+static void normalize_pick_loop(ckl_normalize_t *n)
+{
+  const char *force = getenv("CKL_NORMALIZE_SCAN");
+
+  n->loop = norm_loop_scalar;
+  n->scan_name = "scalar";
+
+  if (force && strcmp(force, "scalar") == 0) {
+    return;
+  }
+
+#ifdef NORM_HAVE_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2") && !(force && strcmp(force, "sse2") == 0)) {
+    n->loop = norm_loop_avx2;
+    n->scan_name = "avx2";
+  }
+  else if (__builtin_cpu_supports("sse2")) {
+    n->loop = norm_loop_sse2;
+    n->scan_name = "sse2";
+  }
+#endif
+}
+
+int ckl_normalize_init(ckl_normalize_t *n, ckl_emit_fn emit, void *baton)
+{
+  memset(n, 0, sizeof(*n));
+  n->emit = emit;
+  n->baton = baton;
+  n->size = NORM_BUF_INIT;
+  n->buf = malloc(n->size);
+  n->state = NORM_TEXT;
+  normalize_pick_loop(n);
+  return 0;
+}
+
+int ckl_normalize_write(ckl_normalize_t *n, const char *buf, size_t len)
+{
+  int rv;
+
+  n->loop(n, buf, buf + len);
+
+  /* hand over every completed line, keep the one still being drawn */
+  if (n->line_start > 0) {
+    rv = n->emit(n->baton, n->buf, n->line_start);
+    if (rv < 0) {
+      return rv;
+    }
+    memmove(n->buf, n->buf + n->line_start, n->len - n->line_start);
+    n->len -= n->line_start;
+    n->line_start = 0;
+  }
+
+  return 0;
+}
+
+/* the rest of this stream out, and ready for the next one with the
+ * same buffer, for callers that normalize many short ones */
+int ckl_normalize_reset(ckl_normalize_t *n)
+{
+  int rv = 0;
+
+  if (n->len > 0) {
+    rv = n->emit(n->baton, n->buf, n->len);
+  }
+
+  n->len = 0;
+  n->line_start = 0;
+  n->col = 0;
+  n->cells = 0;
+  n->state = NORM_TEXT;
+  n->csi_arg = 0;
+  n->csi_nargs = 0;
+  return rv;
+}
+
+int ckl_normalize_finish(ckl_normalize_t *n)
+{
+  int rv = ckl_normalize_reset(n);
+
+  free(n->buf);
+  n->buf = NULL;
+  return rv;
+}
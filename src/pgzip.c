@@ -0,0 +1,370 @@
+/*
+ * Licensed to Cloudkick, Inc under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * Cloudkick licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ckl.h"
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+/**
+ * Parallel gzip of a finished script log, for logs that were not
+ * compressed while recording.  The file is cut into blocks which a pool
+ * of threads deflates independently, each block ending on a byte
+ * boundary (Z_SYNC_FLUSH) so the raw deflate streams can simply be laid
+ * end to end, as pigz -i does.  With one gzip header in front and a
+ * trailer whose CRC is combined from the blocks' CRCs, the result is a
+ * single ordinary gzip member any decoder reads.
+ *
+ * The upload pulls the output through ckl_pgzip_read(), a curl read
+ * callback, which hands out the blocks in order as they are done.  At
+ * most PGZIP_WINDOW blocks per thread are held, so memory stays bounded
+ * however large the log, and compression overlaps the upload.
+ */
+
+#ifdef HAVE_ZLIB
+#include <pthread.h>
+
+#define PGZIP_BLOCK_SIZE (512 * 1024)
+#define PGZIP_WINDOW 2
+#define PGZIP_MAX_THREADS 32
+
+typedef struct pgzip_block_t {
+  int done;
+  char *out;
+  size_t out_len;
+  uLong crc;
+  size_t in_len;
+} pgzip_block_t;
+
+struct ckl_pgzip_t {
+  int fd;
+  int level;
+  off_t size;
+  size_t nblocks;
+  size_t window;
+  pgzip_block_t *slots;
+  pthread_t threads[PGZIP_MAX_THREADS];
+  int nthreads;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  size_t next;      /* next block for a worker */
+  size_t emit;      /* next block for the reader */
+  size_t emit_off;  /* bytes of it already read */
+  int stop;
+  int error;
+  int state;
+  uLong crc;
+  unsigned long long total;
+  unsigned char trailer[8];
+  size_t trailer_off;
+};
+
+enum {
+  PGZIP_HEADER,
+  PGZIP_BLOCKS,
+  PGZIP_TRAILER,
+  PGZIP_DONE
+};
+
+static const unsigned char pgzip_header[10] = {
+  0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3
+};
+
+static int pgzip_deflate(ckl_pgzip_t *z, z_stream *zs, char *in,
+                         size_t idx, pgzip_block_t *b)
+{
+  off_t off = (off_t)idx * PGZIP_BLOCK_SIZE;
+  size_t len = z->size - off < PGZIP_BLOCK_SIZE ? z->size - off : PGZIP_BLOCK_SIZE;
+  size_t got = 0;
+  int last = idx == z->nblocks - 1;
+  int rv;
+
+  while (got < len) {
+    ssize_t n = pread(z->fd, in + got, len - got, off + got);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    got += n;
+  }
+
+  b->out = malloc(deflateBound(zs, len) + 16);
+  if (b->out == NULL) {
+    return -1;
+  }
+
+  deflateReset(zs);
+  zs->next_in = (Bytef *)in;
+  zs->avail_in = len;
+  zs->next_out = (Bytef *)b->out;
+  zs->avail_out = deflateBound(zs, len) + 16;
+
+  /* only the last block is final; the others end on a byte boundary */
+  rv = deflate(zs, last ? Z_FINISH : Z_SYNC_FLUSH);
+  if (rv != (last ? Z_STREAM_END : Z_OK) || zs->avail_in != 0) {
+    return -1;
+  }
+
+  b->out_len = (char *)zs->next_out - b->out;
+  b->in_len = len;
+  b->crc = crc32(crc32(0L, Z_NULL, 0), (Bytef *)in, len);
+  return 0;
+}
+
+static void *pgzip_worker(void *baton)
+{
+  ckl_pgzip_t *z = baton;
+  char *in = malloc(PGZIP_BLOCK_SIZE);
+  z_stream zs;
+
+  memset(&zs, 0, sizeof(zs));
+  if (in == NULL ||
+      deflateInit2(&zs, z->level, Z_DEFLATED, -MAX_WBITS, 8,
+                   Z_DEFAULT_STRATEGY) != Z_OK) {
+    pthread_mutex_lock(&z->lock);
+    z->error = 1;
+    pthread_cond_broadcast(&z->cond);
+    pthread_mutex_unlock(&z->lock);
+    free(in);
+    return NULL;
+  }
+
+  pthread_mutex_lock(&z->lock);
+
+  while (!z->stop && !z->error && z->next < z->nblocks) {
+    size_t idx;
+    pgzip_block_t *b;
+    int rv;
+
+    /* stay within the window ahead of the reader */
+    if (z->next >= z->emit + z->window) {
+      pthread_cond_wait(&z->cond, &z->lock);
+      continue;
+    }
+
+    idx = z->next++;
+    b = &z->slots[idx % z->window];
+    pthread_mutex_unlock(&z->lock);
+
+    rv = pgzip_deflate(z, &zs, in, idx, b);
+
+    pthread_mutex_lock(&z->lock);
+    if (rv < 0) {
+      z->error = 1;
+    }
+    b->done = 1;
+    pthread_cond_broadcast(&z->cond);
+  }
+
+  pthread_mutex_unlock(&z->lock);
+
+  deflateEnd(&zs);
+  free(in);
+  return NULL;
+}
+
+static int pgzip_threads(int threads, size_t nblocks)
+{
+  if (threads <= 0) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = n > 0 ? n : 1;
+  }
+
+  if (threads > PGZIP_MAX_THREADS) {
+    threads = PGZIP_MAX_THREADS;
+  }
+
+  if ((size_t)threads > nblocks) {
+    threads = nblocks;
+  }
+
+  return threads;
+}
+
+ckl_pgzip_t *ckl_pgzip_open(const char *path, int level, int threads)
+{
+  ckl_pgzip_t *z;
+  struct stat st;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  int i;
+
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    fprintf(stderr, "Unable to open %s for compression: %s\n", path,
+            strerror(errno));
+    if (fd >= 0) {
+      close(fd);
+    }
+    return NULL;
+  }
+
+  z = calloc(1, sizeof(ckl_pgzip_t));
+  z->fd = fd;
+  z->level = level > Z_BEST_COMPRESSION ? Z_BEST_COMPRESSION : level;
+  z->size = st.st_size;
+  /* an empty log is still one (empty, final) block */
+  z->nblocks = st.st_size > 0 ? (st.st_size + PGZIP_BLOCK_SIZE - 1) / PGZIP_BLOCK_SIZE : 1;
+  z->nthreads = pgzip_threads(threads, z->nblocks);
+  z->window = z->nthreads * PGZIP_WINDOW;
+  z->slots = calloc(z->window, sizeof(pgzip_block_t));
+  z->crc = crc32(0L, Z_NULL, 0);
+  pthread_mutex_init(&z->lock, NULL);
+  pthread_cond_init(&z->cond, NULL);
+
+  for (i = 0; i < z->nthreads; i++) {
+    if (pthread_create(&z->threads[i], NULL, pgzip_worker, z) != 0) {
+      perror("pthread_create() of compressor failed");
+      break;
+    }
+  }
+
+  z->nthreads = i;
+  if (i == 0) {
+    ckl_pgzip_close(z);
+    return NULL;
+  }
+
+  return z;
+}
+
+static size_t pgzip_copy(char *dst, size_t room, const void *src, size_t len,
+                         size_t *off)
+{
+  size_t n = len - *off < room ? len - *off : room;
+
+  memcpy(dst, (const char *)src + *off, n);
+  *off += n;
+  return n;
+}
+
+/* curl read callback: the next piece of the gzip stream, 0 at the end */
+size_t ckl_pgzip_read(char *buf, size_t size, size_t nmemb, void *baton)
+{
+  ckl_pgzip_t *z = baton;
+  size_t room = size * nmemb;
+  size_t got = 0;
+
+  while (got < room && z->state != PGZIP_DONE) {
+    if (z->state == PGZIP_HEADER) {
+      got += pgzip_copy(buf + got, room - got, pgzip_header,
+                        sizeof(pgzip_header), &z->emit_off);
+      if (z->emit_off == sizeof(pgzip_header)) {
+        z->emit_off = 0;
+        z->state = PGZIP_BLOCKS;
+      }
+    }
+    else if (z->state == PGZIP_BLOCKS) {
+      pgzip_block_t *b = &z->slots[z->emit % z->window];
+
+      pthread_mutex_lock(&z->lock);
+      while (!b->done && !z->error) {
+        pthread_cond_wait(&z->cond, &z->lock);
+      }
+      pthread_mutex_unlock(&z->lock);
+
+      if (z->error) {
+        fprintf(stderr, "Compressing the script log failed\n");
+        return CURL_READFUNC_ABORT;
+      }
+
+      got += pgzip_copy(buf + got, room - got, b->out, b->out_len, &z->emit_off);
+      if (z->emit_off < b->out_len) {
+        continue;
+      }
+
+      z->crc = crc32_combine(z->crc, b->crc, b->in_len);
+      z->total += b->in_len;
+      free(b->out);
+      memset(b, 0, sizeof(*b));
+      z->emit_off = 0;
+
+      pthread_mutex_lock(&z->lock);
+      z->emit++;
+      pthread_cond_broadcast(&z->cond);
+      pthread_mutex_unlock(&z->lock);
+
+      if (z->emit == z->nblocks) {
+        int i;
+        for (i = 0; i < 4; i++) {
+          z->trailer[i] = (z->crc >> (8 * i)) & 0xff;
+          z->trailer[4 + i] = (z->total >> (8 * i)) & 0xff;
+        }
+        z->state = PGZIP_TRAILER;
+      }
+    }
+    else {
+      got += pgzip_copy(buf + got, room - got, z->trailer,
+                        sizeof(z->trailer), &z->trailer_off);
+      if (z->trailer_off == sizeof(z->trailer)) {
+        z->state = PGZIP_DONE;
+      }
+    }
+  }
+
+  return got;
+}
+
+void ckl_pgzip_close(ckl_pgzip_t *z)
+{
+  size_t i;
+  int t;
+
+  pthread_mutex_lock(&z->lock);
+  z->stop = 1;
+  pthread_cond_broadcast(&z->cond);
+  pthread_mutex_unlock(&z->lock);
+
+  for (t = 0; t < z->nthreads; t++) {
+    pthread_join(z->threads[t], NULL);
+  }
+
+  for (i = 0; i < z->window; i++) {
+    free(z->slots[i].out);
+  }
+
+  pthread_mutex_destroy(&z->lock);
+  pthread_cond_destroy(&z->cond);
+  close(z->fd);
+  free(z->slots);
+  free(z);
+}
+
+#else
+
+struct ckl_pgzip_t {
+  int unused;
+};
+
+ckl_pgzip_t *ckl_pgzip_open(const char *path, int level, int threads)
+{
+  fprintf(stderr, "Warning: ckl was built without zlib, script log will not be compressed\n");
+  return NULL;
+}
+
+size_t ckl_pgzip_read(char *buf, size_t size, size_t nmemb, void *baton)
+{
+  return CURL_READFUNC_ABORT;
+}
+
+void ckl_pgzip_close(ckl_pgzip_t *z)
+{
+  free(z);
+}
+
+#endif
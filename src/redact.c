@@ -0,0 +1,454 @@
+/*
+ * Licensed to Cloudkick, Inc under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * Cloudkick licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ckl.h"
+#include <stdio.h>
+
+/**
+ * Secret redaction for script logs.
+ *
+ * All patterns are compiled into one Aho-Corasick automaton, flattened to a
+ * DFA over byte classes, so the capture path does a single table lookup per
+ * byte no matter how many patterns are configured.
+ *
+ * A pattern is either a literal ("hunter2"), or a prefix ending in '*'
+ * ("ghp_*") which also swallows the run of token characters following it.
+ *
+ * Bytes that could still be the start of a match are held back until the
+ * automaton rules them out, which is what makes matches straddling two
+ * PTY reads work.  The hold back is at most the longest pattern, and only
+ * delays the log: the terminal is written before the capture path runs.
+ *
+ * Matches can overlap ("hunter2" in "hunter2xyz", a short secret inside a
+ * longer one), so a match does not end the scan.  From the first hit on,
+ * bytes go through a window of what the automaton can still match, with
+ * a mark on each redacted byte, and only leave it once no match can reach
+ * them; a run of redacted bytes becomes one marker.  What is redacted is
+ * then the union of all matches.  The window empties of marks within the
+ * longest pattern, and the scan is back on the fast path.
+ */
+
+#define REDACT_MARKER "[redacted]"
+#define REDACT_NONE ((uint32_t)-1)
+
+/* after construction the table holds row offsets (state * nclasses) rather
+ * than state numbers, with this bit set on transitions into a match */
+#define REDACT_HIT 0x80000000u
+
+static int is_token_char(unsigned char c)
+{
+  return isalnum(c) || c == '_' || c == '-' || c == '.' ||
+         c == '/' || c == '+' || c == '=';
+}
+
+static uint32_t redact_new_state(ckl_redact_t *r, size_t *cap, uint32_t depth)
+{
+  uint32_t s = r->nstates++;
+  int c;
+
+  if (r->nstates > *cap) {
+    *cap *= 2;
+    r->delta = realloc(r->delta, *cap * r->nclasses * sizeof(uint32_t));
+    r->depth = realloc(r->depth, *cap * sizeof(uint32_t));
+    r->match = realloc(r->match, *cap * sizeof(uint32_t));
+    r->token = realloc(r->token, *cap);
+  }
+
+  for (c = 0; c < r->nclasses; c++) {
+    r->delta[s * r->nclasses + c] = REDACT_NONE;
+  }
+  r->depth[s] = depth;
+  r->match[s] = 0;
+  r->token[s] = 0;
+
+  return s;
+}
+
+int ckl_redact_init(ckl_redact_t *r, const char *const *patterns, int count,
+                    ckl_emit_fn emit, void *baton)
+{
+  size_t cap = 64;
+  uint32_t *queue;
+  uint32_t *fail;
+  size_t qhead = 0, qtail = 0;
+  uint32_t s;
+  int i, c;
+
+  memset(r, 0, sizeof(*r));
+  r->emit = emit;
+  r->baton = baton;
+
+  /* bytes that appear in no pattern all share class 0 */
+  r->nclasses = 1;
+  for (i = 0; i < count; i++) {
+    const unsigned char *p = (const unsigned char *)patterns[i];
+    size_t len = strlen(patterns[i]);
+    size_t j;
+    if (len > 0 && p[len - 1] == '*') {
+      len--;
+    }
+    for (j = 0; j < len; j++) {
+      if (r->class[p[j]] == 0) {
+        r->class[p[j]] = r->nclasses++;
+      }
+    }
+  }
+
+  r->delta = malloc(cap * r->nclasses * sizeof(uint32_t));
+  r->depth = malloc(cap * sizeof(uint32_t));
+  r->match = malloc(cap * sizeof(uint32_t));
+  r->token = malloc(cap);
+  redact_new_state(r, &cap, 0);
+
+  /* trie */
+  for (i = 0; i < count; i++) {
+    const unsigned char *p = (const unsigned char *)patterns[i];
+    size_t len = strlen(patterns[i]);
+    int prefix = 0;
+    size_t j;
+
+    if (len > 0 && p[len - 1] == '*') {
+      prefix = 1;
+      len--;
+    }
+
+    if (len == 0) {
+      continue;
+    }
+
+    s = 0;
+    for (j = 0; j < len; j++) {
+      uint32_t *t = &r->delta[s * r->nclasses + r->class[p[j]]];
+      if (*t == REDACT_NONE) {
+        uint32_t n = redact_new_state(r, &cap, j + 1);
+        /* redact_new_state may have moved the table */
+        t = &r->delta[s * r->nclasses + r->class[p[j]]];
+        *t = n;
+      }
+      s = *t;
+    }
+
+    r->match[s] = len;
+    r->token[s] = r->token[s] || prefix;
+    if (len > r->max_len) {
+      r->max_len = len;
+    }
+  }
+
+  /* failure links, flattened into a complete transition table (BFS) */
+  queue = malloc(r->nstates * sizeof(uint32_t));
+  fail = calloc(r->nstates, sizeof(uint32_t));
+
+  for (c = 0; c < r->nclasses; c++) {
+    uint32_t t = r->delta[c];
+    if (t == REDACT_NONE) {
+      r->delta[c] = 0;
+    }
+    else {
+      fail[t] = 0;
+      queue[qtail++] = t;
+    }
+  }
+
+  while (qhead < qtail) {
+    s = queue[qhead++];
+
+    /* a shorter pattern may end here even if ours doesn't */
+    if (r->match[s] == 0) {
+      r->match[s] = r->match[fail[s]];
+      r->token[s] = r->token[fail[s]];
+    }
+
+    for (c = 0; c < r->nclasses; c++) {
+      uint32_t *t = &r->delta[s * r->nclasses + c];
+      uint32_t f = r->delta[fail[s] * r->nclasses + c];
+      if (*t == REDACT_NONE) {
+        *t = f;
+      }
+      else {
+        fail[*t] = f;
+        queue[qtail++] = *t;
+      }
+    }
+  }
+
+  free(queue);
+  free(fail);
+
+  for (s = 0; s < r->nstates * r->nclasses; s++) {
+    uint32_t t = r->delta[s];
+    r->delta[s] = (t * r->nclasses) | (r->match[t] ? REDACT_HIT : 0);
+  }
+
+  r->hold_size = r->max_len + 1;
+  r->hold = malloc(r->hold_size);
+  r->win = malloc(r->hold_size);
+  r->win_mask = malloc(r->hold_size);
+
+  return 0;
+}
+
+/* emits stream positions [a, b), where negative positions are in hold */
+static int redact_emit(ckl_redact_t *r, const char *buf, ssize_t a, ssize_t b)
+{
+  int rv;
+
+  if (a >= b) {
+    return 0;
+  }
+
+  if (a < 0) {
+    ssize_t e = b < 0 ? b : 0;
+    rv = r->emit(r->baton, r->hold + r->hold_len + a, e - a);
+    if (rv < 0) {
+      return rv;
+    }
+    a = 0;
+  }
+
+  if (a < b) {
+    return r->emit(r->baton, buf + a, b - a);
+  }
+
+  return 0;
+}
+
+/* copies stream positions [a, b), as for redact_emit, to the window */
+static void redact_window(ckl_redact_t *r, const char *buf, ssize_t a, ssize_t b)
+{
+  r->win_len = 0;
+
+  if (a < 0) {
+    ssize_t e = b < 0 ? b : 0;
+    memcpy(r->win, r->hold + r->hold_len + a, e - a);
+    r->win_len = e - a;
+    a = 0;
+  }
+
+  if (a < b) {
+    memcpy(r->win + r->win_len, buf + a, b - a);
+    r->win_len += b - a;
+  }
+
+  memset(r->win_mask, 0, r->win_len);
+  r->win_masked = 0;
+  r->last_masked = 0;
+}
+
+/* the first n bytes of the window are final: text as is, each run of
+ * redacted bytes as one marker */
+static int redact_flush(ckl_redact_t *r, size_t n)
+{
+  size_t i = 0;
+  size_t j;
+  int rv;
+
+  while (i < n) {
+    j = i;
+    if (r->win_mask[i]) {
+      while (j < n && r->win_mask[j]) {
+        j++;
+      }
+      r->win_masked -= j - i;
+      if (!r->last_masked) {
+        rv = r->emit(r->baton, REDACT_MARKER, sizeof(REDACT_MARKER) - 1);
+        if (rv < 0) {
+          return rv;
+        }
+        r->matches++;
+      }
+      r->last_masked = 1;
+    }
+    else {
+      while (j < n && !r->win_mask[j]) {
+        j++;
+      }
+      rv = r->emit(r->baton, r->win + i, j - i);
+      if (rv < 0) {
+        return rv;
+      }
+      r->last_masked = 0;
+    }
+    i = j;
+  }
+
+  memmove(r->win, r->win + n, r->win_len - n);
+  memmove(r->win_mask, r->win_mask + n, r->win_len - n);
+  r->win_len -= n;
+
+  return 0;
+}
+
+int ckl_redact_write(ckl_redact_t *r, const char *buf, size_t len)
+{
+  const unsigned char *p = (const unsigned char *)buf;
+  const uint32_t *delta = r->delta;
+  const unsigned char *klass = r->class;
+  const int nclasses = r->nclasses;
+  uint32_t row = r->state * nclasses;
+  uint32_t s;
+  ssize_t emitted = -(ssize_t)r->hold_len;
+  ssize_t keep;
+  size_t i = 0;
+  int rv;
+
+  while (i < len) {
+    if (r->in_token) {
+      /* drop the rest of a token after a prefix pattern */
+      while (i < len && is_token_char(p[i])) {
+        i++;
+      }
+      if (i == len) {
+        emitted = len;
+        break;
+      }
+      r->in_token = 0;
+      emitted = i;
+    }
+
+    if (r->matching) {
+      uint32_t t = delta[row + klass[p[i]]];
+      size_t k;
+
+      row = t & ~REDACT_HIT;
+      s = row / nclasses;
+      r->win[r->win_len] = buf[i];
+      r->win_mask[r->win_len++] = 0;
+      i++;
+
+      if (t & REDACT_HIT) {
+        for (k = r->win_len - r->match[s]; k < r->win_len; k++) {
+          r->win_masked += !r->win_mask[k];
+          r->win_mask[k] = 1;
+        }
+
+        if (r->token[s]) {
+          /* the rest of the token goes too, and the automaton starts over */
+          rv = redact_flush(r, r->win_len);
+          if (rv < 0) {
+            return rv;
+          }
+          r->matching = 0;
+          r->in_token = 1;
+          r->hold_len = 0;
+          row = 0;
+          emitted = i;
+          continue;
+        }
+      }
+
+      /* no match reaches back past the automaton's depth */
+      rv = redact_flush(r, r->win_len - r->depth[s]);
+      if (rv < 0) {
+        return rv;
+      }
+
+      if (r->win_masked == 0) {
+        /* back to the fast path, the window being what is held back */
+        ssize_t before = (ssize_t)r->win_len - (ssize_t)i;
+        if (before > 0) {
+          memcpy(r->hold, r->win, before);
+        }
+        r->hold_len = before > 0 ? before : 0;
+        emitted = (ssize_t)i - (ssize_t)r->win_len;
+        r->matching = 0;
+        r->win_len = 0;
+      }
+      continue;
+    }
+
+    for (; i < len; i++) {
+      uint32_t t = delta[row + klass[p[i]]];
+      if (t & REDACT_HIT) {
+        break;
+      }
+      row = t;
+    }
+
+    if (i == len) {
+      break;
+    }
+
+    /* everything before what the automaton is matching is final, the
+     * rest goes through the window from here */
+    s = row / nclasses;
+    rv = redact_emit(r, buf, emitted, (ssize_t)i - r->depth[s]);
+    if (rv < 0) {
+      return rv;
+    }
+    redact_window(r, buf, (ssize_t)i - r->depth[s], i);
+    r->matching = 1;
+  }
+
+  if (r->matching) {
+    /* the window holds the bytes still in question */
+    r->hold_len = 0;
+    r->state = row / nclasses;
+    return 0;
+  }
+
+  /* whatever could still become a match stays behind */
+  s = row / nclasses;
+  keep = r->depth[s];
+  if ((ssize_t)len - keep < emitted) {
+    keep = (ssize_t)len - emitted;
+  }
+
+  rv = redact_emit(r, buf, emitted, (ssize_t)len - keep);
+  if (rv < 0) {
+    return rv;
+  }
+
+  if (keep > 0) {
+    /* the kept bytes may still partly live in the old hold */
+    if (keep > (ssize_t)len) {
+      memmove(r->hold, r->hold + r->hold_len - (keep - len), keep - len);
+      memcpy(r->hold + (keep - len), buf, len);
+    }
+    else {
+      memcpy(r->hold, buf + len - keep, keep);
+    }
+  }
+  r->hold_len = keep;
+  r->state = s;
+
+  return 0;
+}
+
+int ckl_redact_finish(ckl_redact_t *r)
+{
+  int rv = 0;
+
+  /* a partial match at the end of the session is just text */
+  if (r->matching) {
+    rv = redact_flush(r, r->win_len);
+  }
+  else if (r->hold_len > 0 && !r->in_token) {
+    rv = r->emit(r->baton, r->hold, r->hold_len);
+  }
+
+  free(r->hold);
+  free(r->win);
+  free(r->win_mask);
+  free(r->delta);
+  free(r->depth);
+  free(r->match);
+  free(r->token);
+  memset(r, 0, sizeof(*r));
+
+  return rv;
+}
@@ -17,13 +17,9 @@
 
 #include "ckl.h"
 
-#define USE_SIMPLE_SCRIPT
-
-#ifdef USE_SIMPLE_SCRIPT
 /* TODO: detect headers in sconsript */
 #ifdef __linux__
 #include <pty.h>
-#include <sys/wait.h>
 #include <utmp.h>
 #else
 #ifdef __FreeBSD__
@@ -33,22 +29,62 @@
 #include <util.h>
 #endif
 #endif
-#endif
 
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <sys/ioctl.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
 
 #ifndef BUFSIZ
 #define BUFSIZ 8096
 #endif
 
-int ckl_script_init(ckl_script_t *s, ckl_conf_t *conf)
+/**
+ * bash integration for command segmentation: runs the user's bashrc, then
+ * makes the prompt report OSC 133 markers (see segment.c).  PS0 needs
+ * bash 4.4; other shells are indexed only if they emit the markers
+ * themselves.
+ */
+static const char script_bash_rc[] =
+  "[ -f ~/.bashrc ] && . ~/.bashrc\n"
+  "__ckl_prompt() { local s=$?; printf '\\033]133;D;%s\\007\\033]133;A\\007' \"$s\"; return $s; }\n"
+  "PROMPT_COMMAND=\"__ckl_prompt${PROMPT_COMMAND:+;$PROMPT_COMMAND}\"\n"
+  "PS1=\"$PS1\\[\\e]133;B\\a\\]\"\n"
+  "PS0=\"\\e]133;C\\a$PS0\"\n";
+
+static int script_is_bash(const char *shell)
+{
+  const char *base = strrchr(shell, '/');
+  base = base ? base + 1 : shell;
+  return strcmp(base, "bash") == 0;
+}
+
+/* a temp buffer, or a journal file when the session is spooled */
+static int script_file(ckl_script_t *s, const char *ext, int memory,
+                       char **path, FILE **fd)
+{
+  if (s->spooled) {
+    return ckl_spool_file(&s->spool, ext, path, fd);
+  }
+
+  return ckl_tmp_buffer(path, fd, memory);
+}
+
+int ckl_script_init(ckl_script_t *s, ckl_conf_t *conf, ckl_msg_t *msg)
 {
   int rv;
 
-  rv = ckl_tmp_file(&s->path, &s->fd);
-  if (rv < 0) {
-    ckl_error_out("failed to create script temp file");
-    return rv;
+  if (conf->spool_dir) {
+    rv = ckl_spool_open(&s->spool, conf, msg);
+    if (rv < 0) {
+      fprintf(stderr, "failed to create spool files\n");
+      return rv;
+    }
+    s->spooled = 1;
   }
 
   const char *sh = getenv("SHELL");
@@ -59,12 +95,99 @@ int ckl_script_init(ckl_script_t *s, ckl_conf_t *conf)
 
   s->shell = strdup(sh);
 
+  /* script(1) writes its own file, so anything that has to see the
+   * output as it is captured needs the native recorder. */
+  s->native = conf->script_native || conf->script_compress > 0 ||
+              conf->script_normalize || conf->redact_count > 0 ||
+              conf->script_max_bytes > 0 || conf->script_commands ||
+              conf->script_io_uring || conf->spool_dir || conf->daemon_socket;
+
+  /* Only a log ckl writes itself can start in memory: it is moved to disk
+   * as it passes ckl_tmp_memory_bytes, which neither script(1) nor a
+   * daemon holding its own copy of the descriptor would follow. */
+  int memory = s->native && !conf->daemon_socket && conf->tmp_memory_bytes > 0;
+
+  /* script(1) opens the log by a name of its own, rather than through a
+   * descriptor of ours that the shell and every command would inherit */
+  if (s->native) {
+    rv = script_file(s, ".log", memory, &s->path, &s->fd);
+  }
+  else {
+    rv = ckl_tmp_file(&s->path, &s->fd);
+  }
+  if (rv < 0) {
+    fprintf(stderr, "failed to create script temp file\n");
+    return rv;
+  }
+
+  if (conf->daemon_socket) {
+    s->daemon_fd = ckl_daemon_connect(conf->daemon_socket);
+    if (s->daemon_fd >= 0) {
+      s->daemon = 1;
+    }
+    else {
+      fprintf(stderr, "Warning: recording daemon at %s is not running, recording locally\n",
+              conf->daemon_socket);
+    }
+  }
+
+  if (s->native) {
+    int raw_fd = -1;
+
+    if (conf->script_normalize && conf->script_keep_raw) {
+      rv = script_file(s, ".raw", memory, &s->raw_path, &s->raw_fd);
+      if (rv < 0) {
+        fprintf(stderr, "failed to create raw script temp file\n");
+        return rv;
+      }
+      raw_fd = fileno(s->raw_fd);
+    }
+
+    int index_fd = -1;
+
+    if (conf->script_commands) {
+      rv = script_file(s, ".idx", conf->tmp_memory_bytes > 0,
+                       &s->index_path, &s->index_fd);
+      if (rv < 0) {
+        fprintf(stderr, "failed to create script index temp file\n");
+        return rv;
+      }
+      index_fd = fileno(s->index_fd);
+
+      if (script_is_bash(s->shell)) {
+        rv = ckl_tmp_buffer(&s->rc_path, &s->rc_fd, 1);
+        if (rv < 0) {
+          fprintf(stderr, "failed to create shell rc temp file\n");
+          return rv;
+        }
+        /* bash has its own descriptor for the file by the time it runs
+         * the first line, which closes the one it inherited from us */
+        fprintf(s->rc_fd, "exec %d<&-\n", fileno(s->rc_fd));
+        fputs(script_bash_rc, s->rc_fd);
+        fflush(s->rc_fd);
+      }
+    }
+
+    /* with a daemon the capture path runs over there */
+    if (!s->daemon) {
+      rv = ckl_capture_init(&s->capture, conf, fileno(s->fd), raw_fd, index_fd);
+      if (rv < 0) {
+        fprintf(stderr, "failed to setup script capture\n");
+        return rv;
+      }
+
+      if (s->spooled) {
+        ckl_capture_journal_tail(&s->capture,
+                                 ckl_spool_path(&s->spool, ".tail"),
+                                 ckl_spool_path(&s->spool, ".rawtail"));
+      }
+    }
+  }
+
   return 0;
 }
 
-#ifdef USE_SIMPLE_SCRIPT
-
-int ckl_script_record(ckl_script_t *s, ckl_msg_t *msg)
+static int script_record_simple(ckl_script_t *s, ckl_msg_t *msg)
 {
   int rv;
   char buf[2048];
@@ -77,54 +200,41 @@ int ckl_script_record(ckl_script_t *s, ckl_msg_t *msg)
     return -1;
   }
 
-  msg->script_log = strdup(s->path);
+  msg->script_log = ckl_arena_strdup(&msg->arena, s->path);
 
   return 0;
 }
 
-#else
+static volatile sig_atomic_t g_script_done = 0;
+static volatile sig_atomic_t g_script_winch = 0;
 
-static int g_script_done = 0;
-static int g_script_child_pid = 0;
 static void script_child_finished(int signo)
 {
-  int rv = 0;
-  union wait status;
+  g_script_done = 1;
+}
 
-  do {
-    rv = wait3((int *)&status, WNOHANG, 0);
-    if (rv == g_script_child_pid) {
-      g_script_done = 1;
-      break;
-    }
-  } while (rv > 0);
+static void script_window_changed(int signo)
+{
+  g_script_winch = 1;
 }
 
-static void script_write_output(ckl_script_t *s, int mpty, int spty)
+static int script_write_all(int fd, const char *buf, size_t len)
 {
-  int rv;
-  int i = 0;
-  close(STDIN_FILENO);
+  ssize_t rv;
 
-  char buf[BUFSIZ];
-  while (1) {
-    i++;
-    rv = read(mpty, buf, sizeof(buf));
-    if (rv > 0) {
-      write(1, buf, rv);
-      fwrite(buf, 1, rv, s->fd);
-      if (i % 10 == 0) {
-        fflush(s->fd);
+  while (len > 0) {
+    rv = write(fd, buf, len);
+    if (rv < 0) {
+      if (errno == EINTR) {
+        continue;
       }
+      return -1;
     }
-    else {
-      break;
-    }
+    buf += rv;
+    len -= rv;
   }
 
-  fclose(s->fd);
-  close(mpty);
-  exit(0);
+  return 0;
 }
 
 static void script_start_shell(ckl_script_t *s, int mpty, int spty)
@@ -138,27 +248,124 @@ static void script_start_shell(ckl_script_t *s, int mpty, int spty)
     exit(EXIT_FAILURE);
   }
 
-  execl(s->shell, s->shell, "-i", NULL);
+  /* bash reads its rc file by /proc/self/fd path, after the exec */
+  if (s->rc_path && ckl_tmp_inherit(s->rc_fd) < 0) {
+    exit(EXIT_FAILURE);
+  }
+
+  if (s->rc_path) {
+    execl(s->shell, s->shell, "--rcfile", s->rc_path, "-i", NULL);
+  }
+  else {
+    execl(s->shell, s->shell, "-i", NULL);
+  }
   perror("execl of shell failed!");
   exit(EXIT_FAILURE);
 }
 
-int ckl_script_record(ckl_script_t *s, ckl_msg_t *msg)
+/**
+ * Copies the shell's output to our terminal and the capture path, and our
+ * terminal's input to the shell, until the shell goes away.
+ */
+static int script_pump(ckl_script_t *s, int mpty)
+{
+  int rv;
+  char buf[BUFSIZ];
+  struct pollfd pfd[2];
+  int nfds = 2;
+  int timeout = 250;
+
+  pfd[0].fd = mpty;
+  pfd[0].events = POLLIN;
+  pfd[1].fd = STDIN_FILENO;
+  pfd[1].events = POLLIN;
+
+  /* wake up often enough to honour the group commit interval */
+  if (s->capture.durable && s->capture.sync_ms > 0 && s->capture.sync_ms < timeout) {
+    timeout = s->capture.sync_ms;
+  }
+
+  while (1) {
+    int n = g_script_done ? 1 : nfds;
+
+    if (g_script_winch) {
+      struct winsize win;
+      g_script_winch = 0;
+      if (ioctl(STDIN_FILENO, TIOCGWINSZ, &win) == 0) {
+        ioctl(mpty, TIOCSWINSZ, &win);
+      }
+    }
+
+    /* once the child is gone we only drain what is left on the master.
+     * The timeout covers SIGCHLD landing just before we block. */
+    rv = poll(pfd, n, g_script_done ? 0 : timeout);
+    if (rv < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("poll() failed:");
+      return -1;
+    }
+
+    if (rv == 0) {
+      if (g_script_done) {
+        break;
+      }
+      if (ckl_capture_sync(&s->capture) < 0) {
+        return -1;
+      }
+      continue;
+    }
+
+    if (pfd[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+      rv = read(mpty, buf, sizeof(buf));
+      if (rv < 0 && errno == EINTR) {
+        continue;
+      }
+      if (rv <= 0) {
+        /* EIO: the slave side was closed by the exiting shell */
+        break;
+      }
+      script_write_all(STDOUT_FILENO, buf, rv);
+      if (ckl_capture_write(&s->capture, buf, rv) < 0) {
+        return -1;
+      }
+    }
+
+    if (n > 1 && (pfd[1].revents & (POLLIN | POLLHUP | POLLERR))) {
+      rv = read(STDIN_FILENO, buf, sizeof(buf));
+      if (rv < 0 && errno == EINTR) {
+        continue;
+      }
+      if (rv <= 0) {
+        nfds = 1;
+        continue;
+      }
+      script_write_all(mpty, buf, rv);
+    }
+  }
+
+  return 0;
+}
+
+static int script_record_native(ckl_script_t *s, ckl_msg_t *msg)
 {
   int rv;
   int mpty = 0;
   int spty = 0;
+  pid_t child;
   struct termios parent_term;
+  struct sigaction sa, old_chld, old_winch;
 
   /**
    * Rough Flow:
    * - Open Sub PTY <http://www.gnu.org/software/hello/manual/libc/Pseudo_002dTerminals.html#Pseudo_002dTerminals>
    * - Setup it like the current one
    *      See: man TCSETATTR(3) <http://www.freebsd.org/cgi/man.cgi?query=tcsetattr>
-   * - Double fork()
-   *    - Spawn Shell on it (via fork/execl)
-   *    - read/write from master process
-   * - Record all input/output to the shell to our file.
+   * - fork()
+   *    - Spawn Shell on it (via execl)
+   *    - parent polls our terminal and the master, copying between them
+   * - Feed everything the shell writes through the capture path.
    * - on exit of child:
    *    - store file in ckl_msg_t
    *    - cleanup
@@ -198,55 +405,237 @@ int ckl_script_record(ckl_script_t *s, ckl_msg_t *msg)
     }
   }
 
-  {
-    int child = 0;
-    signal(SIGCHLD, script_child_finished);
+  /* no SA_RESTART, so a blocked poll() wakes up when the shell exits */
+  memset(&sa, 0, sizeof(sa));
+  sigemptyset(&sa.sa_mask);
+  sa.sa_handler = script_child_finished;
+  sigaction(SIGCHLD, &sa, &old_chld);
+  sa.sa_handler = script_window_changed;
+  sigaction(SIGWINCH, &sa, &old_winch);
+
+  g_script_done = 0;
+  child = fork();
+  if (child < 0) {
+    perror("fork() to child failed:");
+    tcsetattr(STDIN_FILENO, TCSAFLUSH, &parent_term);
+    return -1;
+  }
 
-    g_script_child_pid = child = fork();
-    if (child < 0) {
-      perror("fork() to child failed:");
-      return child;
-    }
+  if (child == 0) {
+    script_start_shell(s, mpty, spty);
+  }
 
-    if (child == 0) {
-      int subchild = child = fork();
-      if (child < 0) {
-        perror("fork() to 2nd child failed:");
-        return child;
-      }
+  close(spty);
 
-      if (child) {
-        script_write_output(s, mpty, spty);
-      }
-      else {
-        script_start_shell(s, mpty, spty);
-      }
-    }
+  rv = script_pump(s, mpty);
+
+  waitpid(child, NULL, 0);
+
+  sigaction(SIGCHLD, &old_chld, NULL);
+  sigaction(SIGWINCH, &old_winch, NULL);
+  tcsetattr(STDIN_FILENO, TCSAFLUSH, &parent_term);
+  close(mpty);
+
+  if (ckl_capture_finish(&s->capture) < 0) {
+    rv = -1;
   }
 
-  /* main process ! */
-  {
-    char buf[BUFSIZ];
-    while (g_script_done == 0) {
-      rv = read(STDIN_FILENO, buf, sizeof(buf));
-      if (rv > 0) {
-        write(mpty, buf, rv);
-      }
-      else {
-        break;
+  if (rv < 0) {
+    return rv;
+  }
+
+  msg->script_log = ckl_arena_strdup(&msg->arena, s->path);
+  msg->script_encoding = s->capture.log.encoding;
+  if (s->raw_path) {
+    msg->script_raw_log = ckl_arena_strdup(&msg->arena, s->raw_path);
+  }
+  if (s->index_path) {
+    msg->script_index = ckl_arena_strdup(&msg->arena, s->index_path);
+  }
+
+  return 0;
+}
+
+/**
+ * Same as the native recorder, except that the pumping and capture happen
+ * in the recording daemon: we set up the PTY, start the shell, hand the
+ * daemon the descriptors and wait for it to report the session done.
+ */
+static int script_record_daemon(ckl_script_t *s, ckl_msg_t *msg)
+{
+  int rv;
+  int mpty = 0;
+  int spty = 0;
+  int tty;
+  int fds[5];
+  int nfds = 0;
+  const char *name;
+  pid_t child;
+  struct termios parent_term;
+  struct winsize parent_win;
+  struct termios child_term;
+  struct sigaction sa, old_winch;
+  struct pollfd pfd;
+  ckl_daemon_hello_t hello;
+  ckl_daemon_reply_t reply;
+
+  rv = tcgetattr(STDIN_FILENO, &parent_term);
+  if (rv != 0) {
+    perror("tcgetattr(STDIN_FILENO) failed:");
+    return rv;
+  }
+
+  rv = ioctl(STDIN_FILENO, TIOCGWINSZ, &parent_win);
+  if (rv != 0) {
+    perror("ioctl(TIOCGWINSZ on parent) failed:");
+    return rv;
+  }
+
+  rv = openpty(&mpty, &spty, NULL, &parent_term, &parent_win);
+  if (rv != 0) {
+    perror("openpty() failed:");
+    return rv;
+  }
+  fcntl(mpty, F_SETFD, FD_CLOEXEC);
+
+  /* the daemon makes its terminal non-blocking; a description of its own
+   * keeps that from leaking into our stdin, and the user's shell's */
+  name = ttyname(STDIN_FILENO);
+  tty = name ? open(name, O_RDWR | O_NOCTTY) : -1;
+  if (tty < 0) {
+    perror("reopening the terminal failed:");
+    return -1;
+  }
+
+  memset(&hello, 0, sizeof(hello));
+  hello.magic = CKL_DAEMON_MAGIC;
+  fds[nfds++] = tty;
+  fds[nfds++] = mpty;
+  fds[nfds++] = fileno(s->fd);
+  if (s->raw_fd) {
+    hello.flags |= CKL_DAEMON_RAW;
+    fds[nfds++] = fileno(s->raw_fd);
+  }
+  if (s->index_fd) {
+    hello.flags |= CKL_DAEMON_INDEX;
+    fds[nfds++] = fileno(s->index_fd);
+  }
+
+  rv = ckl_daemon_attach(s->daemon_fd, &hello, fds, nfds);
+  close(tty);
+  if (rv < 0) {
+    close(mpty);
+    close(spty);
+    return rv;
+  }
+
+  child_term = parent_term;
+  cfmakeraw(&child_term);
+  child_term.c_lflag &= ~ECHO;
+
+  rv = tcsetattr(STDIN_FILENO, TCSAFLUSH, &child_term);
+  if (rv != 0) {
+    perror("tcsetattr(TCSAFLUSH on child) failed:");
+    return rv;
+  }
+
+  memset(&sa, 0, sizeof(sa));
+  sigemptyset(&sa.sa_mask);
+  sa.sa_handler = script_window_changed;
+  sigaction(SIGWINCH, &sa, &old_winch);
+
+  child = fork();
+  if (child < 0) {
+    perror("fork() to child failed:");
+    tcsetattr(STDIN_FILENO, TCSAFLUSH, &parent_term);
+    return -1;
+  }
+
+  if (child == 0) {
+    close(s->daemon_fd);
+    script_start_shell(s, mpty, spty);
+  }
+
+  close(spty);
+
+  pfd.fd = s->daemon_fd;
+  pfd.events = POLLIN;
+
+  while (1) {
+    if (g_script_winch) {
+      struct winsize win;
+      g_script_winch = 0;
+      if (ioctl(STDIN_FILENO, TIOCGWINSZ, &win) == 0) {
+        ioctl(mpty, TIOCSWINSZ, &win);
       }
     }
+
+    rv = poll(&pfd, 1, -1);
+    if (rv < 0 && errno == EINTR) {
+      continue;
+    }
+
+    rv = read(s->daemon_fd, &reply, sizeof(reply));
+    if (rv < 0 && errno == EINTR) {
+      continue;
+    }
+    break;
   }
 
-  tcsetattr(STDIN_FILENO, TCSAFLUSH, &parent_term);
+  if (rv != sizeof(reply) || reply.magic != CKL_DAEMON_MAGIC) {
+    /* nobody is pumping the shell anymore */
+    fprintf(stderr, "\r\nThe recording daemon went away, ending the session\r\n");
+    kill(child, SIGHUP);
+    reply.status = -1;
+  }
+
+  waitpid(child, NULL, 0);
 
-  msg->script_log = strdup(s->path);
+  sigaction(SIGWINCH, &old_winch, NULL);
+  tcsetattr(STDIN_FILENO, TCSAFLUSH, &parent_term);
   close(mpty);
-  close(spty);
+
+  if (reply.status < 0) {
+    return -1;
+  }
+
+  msg->script_log = ckl_arena_strdup(&msg->arena, s->path);
+  msg->script_encoding = (reply.flags & CKL_DAEMON_GZIP) ? "gzip" : NULL;
+  if (s->raw_path) {
+    msg->script_raw_log = ckl_arena_strdup(&msg->arena, s->raw_path);
+  }
+  if (s->index_path) {
+    msg->script_index = ckl_arena_strdup(&msg->arena, s->index_path);
+  }
+
   return 0;
 }
 
-#endif
+int ckl_script_record(ckl_script_t *s, ckl_msg_t *msg)
+{
+  unsigned long long bytes = 0;
+  struct stat st;
+  int rv;
+
+  CKL_TRACE_START(CKL_SPAN_SCRIPT, script);
+
+  if (s->daemon) {
+    rv = script_record_daemon(s, msg);
+  }
+  else if (s->native) {
+    rv = script_record_native(s, msg);
+    bytes = s->capture.bytes;
+  }
+  else {
+    rv = script_record_simple(s, msg);
+    if (s->path && stat(s->path, &st) == 0) {
+      bytes = st.st_size;
+    }
+  }
+
+  CKL_TRACE_DONE(CKL_SPAN_SCRIPT, script, rv, bytes);
+  return rv;
+}
 
 void ckl_script_free(ckl_script_t *s)
 {
@@ -254,9 +643,36 @@ void ckl_script_free(ckl_script_t *s)
     fclose(s->fd);
   }
   if (s->path) {
-    unlink(s->path);
+    ckl_tmp_remove(s->path);
     free(s->path);
   }
+  if (s->raw_fd != NULL) {
+    fclose(s->raw_fd);
+  }
+  if (s->raw_path) {
+    ckl_tmp_remove(s->raw_path);
+    free(s->raw_path);
+  }
+  if (s->index_fd != NULL) {
+    fclose(s->index_fd);
+  }
+  if (s->index_path) {
+    ckl_tmp_remove(s->index_path);
+    free(s->index_path);
+  }
+  if (s->rc_fd != NULL) {
+    fclose(s->rc_fd);
+  }
+  if (s->rc_path) {
+    ckl_tmp_remove(s->rc_path);
+    free(s->rc_path);
+  }
+  if (s->spooled) {
+    ckl_spool_close(&s->spool);
+  }
+  if (s->daemon) {
+    close(s->daemon_fd);
+  }
   if (s->shell) {
     free((char*)s->shell);
   }
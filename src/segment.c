@@ -0,0 +1,243 @@
+/*
+ * Licensed to Cloudkick, Inc under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * Cloudkick licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ckl.h"
+#include <stdio.h>
+#include <sys/time.h>
+
+/**
+ * Splits a recorded session into commands using the OSC 133 shell
+ * integration markers (the FinalTerm protocol):
+ *
+ *   ESC ] 133 ; A BEL       prompt starts
+ *   ESC ] 133 ; B BEL       prompt ends, the user is typing
+ *   ESC ] 133 ; C BEL       the command line was accepted, output follows
+ *   ESC ] 133 ; D ; n BEL   the command exited with status n
+ *
+ * Everything is passed through untouched; the markers only produce
+ * entries in the command index.  The command line is whatever the
+ * terminal echoed between B and C, cleaned up by a normalizer.
+ */
+
+#define SEG_OSC_MAX 64
+#define SEG_CMD_MAX 4096
+
+enum {
+  SEG_TEXT,
+  SEG_ESC,
+  SEG_OSC,
+  SEG_OSC_ESC
+};
+
+static unsigned long long seg_now_ms()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (unsigned long long)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static int seg_collect(void *baton, const char *buf, size_t len)
+{
+  ckl_segment_t *g = baton;
+
+  if (g->cmd_len + len > SEG_CMD_MAX) {
+    len = SEG_CMD_MAX - g->cmd_len;
+  }
+  memcpy(g->cmd + g->cmd_len, buf, len);
+  g->cmd_len += len;
+  return 0;
+}
+
+static int seg_forward(ckl_segment_t *g, const char *buf, size_t len)
+{
+  if (len == 0) {
+    return 0;
+  }
+
+  if (g->in_input) {
+    ckl_normalize_write(&g->input, buf, len);
+  }
+
+  return g->emit(g->baton, buf, len);
+}
+
+static void seg_marker(ckl_segment_t *g, const char *osc, size_t len)
+{
+  ckl_command_t *cmd;
+
+  if (len < 5 || strncmp(osc, "133;", 4) != 0) {
+    return;
+  }
+
+  switch (osc[4]) {
+    case 'B':
+      if (g->in_input) {
+        ckl_normalize_reset(&g->input);
+      }
+      g->cmd_len = 0;
+      g->in_input = 1;
+      break;
+
+    case 'C':
+      if (g->count == g->alloc) {
+        g->alloc = g->alloc ? g->alloc * 2 : 64;
+        g->cmds = realloc(g->cmds, g->alloc * sizeof(ckl_command_t));
+      }
+      cmd = &g->cmds[g->count++];
+      memset(cmd, 0, sizeof(*cmd));
+
+      if (g->in_input) {
+        ckl_normalize_reset(&g->input);
+        g->in_input = 0;
+      }
+      /* drop the echoed newline(s) */
+      while (g->cmd_len > 0 && isspace((unsigned char)g->cmd[g->cmd_len - 1])) {
+        g->cmd_len--;
+      }
+      cmd->cmdline = malloc(g->cmd_len + 1);
+      memcpy(cmd->cmdline, g->cmd, g->cmd_len);
+      cmd->cmdline[g->cmd_len] = '\0';
+
+      cmd->offset = g->offset(g->baton);
+      cmd->start_ms = seg_now_ms() - g->session_start_ms;
+      cmd->exit_code = -1;
+      g->running = 1;
+      break;
+
+    case 'D':
+      if (!g->running) {
+        /* the first prompt reports a status too, there was no command */
+        break;
+      }
+      cmd = &g->cmds[g->count - 1];
+      cmd->duration_ms = seg_now_ms() - g->session_start_ms - cmd->start_ms;
+      if (len > 6 && osc[5] == ';') {
+        cmd->exit_code = atoi(osc + 6);
+      }
+      g->running = 0;
+      break;
+  }
+}
+
+int ckl_segment_init(ckl_segment_t *g, ckl_emit_fn emit,
+                     unsigned long long (*offset)(void *baton), void *baton)
+{
+  memset(g, 0, sizeof(*g));
+  g->emit = emit;
+  g->offset = offset;
+  g->baton = baton;
+  g->cmd = malloc(SEG_CMD_MAX);
+  g->session_start_ms = seg_now_ms();
+  /* one for the session, reset at every prompt */
+  ckl_normalize_init(&g->input, seg_collect, g);
+  return 0;
+}
+
+int ckl_segment_write(ckl_segment_t *g, const char *buf, size_t len)
+{
+  size_t fwd = 0;
+  size_t i = 0;
+  int rv;
+
+  while (i < len) {
+    if (g->state == SEG_TEXT) {
+      const char *e = memchr(buf + i, '\033', len - i);
+      if (e == NULL) {
+        break;
+      }
+      i = e - buf + 1;
+      g->state = SEG_ESC;
+      continue;
+    }
+
+    char c = buf[i++];
+
+    switch (g->state) {
+      case SEG_ESC:
+        if (c == ']') {
+          g->state = SEG_OSC;
+          g->osc_len = 0;
+        }
+        else {
+          g->state = SEG_TEXT;
+        }
+        break;
+      case SEG_OSC:
+      case SEG_OSC_ESC:
+        if (c == '\a' || (g->state == SEG_OSC_ESC && c == '\\')) {
+          /* the marker is complete: everything before it goes out first,
+           * so the offset we record points just past it */
+          rv = seg_forward(g, buf + fwd, i - fwd);
+          if (rv < 0) {
+            return rv;
+          }
+          fwd = i;
+          g->state = SEG_TEXT;
+          seg_marker(g, g->osc, g->osc_len);
+        }
+        else if (c == '\033') {
+          g->state = SEG_OSC_ESC;
+        }
+        else {
+          g->state = SEG_OSC;
+          if (g->osc_len < SEG_OSC_MAX) {
+            g->osc[g->osc_len++] = c;
+          }
+        }
+        break;
+    }
+  }
+
+  return seg_forward(g, buf + fwd, len - fwd);
+}
+
+void ckl_segment_free(ckl_segment_t *g)
+{
+  size_t i;
+
+  ckl_normalize_finish(&g->input);
+
+  for (i = 0; i < g->count; i++) {
+    free(g->cmds[i].cmdline);
+  }
+  free(g->cmds);
+  free(g->cmd);
+  memset(g, 0, sizeof(*g));
+}
+
+/* a command line in the index, with backslash, tab and newline escaped */
+void ckl_index_escape(FILE *fp, const char *cmdline)
+{
+  const char *p;
+
+  for (p = cmdline; *p; p++) {
+    switch (*p) {
+      case '\\':
+        fputs("\\\\", fp);
+        break;
+      case '\t':
+        fputs("\\t", fp);
+        break;
+      case '\n':
+        fputs("\\n", fp);
+        break;
+      default:
+        fputc(*p, fp);
+        break;
+    }
+  }
+}
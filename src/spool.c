@@ -0,0 +1,573 @@
+/*
+ * Licensed to Cloudkick, Inc under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * Cloudkick licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ckl.h"
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+/**
+ * Session journal.  With ckl_spool_dir set, a recording lives in the spool
+ * instead of /tmp, as a set of files sharing a name:
+ *
+ *   <ts>.<pid>.session   header: host, user, start time, encoding, message
+ *   <ts>.<pid>.log       the script log (and .raw, .idx like the temp files)
+ *   <ts>.<pid>.tail      a capped log's tail ring (and .rawtail for .raw)
+ *
+ * The recording ckl holds an exclusive flock on the .session file until
+ * the session is uploaded and removed.  A .session nobody holds a lock on
+ * belongs to a ckl that died, and is uploaded by the next run, with the
+ * journaled tail of a capped log spliced back in after its head.
+ */
+
+#define SPOOL_MAGIC "ckl-session 1"
+
+static const char *spool_parts[] = {".log", ".raw", ".idx"};
+
+/* a tail journal, the log it goes after, and its half-written rewrite */
+static const char *spool_tails[][3] = {
+  {".tail", ".log", ".tail.new"},
+  {".rawtail", ".raw", ".rawtail.new"}
+};
+
+static char *spool_name(const char *base, const char *ext)
+{
+  size_t lb = strlen(base);
+  size_t le = strlen(ext);
+  char *p = malloc(lb + le + 1);
+
+  memcpy(p, base, lb);
+  memcpy(p + lb, ext, le + 1);
+  return p;
+}
+
+static int spool_write_header(ckl_spool_t *sp, ckl_conf_t *conf, ckl_msg_t *msg)
+{
+  FILE *fp = fdopen(dup(sp->fd), "w");
+  const char *encoding = NULL;
+  int rv;
+  int i;
+
+#ifdef HAVE_ZLIB
+  if (conf->script_compress > 0) {
+    encoding = "gzip";
+  }
+#endif
+
+  if (fp == NULL) {
+    perror("fdopen() of spool header failed");
+    return -1;
+  }
+
+  /* the message goes last, after a blank line, so it can span lines */
+  fprintf(fp, "%s\nts %ld\nhost %s\nuser %s\n", SPOOL_MAGIC, (long)msg->ts,
+          msg->hostname, msg->username);
+  if (encoding) {
+    fprintf(fp, "encoding %s\n", encoding);
+  }
+  for (i = 0; i < msg->tag_count; i++) {
+    fprintf(fp, "tag %s\n", msg->tags[i]);
+  }
+  fprintf(fp, "\n%s", msg->msg);
+
+  rv = fclose(fp);
+  if (rv == 0) {
+    rv = fdatasync(sp->fd);
+  }
+  if (rv != 0) {
+    perror("writing spool header failed");
+    return -1;
+  }
+
+  return 0;
+}
+
+static int spool_open(ckl_spool_t *sp, ckl_conf_t *conf, ckl_msg_t *msg)
+{
+  char buf[2048];
+
+  memset(sp, 0, sizeof(*sp));
+  sp->fd = -1;
+
+  if (mkdir(conf->spool_dir, 0700) < 0 && errno != EEXIST) {
+    fprintf(stderr, "Unable to create spool directory %s: %s\n",
+            conf->spool_dir, strerror(errno));
+    return -1;
+  }
+
+  snprintf(buf, sizeof(buf), "%s/%ld.%d", conf->spool_dir, (long)msg->ts,
+           (int)getpid());
+  sp->base = strdup(buf);
+  sp->path = spool_name(sp->base, ".session");
+
+  /* close-on-exec, or the shell would inherit the lock and keep the
+   * session looking alive after we are gone */
+  sp->fd = open(sp->path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+  if (sp->fd < 0) {
+    fprintf(stderr, "Unable to create spool file %s: %s\n", sp->path,
+            strerror(errno));
+    return -1;
+  }
+
+  if (flock(sp->fd, LOCK_EX | LOCK_NB) < 0) {
+    perror("flock() of spool file failed");
+    return -1;
+  }
+
+  return spool_write_header(sp, conf, msg);
+}
+
+int ckl_spool_open(ckl_spool_t *sp, ckl_conf_t *conf, ckl_msg_t *msg)
+{
+  int rv;
+
+  CKL_TRACE_START(CKL_SPAN_SPOOL_ENQUEUE, spool_enqueue);
+  rv = spool_open(sp, conf, msg);
+  CKL_TRACE_DONE(CKL_SPAN_SPOOL_ENQUEUE, spool_enqueue, rv, 0);
+
+  return rv;
+}
+
+char *ckl_spool_path(ckl_spool_t *sp, const char *ext)
+{
+  return spool_name(sp->base, ext);
+}
+
+int ckl_spool_file(ckl_spool_t *sp, const char *ext, char **path, FILE **fd)
+{
+  char *p = spool_name(sp->base, ext);
+  int fx = open(p, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+
+  if (fx < 0) {
+    fprintf(stderr, "Unable to create spool file %s: %s\n", p,
+            strerror(errno));
+    free(p);
+    return -1;
+  }
+
+  *fd = fdopen(fx, "r+");
+  *path = p;
+  return 0;
+}
+
+static void spool_remove(const char *base, const char *path)
+{
+  size_t i;
+
+  for (i = 0; i < sizeof(spool_parts) / sizeof(spool_parts[0]); i++) {
+    char *p = spool_name(base, spool_parts[i]);
+    unlink(p);
+    free(p);
+  }
+
+  for (i = 0; i < sizeof(spool_tails) / sizeof(spool_tails[0]); i++) {
+    char *p = spool_name(base, spool_tails[i][0]);
+    unlink(p);
+    free(p);
+    p = spool_name(base, spool_tails[i][2]);
+    unlink(p);
+    free(p);
+  }
+
+  /* the header last: while it exists the session is still owed */
+  unlink(path);
+}
+
+void ckl_spool_close(ckl_spool_t *sp)
+{
+  if (sp->path) {
+    spool_remove(sp->base, sp->path);
+  }
+
+  if (sp->fd >= 0) {
+    close(sp->fd);
+  }
+
+  free(sp->path);
+  free(sp->base);
+  memset(sp, 0, sizeof(*sp));
+  sp->fd = -1;
+}
+
+static int spool_read_header(int fd, ckl_msg_t *msg)
+{
+  char buf[8096];
+  char *p;
+  FILE *fp = fdopen(dup(fd), "r");
+  size_t len = 0;
+  size_t n;
+  char *body = NULL;
+
+  if (fp == NULL) {
+    return -1;
+  }
+
+  p = fgets(buf, sizeof(buf), fp);
+  if (p == NULL || strncmp(p, SPOOL_MAGIC, strlen(SPOOL_MAGIC)) != 0) {
+    fclose(fp);
+    return -1;
+  }
+
+  while ((p = fgets(buf, sizeof(buf), fp)) != NULL && p[0] != '\n') {
+    ckl_nuke_newlines(p);
+    if (strncmp("ts ", p, 3) == 0) {
+      msg->ts = strtol(p + 3, NULL, 10);
+    }
+    else if (strncmp("host ", p, 5) == 0) {
+      msg->hostname = ckl_arena_strdup(&msg->arena, p + 5);
+    }
+    else if (strncmp("user ", p, 5) == 0) {
+      msg->username = ckl_arena_strdup(&msg->arena, p + 5);
+    }
+    else if (strncmp("encoding ", p, 9) == 0) {
+      msg->script_encoding = strcmp(p + 9, "gzip") == 0 ? "gzip" : NULL;
+    }
+    else if (strncmp("tag ", p, 4) == 0) {
+      ckl_msg_add_tag(msg, p + 4);
+    }
+  }
+
+  while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+    body = realloc(body, len + n + 1);
+    memcpy(body + len, buf, n);
+    len += n;
+  }
+  fclose(fp);
+
+  if (body == NULL) {
+    body = malloc(1);
+  }
+  body[len] = '\0';
+  msg->msg = ckl_arena_own(&msg->arena, body);
+
+  if (msg->hostname == NULL || msg->username == NULL) {
+    return -1;
+  }
+
+  return 0;
+}
+
+#ifdef HAVE_ZLIB
+static int spool_deflate(z_stream *zs, ckl_writer_t *w, const char *buf,
+                         size_t len, int flush)
+{
+  unsigned char out[16384];
+  int rv;
+
+  zs->next_in = (Bytef *)buf;
+  zs->avail_in = len;
+
+  do {
+    zs->next_out = out;
+    zs->avail_out = sizeof(out);
+
+    rv = deflate(zs, flush);
+    if (rv == Z_STREAM_ERROR) {
+      fprintf(stderr, "deflate() of script log tail failed\n");
+      return -1;
+    }
+
+    if (ckl_writer_write(w, (char *)out, sizeof(out) - zs->avail_out) < 0) {
+      return -1;
+    }
+  } while (zs->avail_out == 0);
+
+  return 0;
+}
+
+/**
+ * The head of a gzip log ends on a sync flush, so the rest can follow as
+ * more deflate blocks.  The trailer wants the CRC and length of all of it,
+ * which takes one pass over the head.
+ */
+static int spool_gzip_append(ckl_writer_t *w, int level, const char *marker,
+                             size_t marker_len, const char *tail,
+                             size_t tail_len)
+{
+  unsigned char in[16384];
+  unsigned char out[16384];
+  unsigned char trailer[8];
+  uLong crc = crc32(0L, Z_NULL, 0);
+  unsigned long long total = 0;
+  z_stream zs;
+  ssize_t n;
+  int rv = 0;
+  int i;
+
+  memset(&zs, 0, sizeof(zs));
+  if (inflateInit2(&zs, MAX_WBITS + 16) != Z_OK) {
+    return -1;
+  }
+
+  while (rv == 0 && (n = read(w->fd, in, sizeof(in))) > 0) {
+    zs.next_in = in;
+    zs.avail_in = n;
+
+    do {
+      zs.next_out = out;
+      zs.avail_out = sizeof(out);
+
+      rv = inflate(&zs, Z_NO_FLUSH);
+      if (rv != Z_OK && rv != Z_BUF_ERROR) {
+        /* a stream that ends was finished, and can not be added to */
+        rv = -1;
+        break;
+      }
+      rv = 0;
+
+      crc = crc32(crc, out, sizeof(out) - zs.avail_out);
+      total += sizeof(out) - zs.avail_out;
+    } while (zs.avail_out == 0);
+  }
+  inflateEnd(&zs);
+
+  if (rv < 0 || n < 0) {
+    fprintf(stderr, "Unable to read the head of the script log\n");
+    return -1;
+  }
+
+  memset(&zs, 0, sizeof(zs));
+  if (deflateInit2(&zs, level, Z_DEFLATED, -MAX_WBITS, 8,
+                   Z_DEFAULT_STRATEGY) != Z_OK) {
+    return -1;
+  }
+
+  crc = crc32(crc, (const Bytef *)marker, marker_len);
+  crc = crc32(crc, (const Bytef *)tail, tail_len);
+  total += marker_len + tail_len;
+
+  rv = spool_deflate(&zs, w, marker, marker_len, Z_NO_FLUSH);
+  if (rv == 0) {
+    rv = spool_deflate(&zs, w, tail, tail_len, Z_FINISH);
+  }
+  deflateEnd(&zs);
+
+  if (rv < 0) {
+    return rv;
+  }
+
+  for (i = 0; i < 4; i++) {
+    trailer[i] = (crc >> (8 * i)) & 0xff;
+    trailer[4 + i] = (total >> (8 * i)) & 0xff;
+  }
+
+  return ckl_writer_write(w, (char *)trailer, sizeof(trailer));
+}
+#endif
+
+/**
+ * A capped session that died kept its tail in a journal (see capture.c).
+ * The log is cut back to where its head ended and gets the marker and the
+ * tail after it, as if the session had finished; the journal goes last,
+ * so doing this twice gives the same log.
+ */
+static int spool_splice_tail(ckl_conf_t *conf, const char *base,
+                             const char *tail_ext, const char *log_ext,
+                             int gzip)
+{
+  char *tail_path = spool_name(base, tail_ext);
+  char *log_path = spool_name(base, log_ext);
+  unsigned long long size;
+  unsigned long long dropped;
+  unsigned long long log_len;
+  unsigned long long elided;
+  char *data = NULL;
+  char marker[128];
+  size_t marker_len = 0;
+  size_t len = 0;
+  size_t keep;
+  size_t n;
+  char buf[8096];
+  ckl_writer_t w;
+  struct stat st;
+  FILE *fp;
+  int fd = -1;
+  int rv = -1;
+
+  fp = fopen(tail_path, "r");
+  if (fp == NULL) {
+    /* not capped, or it never got past the head */
+    free(tail_path);
+    free(log_path);
+    return 0;
+  }
+
+  if (fgets(buf, sizeof(buf), fp) == NULL ||
+      sscanf(buf, CKL_TAIL_MAGIC " %llu %llu %llu", &size, &dropped,
+             &log_len) != 3) {
+    fprintf(stderr, "Skipping unreadable spool file %s\n", tail_path);
+    goto out;
+  }
+
+  while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+    data = realloc(data, len + n);
+    memcpy(data + len, buf, n);
+    len += n;
+  }
+
+  keep = len > size ? size : len;
+  elided = dropped + (len - keep);
+  if (elided > 0) {
+    marker_len = snprintf(marker, sizeof(marker), CKL_ELIDED_MARKER, elided);
+  }
+
+  fd = open(log_path, O_RDWR | O_CLOEXEC);
+  if (fd < 0 || fstat(fd, &st) < 0 || (unsigned long long)st.st_size < log_len) {
+    fprintf(stderr, "Spool file %s is shorter than its tail journal says\n",
+            log_path);
+    goto out;
+  }
+
+  if (ftruncate(fd, log_len) < 0) {
+    perror("ftruncate() of script log failed");
+    goto out;
+  }
+
+  ckl_writer_init(&w, fd, 0);
+
+  if (gzip) {
+#ifdef HAVE_ZLIB
+    int level = conf->script_compress;
+
+    if (level <= 0 || level > Z_BEST_COMPRESSION) {
+      level = Z_DEFAULT_COMPRESSION;
+    }
+    rv = spool_gzip_append(&w, level, marker, marker_len,
+                           data + len - keep, keep);
+#endif
+  }
+  else if (lseek(fd, 0, SEEK_END) >= 0 &&
+           ckl_writer_write(&w, marker, marker_len) == 0) {
+    rv = ckl_writer_write(&w, data + len - keep, keep);
+  }
+
+  if (rv == 0) {
+    rv = ckl_writer_sync(&w, 1);
+  }
+
+  if (rv == 0) {
+    unlink(tail_path);
+  }
+
+out:
+  if (fd >= 0) {
+    close(fd);
+  }
+  fclose(fp);
+  free(data);
+  free(tail_path);
+  free(log_path);
+  return rv;
+}
+
+static int spool_upload(ckl_conf_t *conf, const char *base, int fd,
+                        ckl_spool_send_fn send)
+{
+  ckl_msg_t *msg = calloc(1, sizeof(ckl_msg_t));
+  const char **parts[] = {&msg->script_log, &msg->script_raw_log,
+                          &msg->script_index};
+  struct stat st;
+  size_t i;
+  int rv;
+
+  CKL_TRACE_START(CKL_SPAN_SPOOL_DEQUEUE, spool_dequeue);
+  rv = spool_read_header(fd, msg);
+  if (rv < 0) {
+    fprintf(stderr, "Skipping unreadable spool file %s.session\n", base);
+    ckl_msg_free(msg);
+    CKL_TRACE_DONE(CKL_SPAN_SPOOL_DEQUEUE, spool_dequeue, rv, 0);
+    return rv;
+  }
+
+  for (i = 0; i < sizeof(spool_tails) / sizeof(spool_tails[0]); i++) {
+    if (spool_splice_tail(conf, base, spool_tails[i][0], spool_tails[i][1],
+                          msg->script_encoding != NULL) < 0) {
+      fprintf(stderr, "Uploading %s%s without its tail\n", base,
+              spool_tails[i][1]);
+    }
+  }
+
+  for (i = 0; i < sizeof(spool_parts) / sizeof(spool_parts[0]); i++) {
+    char *p = spool_name(base, spool_parts[i]);
+    if (stat(p, &st) == 0 && st.st_size > 0) {
+      *parts[i] = ckl_arena_own(&msg->arena, p);
+    }
+    else {
+      free(p);
+    }
+  }
+
+  fprintf(stderr, "Uploading interrupted session from %s", ctime(&msg->ts));
+  ckl_metrics_retry(&conf->metrics);
+
+  rv = send(conf, msg);
+  ckl_msg_free(msg);
+  CKL_TRACE_DONE(CKL_SPAN_SPOOL_DEQUEUE, spool_dequeue, rv, 0);
+
+  return rv;
+}
+
+int ckl_spool_recover(ckl_conf_t *conf, ckl_spool_send_fn send)
+{
+  DIR *dir = opendir(conf->spool_dir);
+  struct dirent *ent;
+  char buf[2048];
+
+  if (dir == NULL) {
+    /* nothing was ever spooled */
+    return 0;
+  }
+
+  while ((ent = readdir(dir)) != NULL) {
+    size_t len = strlen(ent->d_name);
+    int fd;
+
+    if (len < 8 || strcmp(ent->d_name + len - 8, ".session") != 0) {
+      continue;
+    }
+
+    snprintf(buf, sizeof(buf), "%s/%s", conf->spool_dir, ent->d_name);
+    fd = open(buf, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      continue;
+    }
+
+    /* held by a ckl that is still recording */
+    if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+      close(fd);
+      continue;
+    }
+
+    buf[strlen(buf) - 8] = '\0';
+    if (spool_upload(conf, buf, fd, send) == 0) {
+      char *path = spool_name(buf, ".session");
+      spool_remove(buf, path);
+      free(path);
+    }
+    else {
+      fprintf(stderr, "Leaving %s.session in the spool for the next run\n", buf);
+    }
+
+    close(fd);
+  }
+
+  closedir(dir);
+  return 0;
+}
@@ -0,0 +1,830 @@
+/*
+ * Licensed to Cloudkick, Inc under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * Cloudkick licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE
+#include "ckl.h"
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <time.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/**
+ * Local changelog.  With ckl_store_dir set, every entry ckl sends is also
+ * appended to two files in it:
+ *
+ *   entries   the entries, each like a spool header: ts, host, user, tags,
+ *             the size of its script log and its commands, a blank line,
+ *             then the message
+ *   index     a fixed-size record per entry, oldest first: where the
+ *             entry is in entries, and its time
+ *
+ * so -l and -d can be answered from the host, with both files mapped,
+ * while the endpoint is down or far away.  Entries are numbered newest
+ * first, from 1, like the endpoint's.
+ *
+ * `ckl --sync` adds the host's entries that reached the endpoint some
+ * other way: the endpoint's /sync streams the events after the highest
+ * event id the store has seen from it, kept per host in <dir>/sync, in
+ * the same form as entries.  An event that is an entry this host sent
+ * replaces it, and entries are listed in the order of their time.
+ *
+ * Writers hold an exclusive flock on entries.  An entry goes first and
+ * its record second, so a ckl that dies in between leaves bytes no record
+ * points to, which are never read.  The script log itself stays on the
+ * endpoint.
+ */
+
+#define STORE_MAGIC "ckl-store 1\n"
+#define SYNC_MAGIC "ckl-sync 1\n"
+#define STORE_STDIN "[message read from stdin]"
+
+/* flags of a record */
+#define STORE_SYNCED 1   /* the entry came from the endpoint's /sync */
+#define STORE_REPLACED 2 /* and a later one from /sync is this entry */
+
+struct ckl_store_rec_t {
+  uint64_t off;
+  uint32_t len;
+  uint32_t flags;
+  int64_t ts;
+};
+
+/* the files, held for writing */
+typedef struct store_lock_t {
+  int efd;
+  int ifd;
+  off_t end;
+  size_t nrec;
+} store_lock_t;
+
+static char *store_name(const char *dir, const char *name)
+{
+  size_t ld = strlen(dir);
+  size_t ln = strlen(name);
+  char *p = malloc(ld + ln + 2);
+
+  memcpy(p, dir, ld);
+  p[ld] = '/';
+  memcpy(p + ld + 1, name, ln + 1);
+  return p;
+}
+
+static int store_open_file(const char *dir, const char *name, int flags)
+{
+  char *path = store_name(dir, name);
+  int fd = open(path, flags | O_CLOEXEC, 0600);
+
+  if (fd < 0 && (errno != ENOENT || (flags & O_CREAT))) {
+    fprintf(stderr, "Unable to open store file %s: %s\n", path,
+            strerror(errno));
+  }
+  free(path);
+  return fd;
+}
+
+/* the commands of the session from its index, without the time marks */
+static void store_commands(FILE *fp, const char *index_path)
+{
+  FILE *idx = fopen(index_path, "r");
+  char buf[8192];
+
+  if (idx == NULL) {
+    return;
+  }
+
+  while (fgets(buf, sizeof(buf), idx) != NULL) {
+    if (buf[0] == '#' || buf[0] == '@' || strchr(buf, '\n') == NULL) {
+      continue;
+    }
+    fprintf(fp, "cmd %s", buf);
+  }
+
+  fclose(idx);
+}
+
+static int store_write(int fd, const char *buf, size_t len)
+{
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      return -1;
+    }
+    buf += n;
+    len -= n;
+  }
+
+  return 0;
+}
+
+static void store_unlock(store_lock_t *l)
+{
+  if (l->efd >= 0) {
+    close(l->efd);
+  }
+  if (l->ifd >= 0) {
+    close(l->ifd);
+  }
+}
+
+static int store_lock(const char *dir, store_lock_t *l)
+{
+  struct stat st;
+
+  l->efd = l->ifd = -1;
+
+  if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+    fprintf(stderr, "Unable to create store directory %s: %s\n", dir,
+            strerror(errno));
+    return -1;
+  }
+
+  /* records are written with pwrite(), which O_APPEND would ignore */
+  l->efd = store_open_file(dir, "entries", O_RDWR | O_CREAT | O_APPEND);
+  l->ifd = store_open_file(dir, "index", O_RDWR | O_CREAT);
+  if (l->efd < 0 || l->ifd < 0) {
+    store_unlock(l);
+    return -1;
+  }
+
+  if (flock(l->efd, LOCK_EX) < 0 || fstat(l->efd, &st) < 0) {
+    perror("locking the store failed");
+    store_unlock(l);
+    return -1;
+  }
+  l->end = st.st_size;
+
+  if (fstat(l->ifd, &st) < 0) {
+    perror("fstat() of the store index failed");
+    store_unlock(l);
+    return -1;
+  }
+  l->nrec = st.st_size / sizeof(struct ckl_store_rec_t);
+
+  if (l->end == 0) {
+    if (store_write(l->efd, STORE_MAGIC, strlen(STORE_MAGIC)) < 0) {
+      perror("writing the store failed");
+      store_unlock(l);
+      return -1;
+    }
+    l->end = strlen(STORE_MAGIC);
+  }
+
+  return 0;
+}
+
+/* a torn record left by a ckl that died is written over */
+static int store_put(store_lock_t *l, time_t ts, uint32_t flags,
+                     const char *buf, size_t len)
+{
+  struct ckl_store_rec_t rec;
+
+  memset(&rec, 0, sizeof(rec));
+  rec.off = l->end;
+  rec.len = len;
+  rec.flags = flags;
+  rec.ts = ts;
+
+  if (store_write(l->efd, buf, len) < 0 ||
+      pwrite(l->ifd, &rec, sizeof(rec), l->nrec * sizeof(rec)) != sizeof(rec)) {
+    perror("appending to the store failed");
+    return -1;
+  }
+
+  l->end += len;
+  l->nrec++;
+  return 0;
+}
+
+int ckl_store_append(ckl_conf_t *conf, ckl_msg_t *msg)
+{
+  store_lock_t l;
+  struct stat st;
+  char *buf = NULL;
+  size_t len = 0;
+  FILE *fp;
+  int rv;
+  int i;
+
+  fp = open_memstream(&buf, &len);
+  if (fp == NULL) {
+    perror("open_memstream() for the store failed");
+    return -1;
+  }
+
+  fprintf(fp, "ts %ld\nhost %s\nuser %s\n", (long)msg->ts, msg->hostname,
+          msg->username);
+  for (i = 0; i < msg->tag_count; i++) {
+    fprintf(fp, "tag %s\n", msg->tags[i]);
+  }
+  if (msg->script_log && stat(msg->script_log, &st) == 0) {
+    fprintf(fp, "log %lld\n", (long long)st.st_size);
+  }
+  if (msg->script_index) {
+    store_commands(fp, msg->script_index);
+  }
+  /* a message from stdin went to the endpoint as it was read */
+  fprintf(fp, "\n%s", msg->msg_stdin ? STORE_STDIN : msg->msg);
+  if (fclose(fp) != 0) {
+    free(buf);
+    return -1;
+  }
+
+  rv = store_lock(conf->store_dir, &l);
+  if (rv == 0) {
+    rv = store_put(&l, msg->ts, 0, buf, len);
+    store_unlock(&l);
+  }
+
+  free(buf);
+  return rv;
+}
+
+static void *store_map(int fd, size_t *size)
+{
+  struct stat st;
+  void *p;
+
+  if (fstat(fd, &st) < 0 || st.st_size == 0) {
+    *size = 0;
+    return NULL;
+  }
+
+  p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED) {
+    perror("mmap() of the store failed");
+    *size = 0;
+    return NULL;
+  }
+
+  *size = st.st_size;
+  return p;
+}
+
+/* an empty store when there is none yet */
+int ckl_store_open(ckl_store_t *s, const char *dir)
+{
+  size_t isize;
+  size_t i;
+  int efd;
+  int ifd;
+
+  memset(s, 0, sizeof(*s));
+
+  efd = store_open_file(dir, "entries", O_RDONLY);
+  ifd = store_open_file(dir, "index", O_RDONLY);
+  if (efd >= 0 && ifd >= 0) {
+    /* records first: an entry appended after is then not missed */
+    s->index = store_map(ifd, &isize);
+    s->entries = store_map(efd, &s->entries_size);
+    s->count = isize / sizeof(struct ckl_store_rec_t);
+    s->index_size = isize;
+  }
+
+  if (efd >= 0) {
+    close(efd);
+  }
+  if (ifd >= 0) {
+    close(ifd);
+  }
+
+  if (s->entries_size < strlen(STORE_MAGIC) ||
+      memcmp(s->entries, STORE_MAGIC, strlen(STORE_MAGIC)) != 0) {
+    if (s->entries_size > 0) {
+      fprintf(stderr, "%s/entries is not a ckl store\n", dir);
+    }
+    s->count = 0;
+  }
+
+  /* by time, oldest first; appends are in order but for what --sync
+   * adds, so this is an insertion sort of a few entries at most */
+  s->nrec = s->count;
+  s->order = malloc((s->nrec + 1) * sizeof(size_t));
+  s->count = 0;
+  for (i = 0; i < s->nrec; i++) {
+    size_t j = s->count++;
+
+    if (s->index[i].flags & STORE_REPLACED) {
+      s->count--;
+      continue;
+    }
+    while (j > 0 && s->index[s->order[j - 1]].ts > s->index[i].ts) {
+      s->order[j] = s->order[j - 1];
+      j--;
+    }
+    s->order[j] = i;
+  }
+
+  return 0;
+}
+
+void ckl_store_close(ckl_store_t *s)
+{
+  if (s->entries) {
+    munmap((void *)s->entries, s->entries_size);
+  }
+  if (s->index) {
+    munmap((void *)s->index, s->index_size);
+  }
+  free(s->order);
+  memset(s, 0, sizeof(*s));
+}
+
+/* entry n, newest first from 1, as [p, end); -1 if there is none */
+static int store_entry(ckl_store_t *s, size_t n, const char **p,
+                       const char **end)
+{
+  const struct ckl_store_rec_t *rec;
+
+  if (n < 1 || n > s->count) {
+    return -1;
+  }
+
+  rec = &s->index[s->order[s->count - n]];
+  if (rec->off + rec->len > s->entries_size) {
+    return -1;
+  }
+
+  *p = s->entries + rec->off;
+  *end = *p + rec->len;
+  return 0;
+}
+
+/* the next header line of an entry, without its newline; NULL at the
+ * blank line before the message, which *p is then left at */
+static const char *store_line(const char **p, const char *end, size_t *len)
+{
+  const char *line = *p;
+  const char *nl = memchr(line, '\n', end - line);
+
+  if (nl == NULL || nl == line) {
+    *p = nl ? nl + 1 : end;
+    return NULL;
+  }
+
+  *len = nl - line;
+  *p = nl + 1;
+  return line;
+}
+
+static int store_has_tag(const char *p, const char *end, const char *tag)
+{
+  size_t tlen = strlen(tag);
+  const char *line;
+  size_t len;
+
+  while ((line = store_line(&p, end, &len)) != NULL) {
+    if (len == tlen + 4 && memcmp(line, "tag ", 4) == 0 &&
+        memcmp(line + 4, tag, tlen) == 0) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/* prints "[n] +Ns command (exit x, N.Ns)" from an index line */
+static void store_command(FILE *out, int seq, const char *line, size_t len)
+{
+  const char *end = line + len;
+  long long f[4];
+  const char *p = line;
+  int i;
+
+  for (i = 0; i < 4; i++) {
+    f[i] = strtoll(p, NULL, 10);
+    p = memchr(p, '\t', end - p);
+    if (p == NULL) {
+      return;
+    }
+    p++;
+  }
+
+  fprintf(out, "  [%d] +%llds ", seq, f[1] / 1000);
+  for (; p < end; p++) {
+    if (*p == '\\' && p + 1 < end) {
+      p++;
+      fputc(*p == 't' ? '\t' : *p == 'n' ? '\n' : *p, out);
+    }
+    else {
+      fputc(*p, out);
+    }
+  }
+  if (f[3] < 0) {
+    fprintf(out, " (running, %.1fs)\n", f[2] / 1000.0);
+  }
+  else {
+    fprintf(out, " (exit %lld, %.1fs)\n", f[3], f[2] / 1000.0);
+  }
+}
+
+/* the entry as the endpoint shows it; with detail, its commands too */
+static void store_print(FILE *out, size_t n, const char *p, const char *end,
+                        int detail)
+{
+  const char *line;
+  const char *host = "";
+  const char *user = "";
+  size_t hlen = 0;
+  size_t ulen = 0;
+  size_t len;
+  const char *q = p;
+  long long log = -1;
+  int tags = 0;
+  int seq = 0;
+  char when[64];
+  time_t ts = 0;
+
+  while ((line = store_line(&q, end, &len)) != NULL) {
+    if (len > 3 && memcmp(line, "ts ", 3) == 0) {
+      ts = strtol(line + 3, NULL, 10);
+    }
+    else if (len >= 5 && memcmp(line, "host ", 5) == 0) {
+      host = line + 5;
+      hlen = len - 5;
+    }
+    else if (len >= 5 && memcmp(line, "user ", 5) == 0) {
+      user = line + 5;
+      ulen = len - 5;
+    }
+    else if (len > 4 && memcmp(line, "log ", 4) == 0) {
+      log = strtoll(line + 4, NULL, 10);
+    }
+  }
+
+  strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S UTC", gmtime(&ts));
+  fprintf(out, "(%zu) %s by %.*s on %.*s\n    %.*s\n", n, when, (int)ulen,
+          user, (int)hlen, host, (int)(end - q), q);
+
+  q = p;
+  while ((line = store_line(&q, end, &len)) != NULL) {
+    if (len > 4 && memcmp(line, "tag ", 4) == 0) {
+      fprintf(out, "%s%.*s", tags++ ? " " : "    [", (int)len - 4, line + 4);
+    }
+  }
+  if (tags) {
+    fputs("]\n", out);
+  }
+
+  if (!detail) {
+    return;
+  }
+
+  q = p;
+  while ((line = store_line(&q, end, &len)) != NULL) {
+    if (len > 4 && memcmp(line, "cmd ", 4) == 0) {
+      store_command(out, ++seq, line + 4, len - 4);
+    }
+  }
+  if (log >= 0) {
+    fprintf(out, "[script log: %lld bytes, on the endpoint (--remote)]\n", log);
+  }
+}
+
+/* the newest count entries with all the tags; prints them when out is
+ * set, and returns how many there were either way */
+int ckl_store_list(ckl_store_t *s, int count, const char **tags, int tag_count,
+                   FILE *out)
+{
+  const char *p;
+  const char *end;
+  size_t n;
+  int found = 0;
+  int i;
+
+  for (n = 1; n <= s->count && found < count; n++) {
+    if (store_entry(s, n, &p, &end) < 0) {
+      continue;
+    }
+
+    for (i = 0; i < tag_count && store_has_tag(p, end, tags[i]); i++);
+    if (i < tag_count) {
+      continue;
+    }
+
+    found++;
+    if (out) {
+      store_print(out, n, p, end, 0);
+    }
+  }
+
+  return found;
+}
+
+/* entry n with its commands; -1 if the store does not have it */
+int ckl_store_detail(ckl_store_t *s, int n, FILE *out)
+{
+  const char *p;
+  const char *end;
+
+  if (n < 1 || store_entry(s, n, &p, &end) < 0) {
+    return -1;
+  }
+
+  store_print(out, n, p, end, 1);
+  return 0;
+}
+
+/* the endpoint's event id of entry n, 0 for one not synced yet; -1 if
+ * the store does not have it */
+int ckl_store_event(ckl_store_t *s, int n, unsigned long long *event)
+{
+  const struct ckl_store_rec_t *rec;
+  const char *p;
+  const char *end;
+
+  if (n < 1 || store_entry(s, n, &p, &end) < 0) {
+    return -1;
+  }
+
+  *event = 0;
+  rec = &s->index[s->order[s->count - n]];
+  if ((rec->flags & STORE_SYNCED) && end - p > 3 && memcmp(p, "id ", 3) == 0) {
+    *event = strtoull(p + 3, NULL, 10);
+  }
+  return 0;
+}
+
+/* the highest event id of the host that --sync has seen, 0 before any */
+unsigned long long ckl_store_since(const char *dir, const char *hostname)
+{
+  char *path = store_name(dir, "sync");
+  FILE *fp = fopen(path, "r");
+  unsigned long long since = 0;
+  unsigned long long id;
+  char host[HOST_NAME_MAX + 1];
+
+  free(path);
+  if (fp == NULL) {
+    return 0;
+  }
+
+  while (fscanf(fp, "%64s %llu", host, &id) == 2) {
+    if (strcmp(host, hostname) == 0) {
+      since = id;
+    }
+  }
+
+  fclose(fp);
+  return since;
+}
+
+/* rewrites <dir>/sync with the host's new mark, the others kept */
+static int store_save_since(const char *dir, const char *hostname,
+                            unsigned long long since)
+{
+  char *path = store_name(dir, "sync");
+  char *tmp = store_name(dir, "sync.tmp");
+  FILE *in = fopen(path, "r");
+  FILE *out = fopen(tmp, "w");
+  unsigned long long id;
+  char host[HOST_NAME_MAX + 1];
+  int rv = -1;
+
+  if (out != NULL) {
+    while (in != NULL && fscanf(in, "%64s %llu", host, &id) == 2) {
+      if (strcmp(host, hostname) != 0) {
+        fprintf(out, "%s %llu\n", host, id);
+      }
+    }
+    fprintf(out, "%s %llu\n", hostname, since);
+    if (fclose(out) == 0 && rename(tmp, path) == 0) {
+      rv = 0;
+    }
+  }
+
+  if (rv < 0) {
+    fprintf(stderr, "Unable to save %s: %s\n", path, strerror(errno));
+    unlink(tmp);
+  }
+  if (in != NULL) {
+    fclose(in);
+  }
+  free(path);
+  free(tmp);
+  return rv;
+}
+
+/* the user and message of an entry; its time is in its record */
+static void store_who(const char *p, const char *end, const char **user,
+                      size_t *ulen, const char **msg)
+{
+  const char *line;
+  size_t len;
+
+  *user = "";
+  *ulen = 0;
+  while ((line = store_line(&p, end, &len)) != NULL) {
+    if (len >= 5 && memcmp(line, "user ", 5) == 0) {
+      *user = line + 5;
+      *ulen = len - 5;
+    }
+  }
+  *msg = p;
+}
+
+/* the record of the event, synced before, or of the entry this host sent
+ * that it is; -1 for neither */
+static ssize_t store_match(ckl_store_t *s, unsigned long long id, time_t ts,
+                           const char *p, const char *end)
+{
+  const char *user;
+  const char *msg;
+  char synced[32];
+  size_t ulen;
+  size_t slen;
+  size_t i;
+
+  store_who(p, end, &user, &ulen, &msg);
+  slen = snprintf(synced, sizeof(synced), "id %llu\n", id);
+
+  for (i = 0; i < s->nrec; i++) {
+    const struct ckl_store_rec_t *rec = &s->index[i];
+    const char *luser;
+    const char *lmsg;
+    const char *lend;
+    size_t lulen;
+
+    if ((rec->flags & STORE_REPLACED) || rec->ts != ts ||
+        rec->off + rec->len > s->entries_size) {
+      continue;
+    }
+
+    /* a mark lost with <dir>/sync gets the same events again */
+    if (rec->flags & STORE_SYNCED) {
+      if (rec->len >= slen &&
+          memcmp(s->entries + rec->off, synced, slen) == 0) {
+        return i;
+      }
+      continue;
+    }
+
+    lend = s->entries + rec->off + rec->len;
+    store_who(s->entries + rec->off, lend, &luser, &lulen, &lmsg);
+    if (lulen != ulen || memcmp(luser, user, ulen) != 0) {
+      continue;
+    }
+
+    if ((lend - lmsg == end - msg && memcmp(lmsg, msg, end - msg) == 0) ||
+        (lend - lmsg == strlen(STORE_STDIN) &&
+         memcmp(lmsg, STORE_STDIN, strlen(STORE_STDIN)) == 0)) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+/**
+ * Adds what the endpoint's /sync returned: after a "ckl-sync 1" line,
+ * each event as "<id> <length>\n" and an entry of that length.  Returns
+ * how many were added, and moves *since to the last.  A response cut
+ * short is taken up to its last whole event.
+ */
+int ckl_store_merge(const char *dir, const char *hostname, const char *buf,
+                    size_t len, unsigned long long *since)
+{
+  const char *p = buf;
+  const char *end = buf + len;
+  ckl_store_t s;
+  store_lock_t l;
+  int added = 0;
+  int rv;
+
+  if (len < strlen(SYNC_MAGIC) ||
+      memcmp(buf, SYNC_MAGIC, strlen(SYNC_MAGIC)) != 0) {
+    fprintf(stderr, "The endpoint does not support --sync\n");
+    return -1;
+  }
+  p += strlen(SYNC_MAGIC);
+
+  if (store_lock(dir, &l) < 0) {
+    return -1;
+  }
+  /* mapped under the lock, so it is all that is there */
+  ckl_store_open(&s, dir);
+
+  while (p < end) {
+    const char *nl = memchr(p, '\n', end - p);
+    unsigned long long id;
+    unsigned long long rlen;
+    const char *line;
+    const char *q;
+    char *entry;
+    size_t elen;
+    time_t ts = 0;
+    ssize_t m;
+
+    if (nl == NULL || sscanf(p, "%llu %llu", &id, &rlen) != 2 ||
+        rlen > (unsigned long long)(end - nl - 1)) {
+      break;
+    }
+    p = nl + 1;
+
+    q = p;
+    while ((line = store_line(&q, p + rlen, &elen)) != NULL) {
+      if (elen > 3 && memcmp(line, "ts ", 3) == 0) {
+        ts = strtol(line + 3, NULL, 10);
+      }
+    }
+
+    m = store_match(&s, id, ts, p, p + rlen);
+    if (m >= 0 && (s.index[m].flags & STORE_SYNCED)) {
+      p += rlen;
+      if (id > *since) {
+        *since = id;
+      }
+      continue;
+    }
+    if (m >= 0) {
+      uint32_t flags = STORE_REPLACED;
+      if (pwrite(l.ifd, &flags, sizeof(flags), m * sizeof(struct ckl_store_rec_t) +
+                 offsetof(struct ckl_store_rec_t, flags)) != sizeof(flags)) {
+        perror("updating the store index failed");
+      }
+    }
+
+    if (asprintf(&entry, "id %llu\n%.*s", id, (int)rlen, p) < 0) {
+      break;
+    }
+    rv = store_put(&l, ts, STORE_SYNCED, entry, strlen(entry));
+    free(entry);
+    if (rv < 0) {
+      break;
+    }
+
+    added++;
+    if (id > *since) {
+      *since = id;
+    }
+    p += rlen;
+  }
+
+  store_save_since(dir, hostname, *since);
+  ckl_store_close(&s);
+  store_unlock(&l);
+
+  return added;
+}
+
+static int store_sync_emit(void *baton, const char *buf, size_t len)
+{
+  return fwrite(buf, 1, len, baton) == len ? 0 : -1;
+}
+
+/* the host's events the store has not seen, in one request; returns how
+ * many were added, and the event the store is now synced up to */
+int ckl_store_sync(ckl_conf_t *conf, unsigned long long *since)
+{
+  int rv;
+  char hostname[HOST_NAME_MAX + 1];
+  char *buf = NULL;
+  size_t len = 0;
+  FILE *fp;
+  ckl_transport_t *transport;
+
+  if (ckl_hostname(hostname, sizeof(hostname)) < 0) {
+    fprintf(stderr, "hostname lookup failed\n");
+    return -1;
+  }
+  *since = ckl_store_since(conf->store_dir, hostname);
+
+  transport = calloc(1, sizeof(ckl_transport_t));
+  rv = ckl_transport_init(transport, conf);
+  if (rv == 0) {
+    fp = open_memstream(&buf, &len);
+    rv = ckl_transport_sync(transport, conf, hostname, *since,
+                            store_sync_emit, fp);
+    fclose(fp);
+  }
+  ckl_transport_free(transport);
+  if (rv < 0) {
+    free(buf);
+    return rv;
+  }
+
+  rv = ckl_store_merge(conf->store_dir, hostname, buf, len, since);
+  free(buf);
+
+  return rv;
+}
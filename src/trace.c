@@ -0,0 +1,125 @@
+/*
+ * Licensed to Cloudkick, Inc under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * Cloudkick licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ckl.h"
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+
+/**
+ * Spans of ckl's phases, as JSON lines, for following latency across a
+ * fleet without a tracer on each host.  Set CKL_TRACE_FILE in the
+ * environment, or ckl_trace_file in the configuration, and every span
+ * ends with a line like
+ *
+ *   {"ts":1790000000.123456,"pid":42,"span":"request","dur_us":8123,"status":200,"bytes":512}
+ *
+ * appended to the file with a single write(2), so runs in parallel do not
+ * interleave.  The same spans are USDT probes (see CKL_TRACE_START in
+ * ckl.h), which cost a nop each when nothing is attached.
+ *
+ * Start times are per thread, for libckl contexts in several threads.
+ */
+
+typedef struct trace_span_t {
+  const char *name;
+  const char *a;
+  const char *b;
+} trace_span_t;
+
+/* the names of the two values each span ends with, NULL when unused */
+static const trace_span_t trace_spans[CKL_SPAN_MAX] = {
+  {"config", "rv", NULL},
+  {"msg", "msg_bytes", "tags"},
+  {"editor", "rv", NULL},
+  {"script", "rv", "bytes"},
+  {"oauth", "params", NULL},
+  {"request", "status", "bytes"},
+  {"spool_enqueue", "rv", NULL},
+  {"spool_dequeue", "rv", NULL}
+};
+
+static int trace_fd = -1;
+static __thread struct timespec trace_started[CKL_SPAN_MAX];
+
+int ckl_trace_open(const char *path)
+{
+  int fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+
+  if (fd < 0) {
+    fprintf(stderr, "Unable to open trace file %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  /* the first file wins, for contexts loading at the same time */
+  if (!__sync_bool_compare_and_swap(&trace_fd, -1, fd)) {
+    close(fd);
+  }
+
+  return 0;
+}
+
+void ckl_trace_init(void)
+{
+  const char *path = getenv("CKL_TRACE_FILE");
+
+  if (path != NULL && path[0] != '\0') {
+    ckl_trace_open(path);
+  }
+}
+
+/* the clock is read either way: the file may be opened mid-span */
+void ckl_trace_begin(ckl_span_e span)
+{
+  clock_gettime(CLOCK_MONOTONIC, &trace_started[span]);
+}
+
+void ckl_trace_end(ckl_span_e span, long long a, long long b)
+{
+  const trace_span_t *s = &trace_spans[span];
+  struct timespec now, wall;
+  char buf[256];
+  long long dur;
+  int len;
+
+  if (trace_fd < 0) {
+    return;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  clock_gettime(CLOCK_REALTIME, &wall);
+  dur = (now.tv_sec - trace_started[span].tv_sec) * 1000000LL +
+        (now.tv_nsec - trace_started[span].tv_nsec) / 1000;
+
+  /* ts is when the span started */
+  len = snprintf(buf, sizeof(buf),
+                 "{\"ts\":%.6f,\"pid\":%d,\"span\":\"%s\",\"dur_us\":%lld",
+                 wall.tv_sec + wall.tv_nsec / 1e9 - dur / 1e6, (int)getpid(),
+                 s->name, dur);
+  if (s->a) {
+    len += snprintf(buf + len, sizeof(buf) - len, ",\"%s\":%lld", s->a, a);
+  }
+  if (s->b) {
+    len += snprintf(buf + len, sizeof(buf) - len, ",\"%s\":%lld", s->b, b);
+  }
+  len += snprintf(buf + len, sizeof(buf) - len, "}\n");
+
+  if (write(trace_fd, buf, len) != len) {
+    /* a trace is not worth failing or nagging over */
+  }
+}
@@ -19,6 +19,8 @@
 #include "ckl.h"
 #include "ckl_version.h"
 #include "extern/liboauth/src/oauth.h"
+#include <strings.h>
+#include <pthread.h>
 
 static void base_post_data(ckl_transport_t *t,
                            ckl_conf_t *conf,
@@ -39,12 +41,46 @@ static void base_post_data(ckl_transport_t *t,
   }
 }
 
+/* key=value tags travel as one field, a tag per line */
+static void tags_post_data(ckl_transport_t *t,
+                           const char **tags,
+                           int tag_count)
+{
+  size_t len = 0;
+  char *buf;
+  char *p;
+  int i;
+
+  if (tag_count == 0) {
+    return;
+  }
+
+  for (i = 0; i < tag_count; i++) {
+    len += strlen(tags[i]) + 1;
+  }
+
+  p = buf = ckl_arena_alloc(&t->arena, len);
+  for (i = 0; i < tag_count; i++) {
+    size_t n = strlen(tags[i]);
+    memcpy(p, tags[i], n);
+    p[n] = i + 1 < tag_count ? '\n' : '\0';
+    p += n + 1;
+  }
+
+  curl_formadd(&t->formpost,
+               &t->lastptr,
+               CURLFORM_COPYNAME, "tags",
+               CURLFORM_COPYCONTENTS, buf,
+               CURLFORM_END);
+}
+
 static int msg_to_post_data(ckl_transport_t *t,
                             ckl_conf_t *conf,
                             ckl_msg_t* m)
 {
   char buf[128];
 
+  CKL_TRACE_START(CKL_SPAN_MSG, msg);
   snprintf(buf, sizeof(buf), "%d", (int)m->ts);
 
   base_post_data(t, conf, m->hostname);
@@ -55,81 +91,308 @@ static int msg_to_post_data(ckl_transport_t *t,
                CURLFORM_COPYCONTENTS, m->username,
                CURLFORM_END);
 
-  curl_formadd(&t->formpost,
-               &t->lastptr,
-               CURLFORM_COPYNAME, "msg",
-               CURLFORM_COPYCONTENTS, m->msg,
-               CURLFORM_END);
-  
+  /* a message from stdin is added as a stream in ckl_transport_run */
+  if (!m->msg_stdin) {
+    curl_formadd(&t->formpost,
+                 &t->lastptr,
+                 CURLFORM_COPYNAME, "msg",
+                 CURLFORM_COPYCONTENTS, m->msg,
+                 CURLFORM_END);
+  }
+
   curl_formadd(&t->formpost,
                &t->lastptr,
                CURLFORM_COPYNAME, "ts",
                CURLFORM_COPYCONTENTS, buf,
                CURLFORM_END);
 
+  tags_post_data(t, m->tags, m->tag_count);
+  CKL_TRACE_DONE(CKL_SPAN_MSG, msg, m->msg_stdin || !m->msg ? 0 : strlen(m->msg),
+                 m->tag_count);
+
   return 0;
 }
 
 static int list_to_post_data(ckl_transport_t *t,
                             ckl_conf_t *conf,
-                            int count)
+                            int count,
+                            const char **tags,
+                            int tag_count)
 {
   char buf[128];
-  const char *hostname = ckl_hostname();
+  char hostname[HOST_NAME_MAX + 1];
+
+  if (ckl_hostname(hostname, sizeof(hostname)) < 0) {
+    return CKL_ERR_SYSTEM;
+  }
   snprintf(buf, sizeof(buf), "%d", count);
 
   base_post_data(t, conf, hostname);
 
-  free((char*)hostname);
   curl_formadd(&t->formpost,
                &t->lastptr,
                CURLFORM_COPYNAME, "count",
                CURLFORM_COPYCONTENTS, buf,
                CURLFORM_END);
 
+  /* only entries carrying all of these */
+  tags_post_data(t, tags, tag_count);
+
+  return 0;
+}
+
+static int sync_to_post_data(ckl_transport_t *t,
+                             ckl_conf_t *conf,
+                             const char *hostname,
+                             unsigned long long since)
+{
+  char buf[32];
+
+  snprintf(buf, sizeof(buf), "%llu", since);
+
+  base_post_data(t, conf, hostname);
+
+  curl_formadd(&t->formpost,
+               &t->lastptr,
+               CURLFORM_COPYNAME, "since",
+               CURLFORM_COPYCONTENTS, buf,
+               CURLFORM_END);
+
   return 0;
 }
 
 static int detail_to_post_data(ckl_transport_t *t,
                                ckl_conf_t *conf,
-                               const char *slug)
+                               const char *slug,
+                               unsigned long long event,
+                               int head,
+                               int tail)
+{
+  char buf[64];
+  char hostname[HOST_NAME_MAX + 1];
+
+  if (ckl_hostname(hostname, sizeof(hostname)) < 0) {
+    return CKL_ERR_SYSTEM;
+  }
+
+  base_post_data(t, conf, hostname);
+
+  curl_formadd(&t->formpost,
+               &t->lastptr,
+               CURLFORM_COPYNAME, "id",
+               CURLFORM_COPYCONTENTS, slug,
+               CURLFORM_END);
+
+  /* the event itself, whatever its number is on the endpoint now */
+  if (event > 0) {
+    snprintf(buf, sizeof(buf), "%llu", event);
+    curl_formadd(&t->formpost,
+                 &t->lastptr,
+                 CURLFORM_COPYNAME, "event",
+                 CURLFORM_COPYCONTENTS, buf,
+                 CURLFORM_END);
+  }
+
+  /* the server reads only that window of the script log */
+  if (head > 0) {
+    snprintf(buf, sizeof(buf), "%d", head);
+    curl_formadd(&t->formpost,
+                 &t->lastptr,
+                 CURLFORM_COPYNAME, "head",
+                 CURLFORM_COPYCONTENTS, buf,
+                 CURLFORM_END);
+  }
+
+  if (tail > 0) {
+    snprintf(buf, sizeof(buf), "%d", tail);
+    curl_formadd(&t->formpost,
+                 &t->lastptr,
+                 CURLFORM_COPYNAME, "tail",
+                 CURLFORM_COPYCONTENTS, buf,
+                 CURLFORM_END);
+  }
+
+  return 0;
+}
+
+static int replay_to_post_data(ckl_transport_t *t,
+                               ckl_conf_t *conf,
+                               const char *slug,
+                               unsigned long long event,
+                               const char *at)
 {
-  const char *hostname = ckl_hostname();
+  char buf[64];
+  char hostname[HOST_NAME_MAX + 1];
+
+  if (ckl_hostname(hostname, sizeof(hostname)) < 0) {
+    return CKL_ERR_SYSTEM;
+  }
 
   base_post_data(t, conf, hostname);
 
-  free((char*)hostname);
   curl_formadd(&t->formpost,
                &t->lastptr,
                CURLFORM_COPYNAME, "id",
                CURLFORM_COPYCONTENTS, slug,
                CURLFORM_END);
 
+  /* as for /detail, the session -l listed and not whatever is N now */
+  if (event > 0) {
+    snprintf(buf, sizeof(buf), "%llu", event);
+    curl_formadd(&t->formpost,
+                 &t->lastptr,
+                 CURLFORM_COPYNAME, "event",
+                 CURLFORM_COPYCONTENTS, buf,
+                 CURLFORM_END);
+  }
+
+  if (at) {
+    curl_formadd(&t->formpost,
+                 &t->lastptr,
+                 CURLFORM_COPYNAME, "at",
+                 CURLFORM_COPYCONTENTS, at,
+                 CURLFORM_END);
+  }
+
   return 0;
 }
 
-static char *strappend(const char *a, const char *b)
+/* curl calls one read function for every CURLFORM_STREAM part */
+static size_t stream_read(char *buf, size_t size, size_t nmemb, void *baton)
+{
+  ckl_stream_t *s = baton;
+  return s->read(buf, size, nmemb, s->baton);
+}
+
+static void pgzip_close(void *baton)
+{
+  ckl_pgzip_close(baton);
+}
+
+static void msgstream_close(void *baton)
+{
+  ckl_msgstream_close(baton);
+}
+
+static ckl_stream_t *add_stream(ckl_transport_t *t,
+                                size_t (*read)(char *, size_t, size_t, void *),
+                                void (*close)(void *),
+                                void *baton)
+{
+  ckl_stream_t *s = &t->streams[t->nstreams++];
+
+  s->read = read;
+  s->close = close;
+  s->baton = baton;
+  curl_easy_setopt(t->curl, CURLOPT_READFUNCTION, stream_read);
+  return s;
+}
+
+static void msg_stream_post_data(ckl_transport_t *t, ckl_conf_t *conf)
+{
+  ckl_msgstream_t *ms = ckl_msgstream_open(STDIN_FILENO, conf->msg_max_bytes);
+  ckl_stream_t *s = add_stream(t, ckl_msgstream_read, msgstream_close, ms);
+
+  /* no length up front, so curl sends the request chunked */
+  curl_formadd(&t->formpost,
+               &t->lastptr,
+               CURLFORM_COPYNAME, "msg",
+               CURLFORM_STREAM, s,
+               CURLFORM_FILENAME, "msg.txt",
+               CURLFORM_CONTENTTYPE, "text/plain", CURLFORM_END);
+}
+
+static void script_post_data(ckl_transport_t *t,
+                             ckl_conf_t *conf,
+                             const char *name,
+                             const char *path,
+                             const char *filename,
+                             const char *encoding,
+                             int compress)
+{
+  ckl_pgzip_t *z = NULL;
+  ckl_stream_t *s = NULL;
+  char fbuf[128];
+
+  /* a log that was not compressed while recording is compressed on all
+   * cores now, streamed to curl as it comes out */
+  if (compress && encoding == NULL && conf->upload_compress > 0) {
+    z = ckl_pgzip_open(path, conf->upload_compress, conf->upload_threads);
+    if (z != NULL) {
+      s = add_stream(t, ckl_pgzip_read, pgzip_close, z);
+      encoding = "gzip";
+    }
+  }
+
+  if (encoding != NULL) {
+    char buf[128];
+    /* already compressed while recording, send it as-is */
+    if (t->script_headers == NULL) {
+      snprintf(buf, sizeof(buf), "Content-Encoding: %s", encoding);
+      t->script_headers = curl_slist_append(t->script_headers, buf);
+    }
+    snprintf(fbuf, sizeof(fbuf), "%s.gz", filename);
+  }
+
+  if (s != NULL) {
+    /* no length up front, so curl sends the request chunked */
+    curl_formadd(&t->formpost,
+                 &t->lastptr,
+                 CURLFORM_COPYNAME, name,
+                 CURLFORM_STREAM, s,
+                 CURLFORM_FILENAME, fbuf,
+                 CURLFORM_CONTENTTYPE, "text/plain",
+                 CURLFORM_CONTENTHEADER, t->script_headers, CURLFORM_END);
+  }
+  else if (encoding != NULL) {
+    curl_formadd(&t->formpost,
+                 &t->lastptr,
+                 CURLFORM_COPYNAME, name,
+                 CURLFORM_FILE, path,
+                 CURLFORM_FILENAME, fbuf,
+                 CURLFORM_CONTENTTYPE, "text/plain",
+                 CURLFORM_CONTENTHEADER, t->script_headers, CURLFORM_END);
+  }
+  else {
+    curl_formadd(&t->formpost,
+                 &t->lastptr,
+                 CURLFORM_COPYNAME, name,
+                 CURLFORM_FILE, path,
+                 CURLFORM_FILENAME, filename,
+                 CURLFORM_CONTENTTYPE, "text/plain", CURLFORM_END);
+  }
+}
+
+/* what one request added to the transport, so the next starts clean on
+ * the same connection */
+static void transport_reset(ckl_transport_t *t)
 {
-  size_t la = strlen(a);
-  size_t lb = strlen(b);
-  char *c = malloc(la + lb + 1);
-  memcpy(c, a, la);
-  memcpy(c+la, b, lb);
-  c[la+lb] = '\0';
-  return c;
+  int i;
+
+  for (i = 0; i < t->nstreams; i++) {
+    t->streams[i].close(t->streams[i].baton);
+  }
+  t->nstreams = 0;
+  curl_formfree(t->formpost);
+  t->formpost = NULL;
+  t->lastptr = NULL;
+  curl_slist_free_all(t->script_headers);
+  t->script_headers = NULL;
+  t->append_url = "/";
+  ckl_arena_reset(&t->arena);
 }
 
 static int ckl_transport_run(ckl_transport_t *t, ckl_conf_t *conf, ckl_msg_t* m)
 {
   long httprc = -1;
+  curl_off_t uploaded = 0;
+  double elapsed = 0;
   CURLcode res;
-  char *url = strdup(conf->endpoint);
-  char *postarg = NULL;
+  char *url = ckl_arena_printf(&t->arena, "%s%s", conf->endpoint,
+                               t->append_url ? t->append_url : "");
+  int rv = CKL_OK;
 
-  if (t->append_url) {
-    free(url);
-    url = strappend(conf->endpoint, t->append_url);
-  }
+  t->error[0] = '\0';
 
   if (conf->oauth_key && conf->oauth_secret) {
     int i;
@@ -137,17 +400,20 @@ static int ckl_transport_run(ckl_transport_t *t, ckl_conf_t *conf, ckl_msg_t* m)
     char **argv = NULL;
     char *url2;
     struct curl_httppost *tmp;
+
+    CKL_TRACE_START(CKL_SPAN_OAUTH, oauth);
     argc = oauth_split_post_paramters(url, &argv, 0);
 
     for (tmp = t->formpost; tmp != NULL; tmp = tmp->next) {
-      char *p = NULL;
-      if (asprintf(&p, "%s=%s", tmp->name, tmp->contents) < 0) {
+      char *p = ckl_arena_printf(&t->arena, "%s=%s", tmp->name, tmp->contents);
+      if (p == NULL) {
         fprintf(stderr, "Broken asprintf: %s = %s\n",
                  tmp->name, tmp->contents);
-        return -1;
+        oauth_free_array(&argc, &argv);
+        rv = CKL_ERR_NOMEM;
+        goto out;
       }
       oauth_add_param_to_array(&argc, &argv, p);
-      free(p);
     }
 
     url2 = oauth_sign_array2(&argc, &argv, NULL, 
@@ -161,65 +427,95 @@ static int ckl_transport_run(ckl_transport_t *t, ckl_conf_t *conf, ckl_msg_t* m)
     t->formpost = NULL;
     t->lastptr = NULL;
     for (i = 1; i < argc; i++) {
-      char *s = strdup(argv[i]);
-      char *p = strchr(s, '=');
+      char *p = strchr(argv[i], '=');
       if (p == NULL) {
-        fprintf(stderr, "Broken argv: %s = %s\n",
-                tmp->name, tmp->contents);
-        return -1;
+        fprintf(stderr, "Broken argv: %s\n", argv[i]);
+        oauth_free_array(&argc, &argv);
+        rv = CKL_ERR_INVALID;
+        goto out;
       }
 
       *p = '\0';
 
       p++;
       
-      //fprintf(stderr, "argv[%d]: %s = %s\n", i, s, p);
+      //fprintf(stderr, "argv[%d]: %s = %s\n", i, argv[i], p);
 
       curl_formadd(&t->formpost,
                    &t->lastptr,
-                   CURLFORM_COPYNAME, s,
+                   CURLFORM_COPYNAME, argv[i],
                    CURLFORM_COPYCONTENTS, p,
                    CURLFORM_END);
     }
 
+    CKL_TRACE_DONE(CKL_SPAN_OAUTH, oauth, argc, 0);
     oauth_free_array(&argc, &argv);
   }
 
+  /* streamed parts come after the signed fields above */
+  if (m && m->msg_stdin) {
+    msg_stream_post_data(t, conf);
+  }
+
   if (m && m->script_log != NULL) {
-    curl_formadd(&t->formpost,
-                 &t->lastptr,
-                 CURLFORM_COPYNAME, "scriptlog",
-                 CURLFORM_FILE, m->script_log,
-                 CURLFORM_FILENAME, "script.log",
-                 CURLFORM_CONTENTTYPE, "text/plain", CURLFORM_END);
+    script_post_data(t, conf, "scriptlog", m->script_log, "script.log",
+                     m->script_encoding, 1);
   }
-  
-  
+
+  if (m && m->script_raw_log != NULL) {
+    script_post_data(t, conf, "scriptlog_raw", m->script_raw_log, "script.raw",
+                     m->script_encoding, 1);
+  }
+
+  if (m && m->script_index != NULL) {
+    script_post_data(t, conf, "scriptindex", m->script_index, "script.idx", NULL, 0);
+  }
+
   curl_easy_setopt(t->curl, CURLOPT_HTTPPOST, t->formpost);
 
   curl_easy_setopt(t->curl, CURLOPT_URL, url);
 
+  CKL_TRACE_START(CKL_SPAN_REQUEST, request);
+  ckl_prof_begin(CKL_PROF_NETWORK);
   res = curl_easy_perform(t->curl);
+  ckl_prof_end(CKL_PROF_NETWORK);
+
+  curl_easy_getinfo(t->curl, CURLINFO_RESPONSE_CODE, &httprc);
+  curl_easy_getinfo(t->curl, CURLINFO_SIZE_UPLOAD_T, &uploaded);
+  curl_easy_getinfo(t->curl, CURLINFO_TOTAL_TIME, &elapsed);
+  /* status 0 when no response came */
+  CKL_TRACE_DONE(CKL_SPAN_REQUEST, request, res != 0 ? 0 : httprc, uploaded);
+  if (m) {
+    ckl_metrics_request(&conf->metrics, uploaded, elapsed * 1e6);
+  }
 
   if (res != 0) {
     fprintf(stderr, "Failed talking to endpoint %s: (%d) %s\n\n",
             conf->endpoint, res, curl_easy_strerror(res));
-    return -1;
+    if (t->error[0] == '\0') {
+      snprintf(t->error, sizeof(t->error), "%s", curl_easy_strerror(res));
+    }
+    rv = CKL_ERR_NETWORK;
+    goto out;
   }
 
-  curl_easy_getinfo(t->curl, CURLINFO_RESPONSE_CODE, &httprc);
-
   if (httprc >299 || httprc <= 199) {
     fprintf(stderr, "Endpoint %s returned HTTP %d\n",
             conf->endpoint, (int)httprc);
     if (httprc == 403) {
       fprintf(stderr, "Are you sure your secret is correct?\n");
     }
-    return -1;
+    snprintf(t->error, sizeof(t->error), "endpoint returned HTTP %d",
+             (int)httprc);
+    rv = CKL_ERR_HTTP;
   }
 
-  free(url);
-  return 0;
+out:
+  if (m) {
+    ckl_metrics_result(&conf->metrics, rv == CKL_OK);
+  }
+  transport_reset(t);
+  return rv;
 }
 
 int ckl_transport_msg_send(ckl_transport_t *t,
@@ -232,15 +528,24 @@ int ckl_transport_msg_send(ckl_transport_t *t,
     return rv;
   }
 
-  return ckl_transport_run(t, conf, m);
+  rv = ckl_transport_run(t, conf, m);
+
+  /* the endpoint has it; the local copy is a convenience */
+  if (rv == CKL_OK && conf->store_dir) {
+    ckl_store_append(conf, m);
+  }
+
+  return rv;
 }
 
 
 int ckl_transport_list(ckl_transport_t *t,
                        ckl_conf_t *conf,
-                       int count)
+                       int count,
+                       const char **tags,
+                       int tag_count)
 {
-  int rv = list_to_post_data(t, conf, count);
+  int rv = list_to_post_data(t, conf, count, tags, tag_count);
 
   if (rv < 0) {
     return rv;
@@ -253,9 +558,12 @@ int ckl_transport_list(ckl_transport_t *t,
 
 int ckl_transport_detail(ckl_transport_t *t,
                          ckl_conf_t *conf,
-                         const char *slug)
+                         const char *slug,
+                         unsigned long long event,
+                         int head,
+                         int tail)
 {
-  int rv = detail_to_post_data(t, conf, slug);
+  int rv = detail_to_post_data(t, conf, slug, event, head, tail);
 
   if (rv < 0) {
     return rv;
@@ -266,12 +574,112 @@ int ckl_transport_detail(ckl_transport_t *t,
   return ckl_transport_run(t, conf, NULL);
 }
 
+int ckl_transport_replay(ckl_transport_t *t,
+                         ckl_conf_t *conf,
+                         const char *slug,
+                         unsigned long long event,
+                         const char *at)
+{
+  int rv = replay_to_post_data(t, conf, slug, event, at);
+
+  if (rv < 0) {
+    return rv;
+  }
+
+  t->append_url = "/replay";
+
+  return ckl_transport_run(t, conf, NULL);
+}
+
+typedef struct sync_sink_t {
+  ckl_emit_fn emit;
+  void *baton;
+} sync_sink_t;
+
+static size_t sync_write(char *buf, size_t size, size_t nmemb, void *baton)
+{
+  sync_sink_t *s = baton;
+
+  return s->emit(s->baton, buf, size * nmemb) == 0 ? size * nmemb : 0;
+}
+
+/* the host's events after since, handed to emit as they arrive */
+int ckl_transport_sync(ckl_transport_t *t,
+                       ckl_conf_t *conf,
+                       const char *hostname,
+                       unsigned long long since,
+                       ckl_emit_fn emit,
+                       void *baton)
+{
+  sync_sink_t sink = {emit, baton};
+  int rv = sync_to_post_data(t, conf, hostname, since);
+
+  if (rv < 0) {
+    return rv;
+  }
+
+  t->append_url = "/sync";
+  curl_easy_setopt(t->curl, CURLOPT_WRITEFUNCTION, sync_write);
+  curl_easy_setopt(t->curl, CURLOPT_WRITEDATA, &sink);
+
+  rv = ckl_transport_run(t, conf, NULL);
+
+  curl_easy_setopt(t->curl, CURLOPT_WRITEFUNCTION, NULL);
+  curl_easy_setopt(t->curl, CURLOPT_WRITEDATA, stdout);
+
+  return rv;
+}
+
+/* set once the first transport is made, so modes that never talk to
+ * the endpoint (-h, -V, -D) never initialize curl.  curl_global_init()
+ * itself is not thread safe, hence the lock for libckl's contexts. */
+static int transport_global_init;
+static pthread_mutex_t transport_global_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int ckl_transport_global_init(long flags)
+{
+  int rv = CKL_OK;
+
+  pthread_mutex_lock(&transport_global_lock);
+  if (!transport_global_init) {
+    if (curl_global_init(flags) != CURLE_OK) {
+      fprintf(stderr, "curl_global_init() failed\n");
+      rv = CKL_ERR_SYSTEM;
+    }
+    else {
+      transport_global_init = 1;
+    }
+  }
+  pthread_mutex_unlock(&transport_global_lock);
+
+  return rv;
+}
+
 int ckl_transport_init(ckl_transport_t *t, ckl_conf_t *conf)
 {
   char uabuf[255];
   static const char buf[] = "Expect:";
-  
+
+  ckl_prof_begin(CKL_PROF_LIBINIT);
+
+  /* the TLS stack is only set up for an https endpoint */
+  if (!transport_global_init) {
+    long flags = CURL_GLOBAL_NOTHING;
+    if (strncasecmp(conf->endpoint, "https:", 6) == 0) {
+      flags = CURL_GLOBAL_SSL;
+    }
+    if (ckl_transport_global_init(flags) != CKL_OK) {
+      ckl_prof_end(CKL_PROF_LIBINIT);
+      return CKL_ERR_SYSTEM;
+    }
+  }
+
   t->curl = curl_easy_init();
+  if (t->curl == NULL) {
+    ckl_prof_end(CKL_PROF_LIBINIT);
+    return CKL_ERR_SYSTEM;
+  }
+  curl_easy_setopt(t->curl, CURLOPT_ERRORBUFFER, t->error);
   
   snprintf(uabuf, sizeof(uabuf), "ckl/%d.%d.%d (Changelog Client)",
            CKL_VERSION_MAJOR, CKL_VERSION_MINOR, CKL_VERSION_PATCH);
@@ -289,16 +697,53 @@ int ckl_transport_init(ckl_transport_t *t, ckl_conf_t *conf)
   
   t->headerlist = curl_slist_append(t->headerlist, buf);
   curl_easy_setopt(t->curl, CURLOPT_HTTPHEADER, t->headerlist);
-  
+
+  ckl_prof_end(CKL_PROF_LIBINIT);
   return 0;
 }
 
+/* for requests that must not hold up the one the user is waiting on */
+void ckl_transport_connect_timeout(ckl_transport_t *t, long seconds)
+{
+  curl_easy_setopt(t->curl, CURLOPT_CONNECTTIMEOUT, seconds);
+}
+
+/* a message on a connection of its own; connect_timeout 0 is curl's */
+int ckl_transport_send(ckl_conf_t *conf, ckl_msg_t *msg, long connect_timeout)
+{
+  int rv;
+  ckl_transport_t *t = calloc(1, sizeof(ckl_transport_t));
+
+  rv = ckl_transport_init(t, conf);
+  if (rv == 0) {
+    if (connect_timeout > 0) {
+      ckl_transport_connect_timeout(t, connect_timeout);
+    }
+    rv = ckl_transport_msg_send(t, conf, msg);
+  }
+
+  ckl_transport_free(t);
+
+  return rv;
+}
+
 void ckl_transport_free(ckl_transport_t *t)
 {
+  ckl_prof_begin(CKL_PROF_TEARDOWN);
+  transport_reset(t);
   curl_easy_cleanup(t->curl);
-  curl_formfree(t->formpost);
   curl_slist_free_all(t->headerlist);
+  ckl_arena_free(&t->arena);
   free(t);
+  ckl_prof_end(CKL_PROF_TEARDOWN);
 }
 
-
+void ckl_transport_cleanup(void)
+{
+  pthread_mutex_lock(&transport_global_lock);
+  if (transport_global_init) {
+    curl_global_cleanup();
+    transport_global_init = 0;
+  }
+  pthread_mutex_unlock(&transport_global_lock);
+}
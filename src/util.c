@@ -15,13 +15,15 @@
  * limitations under the License.
  */
 
+#define _GNU_SOURCE
 #include "ckl.h"
-
-void ckl_error_out(const char *msg)
-{
-  fprintf(stderr, "ERROR: %s\n", msg);
-  exit(EXIT_FAILURE);
-}
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
 
 void ckl_nuke_newlines(char *p)
 {
@@ -43,7 +45,8 @@ int ckl_tmp_file(char **path, FILE **fd)
   
   strncpy(buf, "/tmp/ckl.XXXXXX", sizeof(buf));
   
-  int fx = mkstemp(buf);
+  /* opened again by path by whoever needs it, never inherited */
+  int fx = mkostemp(buf, O_CLOEXEC);
   if (fx < 0) {
     perror("Failed to create tempfile");
     return -1;
@@ -58,17 +61,312 @@ int ckl_tmp_file(char **path, FILE **fd)
   return 0;
 }
 
-const char *ckl_hostname()
+/**
+ * Scratch buffers for a session's files, which live only as long as ckl
+ * holds them open: a memfd when they may be kept in memory, otherwise an
+ * O_TMPFILE in /tmp.  Whatever needs a path (the shell's rc file, the
+ * upload) gets /proc/self/fd/N.  The descriptor is close-on-exec, so the
+ * shell and its commands do not hold the session's files open; a child
+ * that has to open the path itself needs ckl_tmp_inherit() first, and
+ * should close the descriptor once it has.
+ * Where neither exists, or /proc is not mounted, it is a named file as
+ * from ckl_tmp_file().
+ *
+ * Either way the FILE has to stay open while the path is used, and
+ * ckl_tmp_remove() is the cleanup.
+ */
+int ckl_tmp_buffer(char **path, FILE **fd, int memory)
+{
+  char buf[64];
+  int fx = -1;
+
+#if defined(__linux__) && defined(MFD_CLOEXEC)
+  if (memory) {
+    fx = memfd_create("ckl", MFD_CLOEXEC);
+  }
+#endif
+#ifdef O_TMPFILE
+  if (fx < 0) {
+    fx = open("/tmp", O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+  }
+#endif
+
+  if (fx >= 0) {
+    snprintf(buf, sizeof(buf), "/proc/self/fd/%d", fx);
+    if (access(buf, R_OK | W_OK) < 0) {
+      close(fx);
+      fx = -1;
+    }
+  }
+
+  if (fx < 0) {
+    return ckl_tmp_file(path, fd);
+  }
+
+  *fd = fdopen(fx, "r+");
+  *path = strdup(buf);
+
+  return 0;
+}
+
+/* lets the next exec keep the buffer behind path, for a child that opens
+ * /proc/self/fd/N; named files need nothing */
+int ckl_tmp_inherit(FILE *fd)
+{
+  int flags = fcntl(fileno(fd), F_GETFD);
+
+  if (flags < 0 || fcntl(fileno(fd), F_SETFD, flags & ~FD_CLOEXEC) < 0) {
+    perror("fcntl() of a temp buffer failed");
+    return -1;
+  }
+
+  return 0;
+}
+
+/* the named files are unlinked, the anonymous ones go when closed */
+void ckl_tmp_remove(const char *path)
+{
+  if (strncmp(path, "/proc/self/fd/", 14) != 0) {
+    unlink(path);
+  }
+}
+
+/**
+ * Moves a memory-backed buffer to /tmp, once it has grown past
+ * ckl_tmp_memory_bytes.  The disk file takes over the descriptor number,
+ * so the /proc/self/fd path and anyone writing to the descriptor carry
+ * on with it, at the same offset.  Not a memfd: nothing to do.
+ */
+int ckl_tmp_spill(int fd)
+{
+#ifdef F_GET_SEALS
+  char buf[64 * 1024];
+  char *path;
+  FILE *disk;
+  off_t off = 0;
+  ssize_t n;
+  int cloexec = fcntl(fd, F_GETFD);
+
+  if (fcntl(fd, F_GET_SEALS) < 0) {
+    return 0;
+  }
+
+  if (ckl_tmp_buffer(&path, &disk, 0) < 0) {
+    return -1;
+  }
+  ckl_tmp_remove(path);
+  free(path);
+
+  while ((n = pread(fd, buf, sizeof(buf), off)) != 0) {
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0 || write(fileno(disk), buf, n) != n) {
+      perror("moving a temp buffer to disk failed");
+      fclose(disk);
+      return -1;
+    }
+    off += n;
+  }
+
+  /* dup2() would drop close-on-exec */
+  if (dup3(fileno(disk), fd, cloexec > 0 && (cloexec & FD_CLOEXEC) ?
+           O_CLOEXEC : 0) < 0) {
+    perror("moving a temp buffer to disk failed");
+    fclose(disk);
+    return -1;
+  }
+
+  fclose(disk);
+#endif
+  return 0;
+}
+
+int ckl_hostname(char *buf, size_t len)
 {
-  char buf[HOST_NAME_MAX+1];
-  buf[HOST_NAME_MAX] = '\0';
   int rv;
-  
-  rv = gethostname(&buf[0], HOST_NAME_MAX);
+
+  buf[len - 1] = '\0';
+  rv = gethostname(buf, len - 1);
   if (rv < 0) {
-    ckl_error_out("gethostname returned -1.  Is your hostname set?");
-    return NULL;
+    fprintf(stderr, "gethostname returned -1.  Is your hostname set?\n");
+    return -1;
   }
-  
-  return strdup(buf);
+
+  return 0;
+}
+
+/**
+ * Fixed size ring buffer keeping the last `size` bytes written to it.
+ */
+int ckl_ring_init(ckl_ring_t *r, size_t size)
+{
+  memset(r, 0, sizeof(*r));
+
+  if (size == 0) {
+    return 0;
+  }
+
+  r->buf = malloc(size);
+  if (r->buf == NULL) {
+    return -1;
+  }
+  r->size = size;
+  return 0;
+}
+
+void ckl_ring_write(ckl_ring_t *r, const char *buf, size_t len)
+{
+  size_t end;
+  size_t n;
+
+  if (r->size == 0) {
+    r->dropped += len;
+    return;
+  }
+
+  if (len >= r->size) {
+    /* only the tail of this write survives */
+    r->dropped += r->len + (len - r->size);
+    memcpy(r->buf, buf + len - r->size, r->size);
+    r->start = 0;
+    r->len = r->size;
+    return;
+  }
+
+  if (r->len + len > r->size) {
+    size_t over = r->len + len - r->size;
+    r->dropped += over;
+    r->start = (r->start + over) % r->size;
+    r->len -= over;
+  }
+
+  end = (r->start + r->len) % r->size;
+  n = r->size - end < len ? r->size - end : len;
+  memcpy(r->buf + end, buf, n);
+  memcpy(r->buf, buf + n, len - n);
+  r->len += len;
+}
+
+/* hands the contents past the oldest skip bytes to emit, leaving them */
+int ckl_ring_peek(ckl_ring_t *r, size_t skip, ckl_emit_fn emit, void *baton)
+{
+  size_t from;
+  size_t n;
+  int rv;
+
+  if (skip >= r->len) {
+    return 0;
+  }
+
+  from = (r->start + skip) % r->size;
+  n = r->size - from < r->len - skip ? r->size - from : r->len - skip;
+  rv = emit(baton, r->buf + from, n);
+  if (rv < 0) {
+    return rv;
+  }
+
+  if (n < r->len - skip) {
+    rv = emit(baton, r->buf, r->len - skip - n);
+    if (rv < 0) {
+      return rv;
+    }
+  }
+
+  return 0;
+}
+
+/* hands the contents, oldest first, to emit in at most two pieces */
+int ckl_ring_drain(ckl_ring_t *r, ckl_emit_fn emit, void *baton)
+{
+  int rv = ckl_ring_peek(r, 0, emit, baton);
+
+  if (rv < 0) {
+    return rv;
+  }
+
+  r->start = 0;
+  r->len = 0;
+  return 0;
+}
+
+void ckl_ring_free(ckl_ring_t *r)
+{
+  free(r->buf);
+  memset(r, 0, sizeof(*r));
+}
+
+/**
+ * --profile-startup: wall time of each phase of the invocation, from the
+ * start of main(), printed to stderr at exit.  Only the origin is taken
+ * on every run; the phases read the clock only once the report has been
+ * asked for, so without it they cost a branch.
+ */
+static const char *prof_names[CKL_PROF_MAX] = {
+  "config parse",
+  "identity lookup",
+  "library init",
+  "network",
+  "teardown"
+};
+
+static struct timespec prof_origin;
+static struct timespec prof_started[CKL_PROF_MAX];
+static double prof_spent[CKL_PROF_MAX];
+static int prof_enabled;
+
+static double prof_since(const struct timespec *ts)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - ts->tv_sec) * 1e3 + (now.tv_nsec - ts->tv_nsec) / 1e6;
+}
+
+void ckl_prof_init(void)
+{
+  clock_gettime(CLOCK_MONOTONIC, &prof_origin);
+}
+
+void ckl_prof_enable(void)
+{
+  prof_enabled = 1;
+}
+
+void ckl_prof_begin(ckl_prof_phase_e phase)
+{
+  if (prof_enabled) {
+    clock_gettime(CLOCK_MONOTONIC, &prof_started[phase]);
+  }
+}
+
+void ckl_prof_end(ckl_prof_phase_e phase)
+{
+  if (prof_enabled) {
+    prof_spent[phase] += prof_since(&prof_started[phase]);
+  }
+}
+
+void ckl_prof_report(void)
+{
+  double total;
+  double rest;
+  int i;
+
+  if (!prof_enabled) {
+    return;
+  }
+
+  total = prof_since(&prof_origin);
+  rest = total;
+
+  fprintf(stderr, "%-16s %10s %6s\n", "phase", "ms", "%");
+  for (i = 0; i < CKL_PROF_MAX; i++) {
+    fprintf(stderr, "%-16s %10.3f %5.1f%%\n", prof_names[i], prof_spent[i],
+            total > 0 ? prof_spent[i] * 100 / total : 0);
+    rest -= prof_spent[i];
+  }
+  fprintf(stderr, "%-16s %10.3f %5.1f%%\n", "other", rest,
+          total > 0 ? rest * 100 / total : 0);
+  fprintf(stderr, "%-16s %10.3f\n", "total", total);
 }
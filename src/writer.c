@@ -0,0 +1,603 @@
+/*
+ * Licensed to Cloudkick, Inc under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * Cloudkick licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ckl.h"
+#include <stdio.h>
+#include <errno.h>
+
+/**
+ * Appends the script log to its file.  By default every write is a
+ * write(2) and every sync an fdatasync(2) that the recorder waits on.
+ *
+ * With ckl_script_io_uring the writer goes through an io_uring of its
+ * own instead: output is copied into a few registered buffers, each full
+ * buffer is one WRITE_FIXED at an explicit offset, and a sync is the
+ * partial buffer's write linked to an fdatasync, submitted together and
+ * not waited for, so the recorder keeps pumping while the disk catches
+ * up.  Everything is waited for when the writer is finished.
+ *
+ * The ring is set up with raw syscalls, no liburing.  If the kernel has
+ * no io_uring, or it is disabled or filtered, the writer quietly uses
+ * write(2).
+ */
+
+#if defined(HAVE_IO_URING) && defined(__linux__)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#endif
+
+static int writer_write_all(ckl_writer_t *w, const char *buf, size_t len)
+{
+  ssize_t rv;
+
+  while (len > 0) {
+    w->calls++;
+    rv = write(w->fd, buf, len);
+    if (rv < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("write() of script log failed");
+      return -1;
+    }
+    buf += rv;
+    len -= rv;
+  }
+
+  return 0;
+}
+
+#if defined(HAVE_IO_URING) && defined(__linux__) && defined(__NR_io_uring_setup)
+
+#define URING_BUFS 4
+#define URING_BUF_SIZE (64 * 1024)
+#define URING_ENTRIES 8
+#define URING_FSYNC ((uint64_t)-1)
+
+struct ckl_uring_t {
+  int fd;
+  void *sq_ptr;
+  size_t sq_len;
+  void *cq_ptr;
+  size_t cq_len;
+  struct io_uring_sqe *sqes;
+  size_t sqes_len;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+  int fixed;
+  char *bufs;
+  struct iovec iov[URING_BUFS];
+  size_t fill[URING_BUFS];
+  off_t buf_off[URING_BUFS];
+  int busy[URING_BUFS];
+  int cur;
+  unsigned pending;
+  unsigned inflight;
+  off_t off;
+  int error;
+};
+
+static int uring_enter(ckl_writer_t *w, unsigned submit, unsigned wait)
+{
+  ckl_uring_t *u = w->ring;
+  int rv;
+
+  do {
+    w->calls++;
+    rv = syscall(__NR_io_uring_enter, u->fd, submit, wait,
+                 wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+  } while (rv < 0 && errno == EINTR);
+
+  if (rv < 0) {
+    perror("io_uring_enter() of script log failed");
+    return -1;
+  }
+
+  u->pending -= rv;
+  u->inflight += rv;
+  return 0;
+}
+
+/* a short write leaves a hole; fill it the slow way */
+static void uring_complete_write(ckl_writer_t *w, int idx, int res)
+{
+  ckl_uring_t *u = w->ring;
+  size_t done = res;
+
+  while (done < u->fill[idx]) {
+    ssize_t rv;
+
+    w->calls++;
+    rv = pwrite(w->fd, u->bufs + idx * URING_BUF_SIZE + done,
+                u->fill[idx] - done, u->buf_off[idx] + done);
+    if (rv < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      u->error = errno;
+      break;
+    }
+    done += rv;
+  }
+
+  /* and the fdatasync linked to it was cancelled */
+  if (res >= 0 && (size_t)res < u->fill[idx] && u->error == 0) {
+    w->calls++;
+    if (fdatasync(w->fd) < 0) {
+      u->error = errno;
+    }
+  }
+
+  u->fill[idx] = 0;
+  u->busy[idx] = 0;
+}
+
+static void uring_reap(ckl_writer_t *w)
+{
+  ckl_uring_t *u = w->ring;
+  unsigned head = *u->cq_head;
+
+  while (head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+    struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+
+    if (cqe->user_data == URING_FSYNC) {
+      /* -ECANCELED follows a short write, which already synced */
+      if (cqe->res < 0 && cqe->res != -ECANCELED && u->error == 0) {
+        u->error = -cqe->res;
+      }
+    }
+    else if (cqe->res < 0) {
+      if (u->error == 0) {
+        u->error = -cqe->res;
+      }
+      u->busy[cqe->user_data] = 0;
+      u->fill[cqe->user_data] = 0;
+    }
+    else {
+      uring_complete_write(w, cqe->user_data, cqe->res);
+    }
+
+    u->inflight--;
+    head++;
+  }
+
+  __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+}
+
+static int uring_check(ckl_writer_t *w)
+{
+  ckl_uring_t *u = w->ring;
+
+  if (u->error) {
+    fprintf(stderr, "io_uring write of script log failed: %s\n",
+            strerror(u->error));
+    return -1;
+  }
+
+  return 0;
+}
+
+/* waits for at least `count` more completions */
+static int uring_wait(ckl_writer_t *w, unsigned count)
+{
+  if (uring_enter(w, w->ring->pending, count) < 0) {
+    return -1;
+  }
+  uring_reap(w);
+  return uring_check(w);
+}
+
+/* never more in the air than the completion queue can report */
+static int uring_room(ckl_writer_t *w, unsigned count)
+{
+  ckl_uring_t *u = w->ring;
+
+  while (u->pending + u->inflight + count > URING_ENTRIES) {
+    if (uring_wait(w, 1) < 0) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+static struct io_uring_sqe *uring_sqe(ckl_writer_t *w)
+{
+  ckl_uring_t *u = w->ring;
+  unsigned tail;
+  unsigned idx;
+  struct io_uring_sqe *sqe;
+
+  if (uring_room(w, 1) < 0) {
+    return NULL;
+  }
+
+  tail = *u->sq_tail;
+  idx = tail & *u->sq_mask;
+  sqe = &u->sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  u->sq_array[idx] = idx;
+  __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  u->pending++;
+
+  return sqe;
+}
+
+static int uring_queue_write(ckl_writer_t *w, int flags)
+{
+  ckl_uring_t *u = w->ring;
+  int idx = u->cur;
+  struct io_uring_sqe *sqe = uring_sqe(w);
+
+  if (sqe == NULL) {
+    return -1;
+  }
+
+  if (u->fixed) {
+    sqe->opcode = IORING_OP_WRITE_FIXED;
+    sqe->addr = (uintptr_t)u->iov[idx].iov_base;
+    sqe->len = u->fill[idx];
+    sqe->buf_index = idx;
+  }
+  else {
+    u->iov[idx].iov_len = u->fill[idx];
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->addr = (uintptr_t)&u->iov[idx];
+    sqe->len = 1;
+  }
+  sqe->fd = w->fd;
+  sqe->off = u->off;
+  sqe->flags = flags;
+  sqe->user_data = idx;
+
+  u->buf_off[idx] = u->off;
+  u->off += u->fill[idx];
+  u->busy[idx] = 1;
+  return 0;
+}
+
+/* moves on to the next free buffer, waiting for one if need be */
+static int uring_next(ckl_writer_t *w)
+{
+  ckl_uring_t *u = w->ring;
+
+  while (1) {
+    int i;
+    for (i = 1; i <= URING_BUFS; i++) {
+      int idx = (u->cur + i) % URING_BUFS;
+      if (!u->busy[idx]) {
+        u->cur = idx;
+        return 0;
+      }
+    }
+    if (uring_wait(w, 1) < 0) {
+      return -1;
+    }
+  }
+}
+
+static int uring_write(ckl_writer_t *w, const char *buf, size_t len)
+{
+  ckl_uring_t *u = w->ring;
+
+  if (uring_check(w) < 0) {
+    return -1;
+  }
+
+  while (len > 0) {
+    size_t room = URING_BUF_SIZE - u->fill[u->cur];
+    size_t n = len < room ? len : room;
+
+    memcpy(u->bufs + u->cur * URING_BUF_SIZE + u->fill[u->cur], buf, n);
+    u->fill[u->cur] += n;
+    buf += n;
+    len -= n;
+
+    if (u->fill[u->cur] == URING_BUF_SIZE) {
+      /* submitted right away, and whatever completed is reaped for free */
+      if (uring_queue_write(w, 0) < 0 || uring_enter(w, u->pending, 0) < 0) {
+        return -1;
+      }
+      uring_reap(w);
+      if (uring_next(w) < 0) {
+        return -1;
+      }
+    }
+  }
+
+  return 0;
+}
+
+static int uring_sync(ckl_writer_t *w, int wait)
+{
+  ckl_uring_t *u = w->ring;
+  struct io_uring_sqe *sqe;
+  int queued = 0;
+
+  if (uring_check(w) < 0) {
+    return -1;
+  }
+
+  /* the write drains everything before it, and the sync is linked to
+   * it, so it covers all the output so far.  Both go in together: a wait
+   * for room between them would submit the write with a dangling link. */
+  if (u->fill[u->cur] > 0) {
+    if (uring_room(w, 2) < 0 ||
+        uring_queue_write(w, IOSQE_IO_DRAIN | IOSQE_IO_LINK) < 0) {
+      return -1;
+    }
+    queued = 1;
+  }
+
+  sqe = uring_sqe(w);
+  if (sqe == NULL) {
+    return -1;
+  }
+  sqe->opcode = IORING_OP_FSYNC;
+  sqe->fd = w->fd;
+  sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+  sqe->flags = queued ? 0 : IOSQE_IO_DRAIN;
+  sqe->user_data = URING_FSYNC;
+
+  if (wait) {
+    return uring_wait(w, u->pending + u->inflight);
+  }
+
+  if (uring_enter(w, u->pending, 0) < 0) {
+    return -1;
+  }
+  uring_reap(w);
+
+  if (queued) {
+    return uring_next(w);
+  }
+
+  return 0;
+}
+
+static int uring_flush(ckl_writer_t *w)
+{
+  ckl_uring_t *u = w->ring;
+
+  if (u->fill[u->cur] > 0 && uring_queue_write(w, 0) < 0) {
+    return -1;
+  }
+
+  while (u->pending + u->inflight > 0) {
+    if (uring_wait(w, u->pending + u->inflight) < 0) {
+      return -1;
+    }
+  }
+
+  /* leave the descriptor where write(2) would have */
+  lseek(w->fd, u->off, SEEK_SET);
+  return uring_check(w);
+}
+
+static void uring_free(ckl_uring_t *u)
+{
+  if (u->sq_ptr && u->sq_ptr != MAP_FAILED) {
+    munmap(u->sq_ptr, u->sq_len);
+  }
+  if (u->cq_ptr && u->cq_ptr != MAP_FAILED && u->cq_ptr != u->sq_ptr) {
+    munmap(u->cq_ptr, u->cq_len);
+  }
+  if (u->sqes && u->sqes != MAP_FAILED) {
+    munmap(u->sqes, u->sqes_len);
+  }
+  if (u->fd >= 0) {
+    close(u->fd);
+  }
+  free(u->bufs);
+  free(u);
+}
+
+static ckl_uring_t *uring_init(int fd)
+{
+  struct io_uring_params p;
+  ckl_uring_t *u = calloc(1, sizeof(ckl_uring_t));
+  int i;
+
+  memset(&p, 0, sizeof(p));
+  u->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+  if (u->fd < 0) {
+    /* ENOSYS, or EPERM under a seccomp filter or io_uring_disabled */
+    free(u);
+    return NULL;
+  }
+
+  u->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  u->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (u->cq_len > u->sq_len) {
+      u->sq_len = u->cq_len;
+    }
+    u->cq_len = u->sq_len;
+  }
+
+  u->sq_ptr = mmap(NULL, u->sq_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+  if (u->sq_ptr == MAP_FAILED) {
+    uring_free(u);
+    return NULL;
+  }
+
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    u->cq_ptr = u->sq_ptr;
+  }
+  else {
+    u->cq_ptr = mmap(NULL, u->cq_len, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+    if (u->cq_ptr == MAP_FAILED) {
+      uring_free(u);
+      return NULL;
+    }
+  }
+
+  u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+  u->sqes = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+  if (u->sqes == MAP_FAILED) {
+    uring_free(u);
+    return NULL;
+  }
+
+  u->sq_head = (unsigned *)((char *)u->sq_ptr + p.sq_off.head);
+  u->sq_tail = (unsigned *)((char *)u->sq_ptr + p.sq_off.tail);
+  u->sq_mask = (unsigned *)((char *)u->sq_ptr + p.sq_off.ring_mask);
+  u->sq_array = (unsigned *)((char *)u->sq_ptr + p.sq_off.array);
+  u->cq_head = (unsigned *)((char *)u->cq_ptr + p.cq_off.head);
+  u->cq_tail = (unsigned *)((char *)u->cq_ptr + p.cq_off.tail);
+  u->cq_mask = (unsigned *)((char *)u->cq_ptr + p.cq_off.ring_mask);
+  u->cqes = (struct io_uring_cqe *)((char *)u->cq_ptr + p.cq_off.cqes);
+
+  u->bufs = malloc(URING_BUFS * URING_BUF_SIZE);
+  if (u->bufs == NULL) {
+    uring_free(u);
+    return NULL;
+  }
+  for (i = 0; i < URING_BUFS; i++) {
+    u->iov[i].iov_base = u->bufs + i * URING_BUF_SIZE;
+    u->iov[i].iov_len = URING_BUF_SIZE;
+  }
+
+  /* pinned pages count against RLIMIT_MEMLOCK on older kernels; without
+   * them every write is a plain WRITEV on the same ring */
+  u->fixed = syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_BUFFERS,
+                     u->iov, URING_BUFS) == 0;
+
+  u->off = lseek(fd, 0, SEEK_CUR);
+  if (u->off < 0) {
+    u->off = 0;
+  }
+
+  return u;
+}
+
+#else
+
+struct ckl_uring_t {
+  int unused;
+};
+
+static ckl_uring_t *uring_init(int fd)
+{
+  return NULL;
+}
+
+static int uring_write(ckl_writer_t *w, const char *buf, size_t len)
+{
+  return -1;
+}
+
+static int uring_sync(ckl_writer_t *w, int wait)
+{
+  return -1;
+}
+
+static int uring_flush(ckl_writer_t *w)
+{
+  return 0;
+}
+
+static void uring_free(ckl_uring_t *u)
+{
+  free(u);
+}
+
+#endif
+
+int ckl_writer_init(ckl_writer_t *w, int fd, int use_uring)
+{
+  memset(w, 0, sizeof(*w));
+  w->fd = fd;
+
+  if (use_uring) {
+    w->ring = uring_init(fd);
+  }
+
+  return 0;
+}
+
+/* a log in a memory buffer goes to disk once it is spill_at bytes long */
+static int writer_spill(ckl_writer_t *w)
+{
+  w->spill_at = 0;
+
+  if (w->ring && uring_flush(w) < 0) {
+    return -1;
+  }
+
+  return ckl_tmp_spill(w->fd);
+}
+
+int ckl_writer_write(ckl_writer_t *w, const char *buf, size_t len)
+{
+  int rv;
+
+  if (w->ring) {
+    rv = uring_write(w, buf, len);
+  }
+  else {
+    rv = writer_write_all(w, buf, len);
+  }
+
+  w->written += len;
+  if (rv == 0 && w->spill_at > 0 && w->written > w->spill_at) {
+    rv = writer_spill(w);
+  }
+
+  return rv;
+}
+
+/* with io_uring only `wait` makes the caller block on the disk */
+int ckl_writer_sync(ckl_writer_t *w, int wait)
+{
+  if (w->ring) {
+    return uring_sync(w, wait);
+  }
+
+  w->calls++;
+  if (fdatasync(w->fd) < 0) {
+    perror("fdatasync() of script log failed");
+    return -1;
+  }
+
+  return 0;
+}
+
+/* everything written is in the file once this returns */
+int ckl_writer_finish(ckl_writer_t *w)
+{
+  int rv = 0;
+
+  if (w->ring) {
+    rv = uring_flush(w);
+    uring_free(w->ring);
+    w->ring = NULL;
+  }
+
+  return rv;
+}
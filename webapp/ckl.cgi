@@ -33,6 +33,8 @@ import flup
 import sqlite3
 import traceback
 import time
+import zlib
+import re
 
 def get_conn():
   _SQL_CREATE = ["""
@@ -49,13 +51,489 @@ def get_conn():
     """
     CREATE INDEX IF NOT EXISTS
       ix_events_hostname ON events (hostname);
+    """,
+    """
+    CREATE TABLE IF NOT EXISTS
+      commands (
+        event_id INTEGER NOT NULL,
+        seq INTEGER NOT NULL,
+        offset INTEGER NOT NULL,
+        start_ms INTEGER NOT NULL,
+        duration_ms INTEGER NOT NULL,
+        exit INTEGER NOT NULL,
+        command TEXT NOT NULL,
+        PRIMARY KEY (event_id, seq));
+    """,
+    """
+    CREATE TABLE IF NOT EXISTS
+      marks (
+        event_id INTEGER NOT NULL,
+        time_ms INTEGER NOT NULL,
+        offset INTEGER NOT NULL,
+        PRIMARY KEY (event_id, time_ms));
+    """,
+    """
+    CREATE TABLE IF NOT EXISTS
+      keyframes (
+        event_id INTEGER NOT NULL,
+        offset INTEGER NOT NULL,
+        time_ms INTEGER NOT NULL,
+        screen TEXT NOT NULL,
+        PRIMARY KEY (event_id, offset));
+    """,
+    """
+    CREATE TABLE IF NOT EXISTS
+      tags (
+        event_id INTEGER NOT NULL,
+        key TEXT NOT NULL,
+        value TEXT NOT NULL,
+        PRIMARY KEY (event_id, key, value));
+    """,
+    """
+    CREATE INDEX IF NOT EXISTS
+      ix_tags_key_value ON tags (key, value, event_id);
+    """]
+  # columns added after the initial schema, for existing databases
+  _SQL_MIGRATE = ["""
+    ALTER TABLE events ADD COLUMN script_raw TEXT;
+    """,
+    # the stream /replay feeds the emulator: its length, whether it is
+    # script_raw, and whether it is fed in newline mode
+    """
+    ALTER TABLE events ADD COLUMN replay_len INTEGER;
+    """,
+    """
+    ALTER TABLE events ADD COLUMN replay_raw INTEGER;
+    """,
+    """
+    ALTER TABLE events ADD COLUMN replay_newline INTEGER;
     """]
   conn = sqlite3.connect(DATABASE_PATH)
   for q in _SQL_CREATE:
     conn.execute(q);
+  for q in _SQL_MIGRATE:
+    try:
+      conn.execute(q);
+    except sqlite3.OperationalError:
+      pass
+  # logs are BLOBs, so length() is read from the record header and substr()
+  # counts bytes; logs stored as TEXT before that are converted once
+  if conn.execute("PRAGMA user_version").fetchone()[0] < 1:
+    conn.execute("UPDATE events SET script = CAST(script AS BLOB) WHERE typeof(script) = 'text'")
+    conn.execute("UPDATE events SET script_raw = CAST(script_raw AS BLOB) WHERE typeof(script_raw) = 'text'")
+    conn.execute("PRAGMA user_version = 1")
+  # keyframes used to be cut anywhere, even inside an escape sequence;
+  # they are built again on the next replay
+  if conn.execute("PRAGMA user_version").fetchone()[0] < 2:
+    conn.execute("DELETE FROM keyframes")
+    conn.execute("PRAGMA user_version = 2")
   conn.commit();
   return conn
 
+def as_blob(data):
+  if data is None:
+    return None
+  if isinstance(data, unicode):
+    data = data.encode("utf-8")
+  return buffer(data)
+
+def read_scriptlog(form, name="scriptlog"):
+  if not form.has_key(name):
+    return None
+  item = form[name]
+  if isinstance(item, list):
+    item = item[0]
+  data = item.value
+  if item.headers.get("content-encoding", "").lower() == "gzip":
+    # the client compresses while recording and uploads the stream as-is.
+    # A session recovered from the client's spool ends without the gzip
+    # trailer; decompressobj returns what is there instead of failing.
+    data = zlib.decompressobj(16 + zlib.MAX_WBITS).decompress(data)
+  return data
+
+def unescape_command(s):
+  out = []
+  i = 0
+  while i < len(s):
+    if s[i] == '\\' and i + 1 < len(s):
+      out.append({'t': '\t', 'n': '\n'}.get(s[i+1], s[i+1]))
+      i += 2
+    else:
+      out.append(s[i])
+      i += 1
+  return ''.join(out)
+
+def escape_command(s):
+  return s.replace("\\", "\\\\").replace("\t", "\\t").replace("\n", "\\n")
+
+def read_scriptindex(form):
+  """Parses the command index the client recorded alongside the log, and
+  the time marks that come after the commands."""
+  data = read_scriptlog(form, "scriptindex")
+  commands = []
+  marks = []
+  if not data:
+    return (commands, marks)
+  for line in data.splitlines():
+    if line.startswith("#"):
+      continue
+    if line.startswith("@\t"):
+      fields = line.split("\t")
+      if len(fields) == 4:
+        marks.append(tuple([int(x) for x in fields[1:]]))
+      continue
+    fields = line.split("\t", 4)
+    if len(fields) != 5:
+      continue
+    (offset, start_ms, duration_ms, exit) = [int(x) for x in fields[:4]]
+    commands.append((offset, start_ms, duration_ms, exit, unescape_command(fields[4])))
+  return (commands, marks)
+
+def read_tags(value):
+  """key=value tags, one per line."""
+  tags = []
+  for line in (value or "").splitlines():
+    if "=" in line:
+      tags.append(tuple(line.split("=", 1)))
+  return tags
+
+def get_tags(c, event_id):
+  c.execute("SELECT key,value FROM tags WHERE event_id = ? ORDER BY key, value",
+    [event_id])
+  return " ".join(["%s=%s" % (k, v) for (k, v) in c.fetchall()])
+
+def get_commands(c, event_id):
+  c.execute("SELECT seq,offset,start_ms,duration_ms,exit,command FROM commands WHERE event_id = ? ORDER BY seq",
+    [event_id])
+  return c.fetchall()
+
+def format_command(cmd):
+  (seq, offset, start_ms, duration_ms, exit, command) = cmd
+  status = "exit %d" % (exit)
+  if exit < 0:
+    status = "running"
+  return "[%d] +%ds %s (%s, %.1fs)" % (seq, start_ms / 1000, command, status, duration_ms / 1000.0)
+
+# A keyframe every minute of session time, or every 256k of output, so a
+# replay never has to run more than that through the terminal emulator.
+KEYFRAME_MS = 60000
+KEYFRAME_BYTES = 256 * 1024
+
+_VT_TOKEN = re.compile(r"\x1b\[[0-?]*[ -/]*[@-~]|\x1b\][^\x07\x1b]*(?:\x07|\x1b\\)?|\x1b[()#][0-9A-Za-z]|\x1b.|[\x00-\x1f\x7f]")
+# what is left of an escape sequence that the end of the data cut off
+_VT_PARTIAL = re.compile(r"\x1b(?:\[[0-?]*[ -/]*|\][^\x07\x1b]*\x1b?|[()#])?\Z")
+
+class Screen(object):
+  """A small VT100 state machine: enough of the cursor movement, erase,
+  scroll region and alternate screen controls to know what a terminal
+  showed.  Colours and other attributes are dropped.  Streams with no
+  carriage returns (normalized logs) are fed in newline mode.  An escape
+  sequence or UTF-8 character cut off at the end of what is fed waits in
+  pending for the rest of it."""
+
+  def __init__(self, rows=24, cols=80, newline=False):
+    self.rows = rows
+    self.cols = cols
+    self.newline = newline
+    self.pending = ""
+    self.reset()
+
+  def reset(self):
+    self.grid = [[u" "] * self.cols for i in range(self.rows)]
+    self.saved_grid = None
+    self.y = 0
+    self.x = 0
+    self.wrap = False
+    self.top = 0
+    self.bottom = self.rows - 1
+    self.saved = (0, 0)
+
+  def dump(self):
+    """rows cols y x top bottom saved_y saved_x wrap alt, then the rows,
+    trailing blanks stripped.  With alt 1 a program has the alternate
+    screen, and `y x` and the rows of the main screen under it follow."""
+    alt = self.saved_grid is not None
+    lines = ["%d %d %d %d %d %d %d %d %d %d" % (self.rows, self.cols, self.y, self.x,
+      self.top, self.bottom, self.saved[0], self.saved[1], int(self.wrap), int(alt))]
+    for row in self.grid:
+      lines.append(u"".join(row).rstrip().encode("utf-8"))
+    if alt:
+      (grid, y, x) = self.saved_grid
+      lines.append("%d %d" % (y, x))
+      for row in grid:
+        lines.append(u"".join(row).rstrip().encode("utf-8"))
+    return "\n".join(lines)
+
+  def load_rows(self, lines):
+    grid = [[u" "] * self.cols for i in range(self.rows)]
+    for i in range(min(self.rows, len(lines))):
+      text = lines[i].decode("utf-8", "replace")[:self.cols]
+      grid[i][:len(text)] = list(text)
+    return grid
+
+  def load(self, snapshot):
+    lines = snapshot.split("\n")
+    head = [int(v) for v in lines[0].split()]
+    (rows, cols, y, x) = head[:4]
+    self.rows = rows
+    self.cols = cols
+    self.pending = ""
+    self.reset()
+    self.y = y
+    self.x = x
+    self.grid = self.load_rows(lines[1:rows + 1])
+    if len(head) >= 10:
+      (self.top, self.bottom) = (head[4], head[5])
+      self.saved = (head[6], head[7])
+      self.wrap = bool(head[8])
+      if head[9] and len(lines) > rows + 1:
+        (sy, sx) = [int(v) for v in lines[rows + 1].split()]
+        self.saved_grid = (self.load_rows(lines[rows + 2:]), sy, sx)
+
+  def text(self):
+    return "\n".join([u"".join(row).rstrip().encode("utf-8") for row in self.grid]).rstrip("\n") + "\n"
+
+  def incomplete(self, data, tokens):
+    """Where an escape sequence or UTF-8 character that data ends in the
+    middle of starts, or len(data)."""
+    end = len(data)
+    text = 0
+    if tokens:
+      m = tokens[-1]
+      start = m.start()
+      # an OSC whose "\x1b\\" terminator is cut after the escape
+      if m.group(0) == "\x1b" and len(tokens) > 1 and tokens[-2].end() == start:
+        osc = tokens[-2].group(0)
+        if osc.startswith("\x1b]") and not osc.endswith("\x07") and not osc.endswith("\x1b\\"):
+          start = tokens[-2].start()
+      if data[start:start + 1] == "\x1b" and _VT_PARTIAL.match(data, start):
+        return start
+      text = m.end()
+    for i in range(max(text, end - 3), end):
+      lead = ord(data[i:i + 1])
+      if lead >= 0xc0:
+        need = 2 if lead < 0xe0 else 3 if lead < 0xf0 else 4
+        if end - i < need:
+          return i
+    return end
+
+  def feed(self, data):
+    data = self.pending + data
+    tokens = list(_VT_TOKEN.finditer(data))
+    end = self.incomplete(data, tokens)
+    self.pending = data[end:]
+    pos = 0
+    for m in tokens:
+      if m.start() >= end:
+        break
+      if m.start() > pos:
+        self.put(data[pos:m.start()].decode("utf-8", "replace"))
+      self.control(m.group(0))
+      pos = m.end()
+    if pos < end:
+      self.put(data[pos:end].decode("utf-8", "replace"))
+
+  def put(self, text):
+    for ch in text:
+      if self.wrap:
+        self.x = 0
+        self.linefeed()
+      self.grid[self.y][self.x] = ch
+      if self.x == self.cols - 1:
+        self.wrap = True
+      else:
+        self.x += 1
+
+  def linefeed(self):
+    self.wrap = False
+    if self.y == self.bottom:
+      del self.grid[self.top]
+      self.grid.insert(self.bottom, [u" "] * self.cols)
+    elif self.y < self.rows - 1:
+      self.y += 1
+
+  def move(self, y, x):
+    self.y = max(0, min(self.rows - 1, y))
+    self.x = max(0, min(self.cols - 1, x))
+    self.wrap = False
+
+  def erase(self, y, x0, x1):
+    self.grid[y][x0:x1] = [u" "] * (x1 - x0)
+
+  def control(self, seq):
+    c = seq[0]
+    if c == "\r":
+      self.x = 0
+      self.wrap = False
+    elif c == "\n" or c == "\x0b" or c == "\x0c":
+      if self.newline:
+        self.x = 0
+      self.linefeed()
+    elif c == "\b":
+      self.move(self.y, self.x - 1)
+    elif c == "\t":
+      self.move(self.y, (self.x // 8 + 1) * 8)
+    elif c != "\x1b" or len(seq) < 2:
+      return
+    elif seq[1] == "[":
+      self.csi(seq[2:-1], seq[-1])
+    elif seq[1] == "7":
+      self.saved = (self.y, self.x)
+    elif seq[1] == "8":
+      self.move(*self.saved)
+    elif seq[1] == "M":
+      if self.y == self.top:
+        del self.grid[self.bottom]
+        self.grid.insert(self.top, [u" "] * self.cols)
+      else:
+        self.move(self.y - 1, self.x)
+    elif seq[1] == "D":
+      self.linefeed()
+    elif seq[1] == "E":
+      self.x = 0
+      self.linefeed()
+    elif seq[1] == "c":
+      self.reset()
+
+  def csi(self, params, final):
+    private = params.startswith("?")
+    args = []
+    for a in params.lstrip("?>=").split(";"):
+      try:
+        args.append(int(a))
+      except ValueError:
+        args.append(0)
+    n = max(1, args[0])
+    if private:
+      # 1049/47/1047: the alternate screen of full screen programs
+      if args[0] in (47, 1047, 1049):
+        if final == "h" and self.saved_grid is None:
+          self.saved_grid = (self.grid, self.y, self.x)
+          self.grid = [[u" "] * self.cols for i in range(self.rows)]
+        elif final == "l" and self.saved_grid is not None:
+          (self.grid, y, x) = self.saved_grid
+          self.saved_grid = None
+          self.move(y, x)
+      return
+    if final == "A":
+      self.move(max(self.top, self.y - n) if self.y >= self.top else self.y - n, self.x)
+    elif final == "B" or final == "e":
+      self.move(min(self.bottom, self.y + n) if self.y <= self.bottom else self.y + n, self.x)
+    elif final == "C" or final == "a":
+      self.move(self.y, self.x + n)
+    elif final == "D":
+      self.move(self.y, self.x - n)
+    elif final == "E":
+      self.move(self.y + n, 0)
+    elif final == "F":
+      self.move(self.y - n, 0)
+    elif final == "G" or final == "`":
+      self.move(self.y, n - 1)
+    elif final == "d":
+      self.move(n - 1, self.x)
+    elif final == "H" or final == "f":
+      col = 1
+      if len(args) > 1:
+        col = max(1, args[1])
+      self.move(n - 1, col - 1)
+    elif final == "J":
+      if args[0] == 0:
+        self.erase(self.y, self.x, self.cols)
+        for y in range(self.y + 1, self.rows):
+          self.erase(y, 0, self.cols)
+      elif args[0] == 1:
+        for y in range(0, self.y):
+          self.erase(y, 0, self.cols)
+        self.erase(self.y, 0, self.x + 1)
+      else:
+        for y in range(self.rows):
+          self.erase(y, 0, self.cols)
+    elif final == "K":
+      if args[0] == 0:
+        self.erase(self.y, self.x, self.cols)
+      elif args[0] == 1:
+        self.erase(self.y, 0, self.x + 1)
+      else:
+        self.erase(self.y, 0, self.cols)
+    elif final == "X":
+      self.erase(self.y, self.x, min(self.cols, self.x + n))
+    elif final == "P":
+      row = self.grid[self.y]
+      del row[self.x:self.x + n]
+      row.extend([u" "] * (self.cols - len(row)))
+    elif final == "@":
+      row = self.grid[self.y]
+      row[self.x:self.x] = [u" "] * n
+      del row[self.cols:]
+    elif final == "L" or final == "M":
+      if self.y < self.top or self.y > self.bottom:
+        return
+      for i in range(min(n, self.bottom - self.y + 1)):
+        if final == "L":
+          del self.grid[self.bottom]
+          self.grid.insert(self.y, [u" "] * self.cols)
+        else:
+          del self.grid[self.y]
+          self.grid.insert(self.bottom, [u" "] * self.cols)
+    elif final == "S" or final == "T":
+      for i in range(min(n, self.bottom - self.top + 1)):
+        if final == "S":
+          del self.grid[self.top]
+          self.grid.insert(self.bottom, [u" "] * self.cols)
+        else:
+          del self.grid[self.bottom]
+          self.grid.insert(self.top, [u" "] * self.cols)
+    elif final == "r":
+      top = max(1, args[0]) - 1
+      bottom = self.rows - 1
+      if len(args) > 1 and args[1] > 0:
+        bottom = min(self.rows, args[1]) - 1
+      if top < bottom:
+        self.top = top
+        self.bottom = bottom
+        self.move(0, 0)
+    elif final == "s":
+      self.saved = (self.y, self.x)
+    elif final == "u":
+      self.move(*self.saved)
+
+def replay_stream(script, script_raw):
+  """The stream to replay, with whether its offsets are the raw ones.
+  Offsets are in bytes; sqlite hands a BLOB back as a buffer."""
+  (stream, raw) = (script or "", False)
+  if script_raw:
+    (stream, raw) = (script_raw, True)
+  if isinstance(stream, unicode):
+    stream = stream.encode("utf-8")
+  return (str(stream), raw)
+
+def build_keyframes(stream, marks, newline):
+  """Runs the whole stream through a Screen once, keeping a snapshot at
+  least every KEYFRAME_MS of session time and every KEYFRAME_BYTES of
+  output.  marks are (time_ms, offset) in the stream.  A snapshot is
+  placed before any sequence the cut falls inside, whose bytes the
+  screen still has pending, so a replay starts on a whole token."""
+  screen = Screen(newline=newline)
+  frames = [(0, 0, screen.dump())]
+  pos = 0
+  last_ms = 0
+  for (ms, offset) in marks + [(None, len(stream))]:
+    while offset - pos > KEYFRAME_BYTES:
+      screen.feed(stream[pos:pos + KEYFRAME_BYTES])
+      pos += KEYFRAME_BYTES
+      at = pos - len(screen.pending)
+      if at > frames[-1][1]:
+        frames.append((last_ms, at, screen.dump()))
+    if ms is not None and ms - frames[-1][0] >= KEYFRAME_MS and offset > pos:
+      screen.feed(stream[pos:offset])
+      pos = offset
+      at = pos - len(screen.pending)
+      if at > frames[-1][1]:
+        frames.append((ms, at, screen.dump()))
+    if ms is not None:
+      last_ms = ms
+  return frames
+
 def process_post(environ, start_response):
   form = cgi.FieldStorage(fp=environ['wsgi.input'],
                           environ=environ)
@@ -70,12 +548,30 @@ def process_post(environ, start_response):
   remote_ip = environ['REMOTE_ADDR']
   username = form.getfirst("username", "")
   msg =  form.getfirst("msg", "")
-  script = form.getfirst("scriptlog")
+  script = read_scriptlog(form)
+  script_raw = read_scriptlog(form, "scriptlog_raw")
+  (commands, marks) = read_scriptindex(form)
+  # keyframes are built by the first /replay of the session, not here
+  (stream, raw) = replay_stream(script, script_raw)
   c = get_conn()
-  c.execute("""
-      INSERT INTO events VALUES (NULL, ?, ?, ?, ?, ?, ?)
+  cur = c.execute("""
+      INSERT INTO events (timestamp, hostname, remote_ip, username, message, script, script_raw,
+                          replay_len, replay_raw, replay_newline)
+        VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?)
                   """,
-                  [ts, hostname, remote_ip, username, msg, script])
+                  [ts, hostname, remote_ip, username, msg, as_blob(script), as_blob(script_raw),
+                   len(stream), int(raw), int("\r" not in stream)])
+  event_id = cur.lastrowid
+  seq = 0
+  for (key, value) in read_tags(form.getfirst("tags", "")):
+    c.execute("INSERT OR IGNORE INTO tags VALUES (?, ?, ?)", [event_id, key, value])
+  for (offset, start_ms, duration_ms, exit, command) in commands:
+    seq = seq + 1
+    c.execute("INSERT INTO commands VALUES (?, ?, ?, ?, ?, ?, ?)",
+      [event_id, seq, offset, start_ms, duration_ms, exit, command])
+  for (ms, offset, raw_offset) in marks:
+    c.execute("INSERT OR REPLACE INTO marks VALUES (?, ?, ?)",
+      [event_id, ms, raw_offset if raw else offset])
   c.commit()
   start_response("200 OK", [("content-type","text/plain")])
   return ["saved\n"]
@@ -92,18 +588,145 @@ def process_list(environ, start_response):
   c = get_conn().cursor()
   hostname = form.getfirst("hostname", "")
   count = int(form.getfirst("count", 5))
-  c.execute("SELECT timestamp,hostname,username,message FROM events WHERE hostname = ? ORDER BY id DESC LIMIT ?",
-    [hostname, count])
+  tags = read_tags(form.getfirst("tags", ""))
+  if tags:
+    # driven by the (key, value, event_id) index of the first tag, newest
+    # first; any other tags are probes of the same index
+    (key, value) = tags[0]
+    query = "SELECT e.id,e.timestamp,e.hostname,e.username,e.message FROM tags t JOIN events e ON e.id = t.event_id WHERE t.key = ? AND t.value = ? AND e.hostname = ?"
+    args = [key, value, hostname]
+    for (key, value) in tags[1:]:
+      query += " AND EXISTS (SELECT 1 FROM tags WHERE key = ? AND value = ? AND event_id = e.id)"
+      args.extend([key, value])
+    c.execute(query + " ORDER BY t.event_id DESC LIMIT ?", args + [count])
+  else:
+    c.execute("SELECT id,timestamp,hostname,username,message FROM events WHERE hostname = ? ORDER BY id DESC LIMIT ?",
+      [hostname, count])
+  rows = c.fetchall()
   start_response("200 OK", [("content-type","text/plain")])
   output = []
   id = 0
-  for row in c:
+  for row in rows:
     id = id + 1
-    (timestamp,hostname,username,message) = row
+    (event_id,timestamp,hostname,username,message) = row
+    if tags:
+      # numbered as in the unfiltered list, which is what -d takes
+      c.execute("SELECT count(*) FROM events WHERE hostname = ? AND id >= ?",
+        [hostname, event_id])
+      id = c.fetchone()[0]
     t = time.gmtime(timestamp)
     output.append("(%d) %s by %s on %s\n    %s\n" % (id, time.strftime("%Y-%m-%d %H:%M:%S UTC", t), username, hostname, message))
+    labels = get_tags(c, event_id)
+    if labels:
+      output.append("    [%s]\n" % (labels))
   return output
 
+def sync_entry(c, event_id, timestamp, hostname, username, message, size):
+  """An event as the client keeps it in its store: header lines, a blank
+  line, the message."""
+  lines = ["ts %d" % (timestamp), "host %s" % (hostname), "user %s" % (username)]
+  c.execute("SELECT key,value FROM tags WHERE event_id = ? ORDER BY key, value",
+    [event_id])
+  for (key, value) in c.fetchall():
+    lines.append("tag %s=%s" % (key, value))
+  if size is not None:
+    lines.append("log %d" % (size))
+  for (seq, offset, start_ms, duration_ms, exit, command) in get_commands(c, event_id):
+    lines.append("cmd %d\t%d\t%d\t%d\t%s" % (offset, start_ms, duration_ms, exit, escape_command(command)))
+  entry = "\n".join(lines) + "\n\n" + message
+  if isinstance(entry, unicode):
+    entry = entry.encode("utf-8")
+  return entry
+
+def process_sync(environ, start_response):
+  """The host's events after since, oldest first, each as "<id> <length>"
+  and its entry, streamed as they are read."""
+  form = cgi.FieldStorage(fp=environ['wsgi.input'],
+                          environ=environ)
+
+  secret = form.getfirst("secret", "")
+  if secret != SECRET_KEY:
+    start_response("403 Forbidden", [("content-type","text/plain")])
+    return ["Invalid Secret"]
+
+  conn = get_conn()
+  hostname = form.getfirst("hostname", "")
+  since = int(form.getfirst("since", 0))
+  # the primary key orders it, and ix_events_hostname narrows it to the host
+  events = conn.cursor()
+  events.execute("SELECT id,timestamp,hostname,username,message,length(script) FROM events WHERE hostname = ? AND id > ? ORDER BY id",
+    [hostname, since])
+  start_response("200 OK", [("content-type","text/plain")])
+  def stream():
+    c = conn.cursor()
+    yield "ckl-sync 1\n"
+    for (event_id, timestamp, hostname, username, message, size) in events:
+      entry = sync_entry(c, event_id, timestamp, hostname, username, message, size)
+      yield "%d %d\n%s" % (event_id, len(entry), entry)
+  return stream()
+
+# bytes read per step while looking for the first or last lines of a log
+WINDOW_STEP = 64 * 1024
+
+def script_size(c, event_id, column):
+  c.execute("SELECT length(" + column + ") FROM events WHERE id = ?",
+    [event_id])
+  return c.fetchone()[0] or 0
+
+def script_range(c, event_id, column, start, end):
+  """Bytes [start, end) of the log, without handing Python the rest."""
+  if end <= start:
+    return ""
+  c.execute("SELECT substr(" + column + ", ?, ?) FROM events WHERE id = ?",
+    [start + 1, end - start, event_id])
+  return str(c.fetchone()[0] or "")
+
+def script_window(c, event_id, column, size, head, tail, byte_range):
+  """(start, end) of the part of the log asked for: a byte range "a-b",
+  "a-" or "-n" (the last n bytes), or the first or last lines."""
+  if byte_range:
+    (a, b) = byte_range.split("-", 1)
+    if a == "":
+      return (max(0, size - int(b)), size)
+    if b == "":
+      return (min(int(a), size), size)
+    return (min(int(a), size), min(int(b) + 1, size))
+  # each step reads only the next 64k, carrying the count of lines found
+  if head > 0:
+    (end, seen) = (0, 0)
+    while end < size:
+      data = script_range(c, event_id, column, end, min(size, end + WINDOW_STEP))
+      pos = -1
+      while seen < head:
+        pos = data.find("\n", pos + 1)
+        if pos < 0:
+          break
+        seen += 1
+      if seen == head:
+        return (0, end + pos + 1)
+      end = min(size, end + WINDOW_STEP)
+    return (0, size)
+  if tail > 0 and size > 0:
+    # a newline ending the log does not start another line
+    start = size
+    if script_range(c, event_id, column, size - 1, size) == "\n":
+      start -= 1
+    seen = 0
+    while start > 0:
+      low = max(0, start - WINDOW_STEP)
+      data = script_range(c, event_id, column, low, start)
+      pos = len(data)
+      while seen < tail:
+        pos = data.rfind("\n", 0, pos)
+        if pos < 0:
+          break
+        seen += 1
+      if seen == tail:
+        return (low + pos + 1, size)
+      start = low
+    return (0, size)
+  return (0, size)
+
 def process_detail(environ, start_response):
   form = cgi.FieldStorage(fp=environ['wsgi.input'],
                           environ=environ)
@@ -116,16 +739,170 @@ def process_detail(environ, start_response):
   c = get_conn().cursor()
   hostname = form.getfirst("hostname", "")
   id = int(form.getfirst("id", 1))
-  c.execute("SELECT timestamp,hostname,username,message,script FROM events WHERE hostname = ? ORDER BY id DESC LIMIT 1 OFFSET ?",
-    [hostname, id-1])
-  start_response("200 OK", [("content-type","text/plain")])
+  # the log itself is only read in the window that is returned
+  event = int(form.getfirst("event", 0))
+  if event > 0:
+    # a client's store asks by event id, which does not move when other
+    # entries arrive the way the number does
+    c.execute("SELECT id,timestamp,hostname,username,message,script IS NOT NULL,script_raw IS NOT NULL FROM events WHERE id = ? AND hostname = ?",
+      [event, hostname])
+  else:
+    c.execute("SELECT id,timestamp,hostname,username,message,script IS NOT NULL,script_raw IS NOT NULL FROM events WHERE hostname = ? ORDER BY id DESC LIMIT 1 OFFSET ?",
+      [hostname, id-1])
+  row = c.fetchone()
+  if row is None:
+    start_response("200 OK", [("content-type","text/plain")])
+    return []
+  (event_id,timestamp,hostname,username,message,has_script,has_raw) = row
+  # raw=1 asks for the terminal stream as recorded, before normalizing.
+  # The column is named outright so length() needs only the record header
+  column = "script"
+  if form.getfirst("raw", "0") == "1" and has_raw:
+    (column, has_script) = ("script_raw", True)
+  if event > 0:
+    c.execute("SELECT count(*) FROM events WHERE hostname = ? AND id >= ?",
+      [hostname, event_id])
+    id = c.fetchone()[0]
+  size = script_size(c, event_id, column)
+  start_response("200 OK", [("content-type","text/plain"), ("x-script-size", str(size))])
   output = []
-  for row in c:
-    (timestamp,hostname,username,message,script) = row
-    t = time.gmtime(timestamp)
-    output.append("(%d) %s by %s on %s\n    %s\n%s\n" % (id, time.strftime("%Y-%m-%d %H:%M:%S UTC", t), username, hostname, message, script))
+  commands = get_commands(c, event_id)
+  t = time.gmtime(timestamp)
+  output.append("(%d) %s by %s on %s\n    %s\n" % (id, time.strftime("%Y-%m-%d %H:%M:%S UTC", t), username, hostname, message))
+  labels = get_tags(c, event_id)
+  if labels:
+    output.append("    [%s]\n" % (labels))
+  # cmd=N returns just the output of the Nth command of the session
+  cmd = int(form.getfirst("cmd", 0))
+  if cmd > 0 and has_script and column == "script":
+    for i in range(len(commands)):
+      if commands[i][0] == cmd:
+        end = size
+        if i + 1 < len(commands):
+          end = commands[i+1][1]
+        output.append("%s\n%s" % (format_command(commands[i]), script_range(c, event_id, column, commands[i][1], end)))
+    return output
+  # head=N, tail=N (lines) or range=a-b (bytes) return part of the log
+  head = int(form.getfirst("head", 0))
+  tail = int(form.getfirst("tail", 0))
+  byte_range = form.getfirst("range", "")
+  if has_script and (head > 0 or tail > 0 or byte_range):
+    (start, end) = script_window(c, event_id, column, size, head, tail, byte_range)
+    output.append("[script log: bytes %d-%d of %d]\n" % (start, max(start, end - 1), size))
+    output.append(script_range(c, event_id, column, start, end))
+    return output
+  for command in commands:
+    output.append("  %s\n" % (format_command(command)))
+  output.append("%s\n" % (script_range(c, event_id, column, 0, size) if has_script else None))
   return output
 
+def parse_at(s):
+  """Seconds from HH:MM:SS, MM:SS or plain seconds."""
+  seconds = 0
+  for part in s.split(":"):
+    seconds = seconds * 60 + int(part)
+  return seconds
+
+def replay_info(conn, event_id):
+  """(length, raw, newline) of the stream /replay feeds, as stored with the
+  event; worked out in sqlite once for events stored before that."""
+  c = conn.cursor()
+  c.execute("SELECT replay_len,replay_raw,replay_newline,script_raw IS NOT NULL FROM events WHERE id = ?",
+    [event_id])
+  (length, raw, newline, has_raw) = c.fetchone()
+  if length is None:
+    raw = int(has_raw)
+    column = "script_raw" if raw else "script"
+    c.execute("SELECT coalesce(length(" + column + "), 0), coalesce(instr(" + column + ", X'0D'), 0) = 0 FROM events WHERE id = ?",
+      [event_id])
+    (length, newline) = c.fetchone()
+    c.execute("UPDATE events SET replay_len = ?, replay_raw = ?, replay_newline = ? WHERE id = ?",
+      [length, raw, newline, event_id])
+    conn.commit()
+  return (length, raw, newline)
+
+def replay_keyframes(conn, event_id, column, newline):
+  """Builds the keyframes of a session on its first replay, the one time
+  the whole stream is read, so the upload does not wait for them."""
+  c = conn.cursor()
+  c.execute("SELECT " + column + " FROM events WHERE id = ?", [event_id])
+  (stream, raw) = replay_stream(c.fetchone()[0], None)
+  c.execute("SELECT time_ms,offset FROM marks WHERE event_id = ? ORDER BY time_ms",
+    [event_id])
+  for (ms, offset, screen) in build_keyframes(stream, c.fetchall(), newline):
+    c.execute("INSERT OR REPLACE INTO keyframes VALUES (?, ?, ?, ?)",
+      [event_id, offset, ms, buffer(screen)])
+  conn.commit()
+
+def process_replay(environ, start_response):
+  """The screen of session `id` (as numbered by /list, or `event` by its
+  id) at `at` into the session, or at byte `offset` of the replayed
+  stream.  Starts from the nearest keyframe and reads only the stream
+  after it, so the cost does not depend on where in the session that is.
+  keyframe=1 returns the keyframe and the bytes to apply to it instead,
+  for viewers with their own terminal."""
+  form = cgi.FieldStorage(fp=environ['wsgi.input'],
+                          environ=environ)
+
+  secret = form.getfirst("secret", "")
+  if secret != SECRET_KEY:
+    start_response("403 Forbidden", [("content-type","text/plain")])
+    return ["Invalid Secret"]
+
+  conn = get_conn()
+  c = conn.cursor()
+  hostname = form.getfirst("hostname", "")
+  id = int(form.getfirst("id", 1))
+  # event=N is the session by its id, as for /detail
+  event = int(form.getfirst("event", 0))
+  if event > 0:
+    c.execute("SELECT id FROM events WHERE id = ? AND hostname = ?",
+      [event, hostname])
+  else:
+    c.execute("SELECT id FROM events WHERE hostname = ? ORDER BY id DESC LIMIT 1 OFFSET ?",
+      [hostname, id-1])
+  row = c.fetchone()
+  if row is None:
+    start_response("404 Not Found", [("content-type","text/plain")])
+    return ["No such session\n"]
+  event_id = row[0]
+  (length, raw, newline) = replay_info(conn, event_id)
+  column = "script_raw" if raw else "script"
+
+  if form.has_key("at"):
+    c.execute("SELECT offset FROM marks WHERE event_id = ? AND time_ms <= ? ORDER BY time_ms DESC LIMIT 1",
+      [event_id, parse_at(form.getfirst("at")) * 1000])
+    mark = c.fetchone()
+    if mark is None:
+      c.execute("SELECT count(*) FROM marks WHERE event_id = ?", [event_id])
+      if c.fetchone()[0] == 0:
+        start_response("404 Not Found", [("content-type","text/plain")])
+        return ["Session has no timing, it was recorded without ckl_script_commands\n"]
+      mark = (0,)
+    target = mark[0]
+  else:
+    target = int(form.getfirst("offset", length))
+  target = max(0, min(target, length))
+
+  query = "SELECT offset,time_ms,screen FROM keyframes WHERE event_id = ? AND offset <= ? ORDER BY offset DESC LIMIT 1"
+  c.execute(query, [event_id, target])
+  frame = c.fetchone()
+  if frame is None:
+    replay_keyframes(conn, event_id, column, newline)
+    c.execute(query, [event_id, target])
+    frame = c.fetchone()
+  (offset, time_ms, snapshot) = frame
+  data = script_range(c, event_id, column, offset, target)
+
+  start_response("200 OK", [("content-type","text/plain")])
+  if form.getfirst("keyframe", "0") == "1":
+    return ["keyframe %d %d %d\n%s\n\n" % (offset, time_ms, target - offset, str(snapshot)),
+            data]
+  screen = Screen(newline=bool(newline))
+  screen.load(str(snapshot))
+  screen.feed(data)
+  return [screen.text()]
+
 def mainapp(environ, start_response):
   meth = environ.get('REQUEST_METHOD', 'GET')
   pi = environ.get('PATH_INFO')
@@ -133,6 +910,10 @@ def mainapp(environ, start_response):
     return process_list(environ, start_response)
   if meth == "POST" and pi == "/detail":
     return process_detail(environ, start_response)
+  if meth == "POST" and pi == "/replay":
+    return process_replay(environ, start_response)
+  if meth == "POST" and pi == "/sync":
+    return process_sync(environ, start_response)
   if meth == "POST":
     return process_post(environ, start_response)
   c = get_conn().cursor()
@@ -140,10 +921,10 @@ def mainapp(environ, start_response):
                         environ=environ)
   s = form.getfirst("hostname")
   if s and len(s) > 0:
-    c.execute("SELECT timestamp,hostname,username,message,script FROM events WHERE hostname = ? ORDER BY id DESC LIMIT 500",
+    c.execute("SELECT id,timestamp,hostname,username,message,script FROM events WHERE hostname = ? ORDER BY id DESC LIMIT 500",
       [s])
   else:
-    c.execute("SELECT timestamp,hostname,username,message,script FROM events ORDER BY id DESC LIMIT 500")
+    c.execute("SELECT id,timestamp,hostname,username,message,script FROM events ORDER BY id DESC LIMIT 500")
     s = 'all servers'
   start_response("200 OK", [("content-type","text/html")])
   output = ["<h1>server changelog for %s:</h1>\n" % (s)]
@@ -151,6 +932,13 @@ def mainapp(environ, start_response):
   function unhide(id) {
     document.getElementById('script_'+ id).style.display = 'inline';
   }
+  function seek(id, offset) {
+    var t = document.getElementById('script_'+ id);
+    unhide(id);
+    t.focus();
+    t.setSelectionRange(offset, offset);
+    t.scrollTop = t.scrollHeight * offset / t.value.length;
+  }
   </script>""")
   cserv = get_conn().cursor()
   cserv.execute("SELECT DISTINCT hostname FROM events ORDER BY hostname");
@@ -159,15 +947,22 @@ def mainapp(environ, start_response):
   for row in cserv:
     output.append("<option value='%s'>%s</option>" % (row[0], row[0]))
   output.append("</select><input type='submit' value='Go'></p></form>")
+  ccmd = get_conn().cursor()
   id = 0
   for row in c:
     id = id + 1
-    (timestamp,hostname,username,message,script) = row
+    (event_id,timestamp,hostname,username,message,script) = row
     t = time.gmtime(timestamp)
     output.append("<hr><code>%s by %s on <a href='?hostname=%s'>%s</a></code><br/><pre>  %s</pre>\n" % (time.strftime("%Y-%m-%d %H:%M:%S UTC", t), username, hostname, hostname, message))
     if script != None and len(script) > 1:
+      commands = get_commands(ccmd, event_id)
+      if len(commands) > 0:
+        output.append("<pre>")
+        for command in commands:
+          output.append("  <a href='javascript:seek(%d, %d)'>%s</a>\n" % (id, command[1], cgi.escape(format_command(command))))
+        output.append("</pre>")
       output.append("<a href='javascript:unhide(%d)'>script log available</a>"% (id))
-      output.append("<br><textarea style='display: none' id='script_%d' rows='15' cols='100'>%s</textarea>\n" % (id, script))
+      output.append("<br><textarea style='display: none' id='script_%d' rows='15' cols='100'>%s</textarea>\n" % (id, cgi.escape(str(script))))
   return output
 
 def main(environ, start_response):